@@ -0,0 +1,289 @@
+/*
+ * falbench: benchmark of libfal2muc with synthetic sound data
+ *
+ * Copyright (c) 2019 Hirokuni Yano
+ *
+ * Released under the MIT license.
+ * see https://opensource.org/licenses/MIT
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fal2muc.h"
+#include "gen.h"
+
+typedef struct
+{
+    const char *name;
+    DRIVER_TYPE type;
+    GEN_FORMAT format;
+    uint32_t first_ch;		/* channels parsed by the parse stage */
+    uint32_t last_ch;
+} BENCH_DRIVER;
+
+static const BENCH_DRIVER g_driver[] = {
+    {"opn",		DRIVER_TYPE_OPN,			GEN_FORMAT_OPN,			0, 5},
+    {"opna",	DRIVER_TYPE_OPNA,			GEN_FORMAT_OPNA,		0, 8},
+    {"opnar",	DRIVER_TYPE_OPNA_RHYTHM,	GEN_FORMAT_OPNA_RHYTHM,	0, 9},
+    {"va",		DRIVER_TYPE_OPNA_VA,		GEN_FORMAT_VA,			0, 8},
+    {"mono",	DRIVER_TYPE_OPNA_MONO,		GEN_FORMAT_OPNA,		3, 8},
+    {"x1opm",	DRIVER_TYPE_X1_OPM,			GEN_FORMAT_X1,			0, 8},
+    {"x1psg",	DRIVER_TYPE_X1_PSG,			GEN_FORMAT_X1,			3, 5},
+};
+
+#define BENCH_DRIVER_COUNT (sizeof(g_driver) / sizeof(g_driver[0]))
+
+typedef enum
+{
+    STAGE_DETECT,
+    STAGE_PARSE,
+    STAGE_EMIT,
+    STAGE_TOTAL,
+    STAGE_COUNT,
+} STAGE;
+
+static const char *g_stage_name[STAGE_COUNT] = {
+    "detect", "parse", "emit", "total",
+};
+
+typedef struct
+{
+    double time[STAGE_COUNT];
+    uint64_t songs;
+    uint64_t in_bytes;
+    uint64_t out_bytes;
+} RESULT;
+
+void help(void)
+{
+    fprintf(stderr, "Usage: falbench [option(s)]\n");
+    fprintf(stderr, "  -h\t\tprint this help message and exit\n");
+    fprintf(stderr, "  -n SONGS\tsongs per driver type (default: 100)\n");
+    fprintf(stderr, "  -e EVENTS\tevents per channel (default: 400)\n");
+    fprintf(stderr, "  -r REPEAT\trepeat count (default: 5)\n");
+    fprintf(stderr, "  -s SEED\tfirst random seed (default: 1)\n");
+    exit(1);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static size_t null_write(void *opaque, const void *buf, size_t size)
+{
+    (void)buf;
+    *(uint64_t *)opaque += size;
+
+    return size;
+}
+
+static uint32_t get_word(const uint8_t *p)
+{
+    return (uint32_t)p[0] + ((uint32_t)p[1] << 8);
+}
+
+/* parse all channels as convert_data() does, without emitting */
+static void parse_song(fal2muc_ctx *ctx, const BENCH_DRIVER *drv, const fal2muc_input *song,
+                       const fal2muc_sink *sink)
+{
+    const uint8_t *data = fal2muc_ctx_begin(ctx, song->data, song->size, drv->type, sink);
+    uint32_t end, clock, deflen;
+
+    for (uint32_t ch = drv->first_ch; ch <= drv->last_ch; ch++)
+    {
+        parse_music(ctx, data, get_word(&data[ch * 2]),
+                    ctx->loop_flag, ctx->loop_nest, &end, &clock, &deflen);
+    }
+}
+
+static void run(const BENCH_DRIVER *drv, fal2muc_input *song, uint32_t nsongs,
+                uint32_t repeat, RESULT *res)
+{
+    fal2muc_option opt;
+    fal2muc_ctx *ctx;
+    fal2muc_sink sink;
+    uint64_t out_bytes = 0;
+    volatile DRIVER_TYPE detected;
+    double t;
+
+    memset(&opt, 0, sizeof(opt));
+    opt.driver_type = drv->type;
+    ctx = fal2muc_ctx_new(&opt);
+    if (ctx == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    sink.write = null_write;
+    sink.opaque = &out_bytes;
+
+    memset(res, 0, sizeof(*res));
+    for (uint32_t r = 0; r < repeat; r++)
+    {
+        t = now();
+        for (uint32_t i = 0; i < nsongs; i++)
+        {
+            detected = detect_driver_type(song[i].data);
+        }
+        res->time[STAGE_DETECT] += now() - t;
+
+        t = now();
+        for (uint32_t i = 0; i < nsongs; i++)
+        {
+            parse_song(ctx, drv, &song[i], &sink);
+        }
+        res->time[STAGE_PARSE] += now() - t;
+
+        /* conversion with the forced driver type, detection is not included */
+        t = now();
+        for (uint32_t i = 0; i < nsongs; i++)
+        {
+            if (fal2muc_convert_input(ctx, &song[i], &sink) != FAL2MUC_OK)
+            {
+                fprintf(stderr, "%s: song %u failed\n", drv->name, i);
+                exit(1);
+            }
+        }
+        res->time[STAGE_TOTAL] += now() - t;
+
+        for (uint32_t i = 0; i < nsongs; i++)
+        {
+            res->in_bytes += song[i].size;
+        }
+        res->songs += nsongs;
+    }
+    (void)detected;
+
+    /* emission is what remains after parsing */
+    res->time[STAGE_EMIT] = res->time[STAGE_TOTAL] - res->time[STAGE_PARSE];
+    if (res->time[STAGE_EMIT] < 0)
+    {
+        res->time[STAGE_EMIT] = 0;
+    }
+    res->time[STAGE_TOTAL] += res->time[STAGE_DETECT];
+    res->out_bytes = out_bytes;
+
+    fal2muc_ctx_free(ctx);
+}
+
+static void report(const char *name, const RESULT *res)
+{
+    printf("%-8s %6llu %8.1f", name,
+           (unsigned long long)res->songs, (double)res->out_bytes / 1024 / 1024);
+    for (uint32_t s = 0; s < STAGE_COUNT; s++)
+    {
+        double t = (res->time[s] > 0) ? res->time[s] : 1e-9;
+
+        printf(" %11.0f %8.1f", (double)res->songs / t, (double)res->in_bytes / t / 1024 / 1024);
+    }
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int c;
+    uint32_t nsongs = 100;
+    uint32_t events = 400;
+    uint32_t repeat = 5;
+    uint32_t seed = 1;
+    fal2muc_input *song;
+    RESULT res;
+    RESULT sum;
+
+    while ((c = getopt(argc, argv, "n:e:r:s:")) != -1)
+    {
+        switch (c)
+        {
+        case 'n':
+            nsongs = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+        case 'e':
+            events = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            repeat = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            seed = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+        default:
+            help();
+            break;
+        }
+    }
+    if (nsongs == 0 || repeat == 0)
+    {
+        help();
+    }
+
+    song = calloc(nsongs, sizeof(fal2muc_input));
+    if (song == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    printf("%u songs x %u events/ch x %u times\n", nsongs, events, repeat);
+    printf("%-8s %6s %8s", "driver", "songs", "MML(MB)");
+    for (uint32_t s = 0; s < STAGE_COUNT; s++)
+    {
+        printf(" %11s %8s", g_stage_name[s], "MB/s");
+    }
+    printf("\n");
+
+    memset(&sum, 0, sizeof(sum));
+    for (uint32_t d = 0; d < BENCH_DRIVER_COUNT; d++)
+    {
+        /* song images are readable up to FAL2MUC_VIEW_SIZE as mapped files are */
+        for (uint32_t i = 0; i < nsongs; i++)
+        {
+            uint8_t *buf = calloc(1, FAL2MUC_VIEW_SIZE);
+
+            if (buf == NULL)
+            {
+                fprintf(stderr, "Out of memory\n");
+                return 1;
+            }
+            song[i].data = buf;
+            song[i].size = gen_generate(g_driver[d].format, seed + i, events,
+                                        buf, FAL2MUC_BUFF_SIZE);
+            if (song[i].size == 0)
+            {
+                fprintf(stderr, "Too many events\n");
+                return 1;
+            }
+        }
+
+        run(&g_driver[d], song, nsongs, repeat, &res);
+        report(g_driver[d].name, &res);
+
+        for (uint32_t s = 0; s < STAGE_COUNT; s++)
+        {
+            sum.time[s] += res.time[s];
+        }
+        sum.songs += res.songs;
+        sum.in_bytes += res.in_bytes;
+        sum.out_bytes += res.out_bytes;
+
+        for (uint32_t i = 0; i < nsongs; i++)
+        {
+            free((void *)song[i].data);
+        }
+    }
+    report("all", &sum);
+
+    free(song);
+
+    return 0;
+}
@@ -0,0 +1,114 @@
+/*
+ * falgen: write synthetic Falcom sound data
+ *
+ * Copyright (c) 2019 Hirokuni Yano
+ *
+ * Released under the MIT license.
+ * see https://opensource.org/licenses/MIT
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "gen.h"
+
+static uint8_t g_buff[0x10000];
+
+void help(void)
+{
+    fprintf(stderr, "Usage: falgen [option(s)]\n");
+    fprintf(stderr, "  -h\t\tprint this help message and exit\n");
+    fprintf(stderr, "  -F FORMAT\tformat (opn, opna, opnar, va, x1)\n");
+    fprintf(stderr, "  -s SEED\trandom seed (default: 1)\n");
+    fprintf(stderr, "  -e EVENTS\tevents per channel (default: 200)\n");
+    fprintf(stderr, "  -o FILE\toutput file (default: stdout)\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int c;
+    const char *outfile = NULL;
+    GEN_FORMAT format = GEN_FORMAT_OPN;
+    uint32_t seed = 1;
+    uint32_t events = 200;
+    uint32_t size;
+    FILE *fp;
+    const struct {
+        const char *name;
+        GEN_FORMAT format;
+    } format_table[] = {
+        {"opn",		GEN_FORMAT_OPN			},
+        {"opna",	GEN_FORMAT_OPNA			},
+        {"opnar",	GEN_FORMAT_OPNA_RHYTHM	},
+        {"va",		GEN_FORMAT_VA			},
+        {"x1",		GEN_FORMAT_X1			},
+        {NULL,		GEN_FORMAT_OPN			},
+    };
+
+    while ((c = getopt(argc, argv, "F:s:e:o:")) != -1)
+    {
+        switch (c)
+        {
+        case 'F':
+            for (int i = 0; ; i++)
+            {
+                if (format_table[i].name == NULL)
+                {
+                    help();
+                }
+                if (strcmp(optarg, format_table[i].name) == 0)
+                {
+                    format = format_table[i].format;
+                    break;
+                }
+            }
+            break;
+        case 's':
+            seed = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+        case 'e':
+            events = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+        case 'o':
+            outfile = optarg;
+            break;
+        default:
+            help();
+            break;
+        }
+    }
+    if (optind != argc)
+    {
+        help();
+    }
+
+    size = gen_generate(format, seed, events, g_buff, sizeof(g_buff));
+    if (size == 0)
+    {
+        fprintf(stderr, "Too many events\n");
+        return 1;
+    }
+
+    fp = (outfile != NULL) ? fopen(outfile, "wb") : stdout;
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Can't open '%s'\n", outfile);
+        return 1;
+    }
+    if (fwrite(g_buff, sizeof(uint8_t), size, fp) != size)
+    {
+        fprintf(stderr, "Can't write\n");
+        return 1;
+    }
+    if (outfile != NULL)
+    {
+        fclose(fp);
+    }
+
+    return 0;
+}
@@ -0,0 +1,375 @@
+/*
+ * gen: synthetic Falcom sound data generator
+ *
+ * Copyright (c) 2019 Hirokuni Yano
+ *
+ * Released under the MIT license.
+ * see https://opensource.org/licenses/MIT
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gen.h"
+
+#define GEN_LOOP_NEST_MAX (3)
+
+typedef struct
+{
+    uint8_t *buf;
+    uint32_t size;
+    uint32_t pos;
+    uint32_t rand;
+    bool overflow;
+} GEN;
+
+typedef enum
+{
+    GEN_CH_FM,
+    GEN_CH_OPM,
+    GEN_CH_SSG,
+    GEN_CH_RHYTHM,
+} GEN_CH;
+
+static uint32_t gen_rand(GEN *g, uint32_t n)
+{
+    /* xorshift32: same sequence on every platform */
+    g->rand ^= g->rand << 13;
+    g->rand ^= g->rand >> 17;
+    g->rand ^= g->rand << 5;
+
+    return (n == 0) ? 0 : g->rand % n;
+}
+
+static void gen_byte(GEN *g, uint32_t v)
+{
+    if (g->pos >= g->size)
+    {
+        g->overflow = true;
+        return;
+    }
+    g->buf[g->pos++] = (uint8_t)v;
+}
+
+static void gen_word(GEN *g, uint32_t v)
+{
+    gen_byte(g, v);
+    gen_byte(g, v >> 8);
+}
+
+static void gen_put_word(GEN *g, uint32_t pos, uint32_t v)
+{
+    if (pos + 1 < g->size)
+    {
+        g->buf[pos + 0] = (uint8_t)v;
+        g->buf[pos + 1] = (uint8_t)(v >> 8);
+    }
+}
+
+static uint32_t gen_length(GEN *g, uint32_t clock)
+{
+    static const uint32_t div[] = {1, 2, 4, 8, 16, 32};
+    uint32_t len;
+
+    switch (gen_rand(g, 10))
+    {
+    case 0:
+        /* dotted */
+        len = clock / div[1 + gen_rand(g, 4)];
+        len = len + len / 2;
+        break;
+    case 1:
+        /* odd length, printed as %n */
+        len = 1 + gen_rand(g, 0x60);
+        break;
+    default:
+        len = clock / div[2 + gen_rand(g, 3)];
+        break;
+    }
+    if (len == 0)
+    {
+        len = 1;
+    }
+    if (len > 0x7f)
+    {
+        len = 0x60;
+    }
+
+    return len;
+}
+
+static uint32_t gen_note(GEN *g, GEN_CH type)
+{
+    if (type == GEN_CH_OPM)
+    {
+        /* X1 OPM key code, must be lower than 0x60 */
+        return 0x18 + gen_rand(g, 0x30);
+    }
+
+    return ((2 + gen_rand(g, 4)) << 4) | gen_rand(g, 12);
+}
+
+static void gen_command(GEN *g, GEN_CH type, uint32_t ninst)
+{
+    switch (gen_rand(g, 14))
+    {
+    case 0:
+        gen_byte(g, 0xf0);
+        gen_byte(g, (type == GEN_CH_SSG) ? gen_rand(g, 12) : gen_rand(g, ninst));
+        break;
+    case 1:
+        gen_byte(g, 0xf1);
+        gen_byte(g, (type == GEN_CH_SSG) ? gen_rand(g, 16) : 8 + gen_rand(g, 8));
+        break;
+    case 2:
+        gen_byte(g, 0xf2);
+        gen_byte(g, gen_rand(g, 8));
+        break;
+    case 3:
+        gen_byte(g, 0xf3);
+        gen_byte(g, gen_rand(g, 16) - 8);
+        break;
+    case 4:
+        gen_byte(g, 0xf4);
+        gen_byte(g, gen_rand(g, 256));
+        break;
+    case 5:
+        gen_byte(g, 0xf5);
+        gen_byte(g, 200 + gen_rand(g, 3) * 8);
+        break;
+    case 6:
+        gen_byte(g, 0xf7);
+        gen_byte(g, gen_rand(g, 16));
+        gen_byte(g, 1 + gen_rand(g, 4));
+        gen_word(g, gen_rand(g, 64) - 32);
+        gen_byte(g, gen_rand(g, 256));
+        break;
+    case 7:
+        gen_byte(g, 0xf8);
+        gen_byte(g, (gen_rand(g, 4) == 0) ? 0x20 : 0x10);
+        gen_byte(g, gen_rand(g, 2));
+        break;
+    case 8:
+        gen_byte(g, 0xf9);
+        for (uint32_t i = 0; i < 6; i++)
+        {
+            gen_byte(g, gen_rand(g, 256));
+        }
+        break;
+    case 9:
+        gen_byte(g, 0xfa);
+        gen_byte(g, 0x30 + gen_rand(g, 0x60));
+        gen_byte(g, gen_rand(g, 256));
+        break;
+    case 10:
+        gen_byte(g, 0xfe);
+        gen_byte(g, gen_rand(g, 4) << 6);
+        break;
+    default:
+        break;
+    }
+}
+
+static void gen_event(GEN *g, GEN_CH type, uint32_t clock, uint32_t ninst)
+{
+    uint32_t note;
+
+    switch (gen_rand(g, 16))
+    {
+    case 0:
+    case 1:
+    case 2:
+        gen_byte(g, 0x80 | gen_length(g, clock));
+        break;
+    case 3:
+        /* long tone: 0x6f + tie + same note */
+        note = gen_note(g, type);
+        gen_byte(g, 0x6f);
+        gen_byte(g, note | 0x80);
+        gen_byte(g, gen_length(g, clock));
+        gen_byte(g, note);
+        break;
+    case 4:
+    case 5:
+    case 6:
+        gen_command(g, type, ninst);
+        break;
+    default:
+        gen_byte(g, gen_length(g, clock));
+        gen_byte(g, gen_note(g, type) | ((gen_rand(g, 8) == 0) ? 0x80 : 0x00));
+        break;
+    }
+}
+
+static void gen_block(GEN *g, GEN_CH type, uint32_t clock, uint32_t ninst,
+                      uint32_t events, uint32_t nest)
+{
+    uint32_t i;
+
+    for (i = 0; i < events && !g->overflow; i++)
+    {
+        if (nest < GEN_LOOP_NEST_MAX && gen_rand(g, 24) == 0)
+        {
+            uint32_t start = g->pos;
+            uint32_t body = 2 + gen_rand(g, 8);
+            uint32_t exit_pos = UINT32_MAX;
+
+            gen_block(g, type, clock, ninst, body / 2, nest + 1);
+            if (gen_rand(g, 3) == 0)
+            {
+                /* '/' loop exit, patched after the loop end */
+                gen_byte(g, 0xfd);
+                exit_pos = g->pos;
+                gen_word(g, 0);
+            }
+            gen_block(g, type, clock, ninst, body - body / 2, nest + 1);
+            gen_byte(g, 0xf6);
+            gen_byte(g, 2 + gen_rand(g, 3));
+            gen_byte(g, 0x00);
+            gen_word(g, g->pos + 2 - start);
+            if (exit_pos != UINT32_MAX)
+            {
+                gen_put_word(g, exit_pos, g->pos - (exit_pos + 2));
+            }
+            i += body;
+        }
+        else
+        {
+            gen_event(g, type, clock, ninst);
+        }
+    }
+}
+
+static void gen_channel(GEN *g, GEN_CH type, uint32_t ninst, uint32_t events)
+{
+    static const uint32_t clocks[] = {192, 144, 128, 112};
+    uint32_t clock = clocks[gen_rand(g, 4)];
+    uint32_t loop;
+
+    if (type == GEN_CH_RHYTHM)
+    {
+        gen_byte(g, 0xf0);
+        gen_byte(g, 1 + gen_rand(g, 0x3f));
+        gen_byte(g, 0xf1);
+        gen_byte(g, gen_rand(g, 16));
+    }
+    else
+    {
+        gen_byte(g, 0xf5);
+        gen_byte(g, 200);
+        gen_byte(g, 0xf0);
+        gen_byte(g, (type == GEN_CH_SSG) ? gen_rand(g, 12) : gen_rand(g, ninst));
+    }
+
+    gen_block(g, type, clock, ninst, events / 4, 0);
+    loop = g->pos;
+    gen_block(g, type, clock, ninst, events - events / 4, 0);
+
+    gen_byte(g, 0xff);
+    if (gen_rand(g, 4) == 0)
+    {
+        gen_word(g, 0);
+    }
+    else
+    {
+        gen_word(g, g->pos + 2 - loop);
+    }
+}
+
+static void gen_inst(GEN *g, uint32_t ninst)
+{
+    for (uint32_t i = 0; i < ninst * 0x20; i++)
+    {
+        gen_byte(g, gen_rand(g, 256));
+    }
+}
+
+/* generate a song image with the channel layout of the given driver */
+static void gen_song(GEN *g, uint32_t base, uint32_t inst_offset,
+                     const GEN_CH *types, uint32_t nch, uint32_t ninst, uint32_t events)
+{
+    uint32_t ch;
+
+    g->pos = base + inst_offset;
+    gen_inst(g, ninst);
+
+    for (ch = 0; ch < nch; ch++)
+    {
+        gen_put_word(g, base + ch * 2, g->pos - base);
+        gen_channel(g, types[ch], ninst, events);
+    }
+}
+
+uint32_t gen_generate(GEN_FORMAT format, uint32_t seed, uint32_t events,
+                      uint8_t *buf, uint32_t size)
+{
+    static const GEN_CH opn[] = {
+        GEN_CH_FM, GEN_CH_FM, GEN_CH_FM, GEN_CH_SSG, GEN_CH_SSG, GEN_CH_SSG,
+    };
+    static const GEN_CH opna[] = {
+        GEN_CH_FM, GEN_CH_FM, GEN_CH_FM, GEN_CH_FM, GEN_CH_FM, GEN_CH_FM,
+        GEN_CH_SSG, GEN_CH_SSG, GEN_CH_SSG,
+    };
+    static const GEN_CH va[] = {
+        GEN_CH_FM, GEN_CH_FM, GEN_CH_FM, GEN_CH_SSG, GEN_CH_SSG, GEN_CH_SSG,
+        GEN_CH_FM, GEN_CH_FM, GEN_CH_FM,
+    };
+    static const GEN_CH x1[] = {
+        GEN_CH_OPM, GEN_CH_OPM, GEN_CH_OPM, GEN_CH_SSG, GEN_CH_SSG, GEN_CH_SSG,
+        GEN_CH_OPM, GEN_CH_OPM, GEN_CH_OPM,
+    };
+    GEN g;
+    uint32_t ninst;
+    uint32_t sub;
+
+    memset(buf, 0, size);
+    g.buf = buf;
+    g.size = size;
+    g.pos = 0;
+    g.rand = (seed == 0) ? 0x12345678 : seed;
+    g.overflow = false;
+
+    ninst = 1 + gen_rand(&g, 16);
+
+    switch (format)
+    {
+    case GEN_FORMAT_OPN:
+        gen_song(&g, 0x0000, 0x0010, opn, 6, ninst, events);
+        break;
+    case GEN_FORMAT_OPNA:
+    case GEN_FORMAT_OPNA_RHYTHM:
+        gen_song(&g, 0x0000, 0x0020, opna, 9, ninst, events);
+        gen_put_word(&g, 9 * 2, g.pos);
+        if (format == GEN_FORMAT_OPNA)
+        {
+            gen_byte(&g, 0xff);
+            gen_word(&g, 0);
+        }
+        else
+        {
+            gen_channel(&g, GEN_CH_RHYTHM, ninst, events);
+        }
+        break;
+    case GEN_FORMAT_VA:
+        gen_song(&g, 0x0000, 0x0020, va, 9, ninst, events);
+        break;
+    case GEN_FORMAT_X1:
+        gen_song(&g, 0x0000, 0x0020, x1, 9, ninst, events);
+        /* PSG only sub song for X1 without OPM */
+        sub = g.pos;
+        gen_put_word(&g, 0x001a, sub);
+        gen_put_word(&g, sub, 0x0010);
+        g.pos = sub + 0x0010;
+        for (uint32_t ch = 3; ch < 6; ch++)
+        {
+            gen_put_word(&g, sub + ch * 2, g.pos - sub);
+            gen_channel(&g, GEN_CH_SSG, 0, events);
+        }
+        break;
+    }
+
+    return g.overflow ? 0 : g.pos;
+}
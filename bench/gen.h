@@ -0,0 +1,33 @@
+/*
+ * gen: synthetic Falcom sound data generator
+ *
+ * Copyright (c) 2019 Hirokuni Yano
+ *
+ * Released under the MIT license.
+ * see https://opensource.org/licenses/MIT
+ */
+
+#ifndef BENCH_GEN_H
+#define BENCH_GEN_H
+
+#include <stdint.h>
+
+typedef enum
+{
+    GEN_FORMAT_OPN,
+    GEN_FORMAT_OPNA,
+    GEN_FORMAT_OPNA_RHYTHM,
+    GEN_FORMAT_VA,
+    GEN_FORMAT_X1,
+} GEN_FORMAT;
+
+/*
+ * generate a valid song image from seed.
+ * each channel has about events notes/rests/commands with nested loops,
+ * loop exits, long tones and a loop-back at the end.
+ * returns the image size, or 0 if it doesn't fit in the buffer.
+ */
+uint32_t gen_generate(GEN_FORMAT format, uint32_t seed, uint32_t events,
+                      uint8_t *buf, uint32_t size);
+
+#endif /* BENCH_GEN_H */
@@ -0,0 +1,184 @@
+/*
+ * d88: D88 disk image reader
+ *
+ * Copyright (c) 2019 Hirokuni Yano
+ *
+ * Released under the MIT license.
+ * see https://opensource.org/licenses/MIT
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "d88.h"
+
+static uint32_t get_word(const uint8_t *p)
+{
+    return (uint32_t)p[0] + ((uint32_t)p[1] << 8);
+}
+
+static uint32_t get_dword(const uint8_t *p)
+{
+    return get_word(p) + (get_word(p + 2) << 16);
+}
+
+static int compare_sector(const void *a, const void *b)
+{
+    const D88_SECTOR *sa = a;
+    const D88_SECTOR *sb = b;
+
+    if (sa->track != sb->track)
+    {
+        return (sa->track < sb->track) ? -1 : 1;
+    }
+    if (sa->r != sb->r)
+    {
+        return (sa->r < sb->r) ? -1 : 1;
+    }
+    /* keep the order in the image for duplicated IDs */
+    return (sa->offset < sb->offset) ? -1 : (sa->offset > sb->offset);
+}
+
+bool d88_parse(D88 *d88, const uint8_t *image, size_t size)
+{
+    uint32_t ntrack = D88_TRACK_MAX;
+    uint32_t track;
+    uint32_t size_max = 0;
+    size_t offset;
+    size_t linear;
+
+    memset(d88, 0, sizeof(*d88));
+    if (size < D88_HEADER_SIZE)
+    {
+        return false;
+    }
+
+    memcpy(d88->name, image, 16);
+    d88->protect = image[0x1a];
+    d88->media = image[0x1b];
+    d88->disk_size = get_dword(&image[0x1c]);
+    if (d88->disk_size < D88_HEADER_SIZE || d88->disk_size > size)
+    {
+        return false;
+    }
+
+    /* some images have a shorter track table */
+    for (track = 0; track < ntrack; track++)
+    {
+        offset = get_dword(&image[0x20 + track * 4]);
+        if (offset != 0 && offset < D88_HEADER_SIZE)
+        {
+            if (offset < 0x20 + (size_t)(track + 1) * 4)
+            {
+                return false;
+            }
+            ntrack = (uint32_t)((offset - 0x20) / 4);
+        }
+    }
+
+    for (track = 0; track < ntrack; track++)
+    {
+        uint32_t nsec;
+        uint32_t i;
+
+        offset = get_dword(&image[0x20 + track * 4]);
+        if (offset == 0)
+        {
+            continue;
+        }
+        if (offset + D88_SECTOR_HEADER_SIZE > d88->disk_size)
+        {
+            d88_free(d88);
+            return false;
+        }
+        nsec = get_word(&image[offset + 4]);
+        for (i = 0; i < nsec; i++)
+        {
+            const uint8_t *h = &image[offset];
+            D88_SECTOR *s;
+
+            if (offset + D88_SECTOR_HEADER_SIZE > d88->disk_size
+                || offset + D88_SECTOR_HEADER_SIZE + get_word(&h[0x0e]) > d88->disk_size)
+            {
+                d88_free(d88);
+                return false;
+            }
+            if (d88->count == size_max)
+            {
+                size_max = (size_max == 0) ? 64 : size_max * 2;
+                s = realloc(d88->sector, sizeof(D88_SECTOR) * size_max);
+                if (s == NULL)
+                {
+                    d88_free(d88);
+                    return false;
+                }
+                d88->sector = s;
+            }
+            s = &d88->sector[d88->count++];
+            s->c = h[0];
+            s->h = h[1];
+            s->r = h[2];
+            s->n = h[3];
+            s->deleted = h[7];
+            s->status = h[8];
+            s->track = track;
+            s->size = get_word(&h[0x0e]);
+            s->offset = offset + D88_SECTOR_HEADER_SIZE;
+            offset = s->offset + s->size;
+        }
+    }
+
+    qsort(d88->sector, d88->count, sizeof(D88_SECTOR), compare_sector);
+
+    linear = 0;
+    for (uint32_t i = 0; i < d88->count; i++)
+    {
+        d88->sector[i].linear = linear;
+        linear += d88->sector[i].size;
+    }
+    d88->data_size = linear;
+
+    return true;
+}
+
+void d88_free(D88 *d88)
+{
+    free(d88->sector);
+    d88->sector = NULL;
+    d88->count = 0;
+}
+
+uint8_t *d88_linearize(const D88 *d88, const uint8_t *image, size_t pad)
+{
+    uint8_t *buf = malloc(d88->data_size + pad);
+
+    if (buf == NULL)
+    {
+        return NULL;
+    }
+    for (uint32_t i = 0; i < d88->count; i++)
+    {
+        memcpy(&buf[d88->sector[i].linear], &image[d88->sector[i].offset], d88->sector[i].size);
+    }
+    memset(&buf[d88->data_size], 0, pad);
+
+    return buf;
+}
+
+const D88_SECTOR *d88_find_sector(const D88 *d88, uint8_t c, uint8_t h, uint8_t r)
+{
+    for (uint32_t i = 0; i < d88->count; i++)
+    {
+        const D88_SECTOR *s = &d88->sector[i];
+
+        if (s->c == c && s->h == h && s->r == r)
+        {
+            return s;
+        }
+    }
+
+    return NULL;
+}
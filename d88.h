@@ -0,0 +1,60 @@
+/*
+ * d88: D88 disk image reader
+ *
+ * Copyright (c) 2019 Hirokuni Yano
+ *
+ * Released under the MIT license.
+ * see https://opensource.org/licenses/MIT
+ */
+
+#ifndef D88_H
+#define D88_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define D88_HEADER_SIZE (0x02b0)
+#define D88_SECTOR_HEADER_SIZE (0x0010)
+#define D88_TRACK_MAX (164)
+
+typedef struct
+{
+    uint8_t c;
+    uint8_t h;
+    uint8_t r;
+    uint8_t n;
+    uint8_t deleted;
+    uint8_t status;
+    uint32_t track;				/* index in the track table */
+    uint32_t size;				/* data size */
+    size_t offset;				/* data offset in the image */
+    size_t linear;				/* data offset in d88_linearize() */
+} D88_SECTOR;
+
+/* one disk in an image file */
+typedef struct
+{
+    char name[17];
+    uint8_t protect;
+    uint8_t media;
+    size_t disk_size;
+    D88_SECTOR *sector;			/* in track and sector number order */
+    uint32_t count;
+    size_t data_size;			/* sum of sector data */
+} D88;
+
+/* parse a disk at the start of image, returns false if it's not a D88 image */
+bool d88_parse(D88 *d88, const uint8_t *image, size_t size);
+void d88_free(D88 *d88);
+
+/*
+ * concatenate the data of all sectors in order.
+ * pad zero bytes are added after the data, free() the result.
+ */
+uint8_t *d88_linearize(const D88 *d88, const uint8_t *image, size_t pad);
+
+/* find a sector by its ID, returns NULL if not found */
+const D88_SECTOR *d88_find_sector(const D88 *d88, uint8_t c, uint8_t h, uint8_t r);
+
+#endif /* D88_H */
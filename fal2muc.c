@@ -12,796 +12,1390 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <stdarg.h>
+#include <time.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
-/* use macro instead of expanding envelope command. */
-#define USE_SSG_ENV_MACRO
+#include "fal2muc.h"
+#include "d88.h"
+#include "n88bas.h"
 
-/* combine long length tones. */
-#define COMBINE_LONG_TONE
+void help(void)
+{
+    fprintf(stderr, "Usage: fal2muc [option(s)] file\n");
+    fprintf(stderr, "       fal2muc [option(s)] -O DIR file|dir...\n");
+    fprintf(stderr, "  -h\t\tprint this help message and exit\n");
+    fprintf(stderr, "  -v\t\tverbose (debug info)\n");
+    fprintf(stderr, "  -w\t\tapply workaround and ignore warnings\n");
+    fprintf(stderr, "  -z\t\toptimize the size of MML (repeated phrases to loops)\n");
+    fprintf(stderr, "  -i\t\tdefine identical voices only once\n");
+    fprintf(stderr, "  -I FILE\twrite the voices of all songs into a bank file (batch mode)\n");
+    fprintf(stderr, "  -o FILE\toutput file (default: stdout)\n");
+    fprintf(stderr, "  -O DIR\toutput directory (batch mode)\n");
+    fprintf(stderr, "  -j N\t\tnumber of threads: songs in batch mode, otherwise channels (0: all cores)\n");
+    fprintf(stderr, "  -B\t\toutput N88-BASIC program instead of text (like txt2bas)\n");
+    fprintf(stderr, "  -D\t\textract all songs from D88 disk images (batch mode)\n");
+    fprintf(stderr, "  -s OFFSET\tstart offset of song data in file (default: 0)\n");
+    fprintf(stderr, "  -l LENGTH\tlength of song data (default: up to the end)\n");
+    fprintf(stderr, "  -m VERSION\tMUCOM88 version\n");
+    fprintf(stderr, "  -t TITLE\ttitle for tag\n");
+    fprintf(stderr, "  -a AUTHOR\tauthor for tag\n");
+    fprintf(stderr, "  -c COMPOSER\tcomposer for tag\n");
+    fprintf(stderr, "  -d DATE\tdate for tag\n");
+    fprintf(stderr, "  -C COMMENT\tcomment for tag\n");
+    fprintf(stderr, "  --cache=DIR\treuse MML converted from the same data and options\n");
+    fprintf(stderr, "  --stats[=FILE]\twrite timing and counters in JSON (default: stderr)\n");
+    fprintf(stderr, "  --render=FORMAT\twrite a register log (vgm, s98) or a sound (wav) instead of MML\n");
+    fprintf(stderr, "  --timing[=FILE]\twrite the length of songs in JSON instead of MML (default: stdout)\n");
+    fprintf(stderr, "  --fingerprint[=FILE]\twrite fingerprints and near-duplicates in JSON instead of MML (default: stdout)\n");
+    fprintf(stderr, "  -F FORMAT\tfile format (default: auto detect)\n");
+    fprintf(stderr, "\t\t          Data          / Playback\n");
+    fprintf(stderr, "\t\t  opn   = OPN           / OPN\n");
+    fprintf(stderr, "\t\t  opna  = OPNA          / OPNA\n");
+    fprintf(stderr, "\t\t  opnar = OPNA(RHYTHM)  / OPNA\n");
+    fprintf(stderr, "\t\t  va    = OPNA(PC-88VA) / OPNA\n");
+    fprintf(stderr, "\t\t  mono  = OPNA          / OPN\n");
+    fprintf(stderr, "\t\t  x1opm = OPM+PSG(X1)   / OPNA\n");
+    fprintf(stderr, "\t\t  x1psg = PSG(X1)       / OPN\n");
+    exit(1);
+}
 
-/* combine long length rests. doesn't work due to MUCOM88 bug. */
-#undef COMBINE_LONG_REST
+typedef struct
+{
+    char **name;
+    uint32_t count;
+    uint32_t size;
+} FILE_LIST;
 
-/* global option(s) */
-bool g_opt_verbose = false;
-bool g_opt_ignore_warning = false;
+/* how input files are read */
+typedef struct
+{
+    size_t offset;
+    size_t length;
+    const char *cachedir;		/* NULL: no cache */
+    bool d88;					/* input files are D88 disk images */
+    bool basic;					/* output N88-BASIC program */
+    bool render;				/* output a register log instead of MML */
+    FAL2MUC_RENDER format;
+} INPUT_OPTION;
+
+/* extension of output files */
+const char *output_ext(const INPUT_OPTION *in_opt)
+{
+    if (in_opt->render)
+    {
+        return (in_opt->format == FAL2MUC_RENDER_S98) ? "s98"
+            : (in_opt->format == FAL2MUC_RENDER_WAV) ? "wav" : "vgm";
+    }
 
-#define BUFF_SIZE (0x10000)
-uint8_t g_data[BUFF_SIZE];
-uint8_t g_loop_flag[BUFF_SIZE];
-uint8_t g_loop_nest[BUFF_SIZE];
-uint32_t g_ssg_tempo_prev = UINT32_MAX;
-uint32_t g_ssg_tempo_count = 0;
+    return in_opt->basic ? "bas" : "muc";
+}
 
-typedef enum
+/* MML or a register log */
+FAL2MUC_STATUS convert_input(fal2muc_ctx *ctx, const INPUT_OPTION *in_opt,
+                             const fal2muc_input *input, const fal2muc_sink *sink)
 {
-    DRIVER_TYPE_UNKNOWN,
-    DRIVER_TYPE_OPN,
-    DRIVER_TYPE_OPNA,
-    DRIVER_TYPE_OPNA_RHYTHM,
-    DRIVER_TYPE_OPNA_VA,
-    DRIVER_TYPE_OPNA_MONO,
-    DRIVER_TYPE_X1_OPM,
-    DRIVER_TYPE_X1_PSG,
-} DRIVER_TYPE;
+    if (in_opt->render)
+    {
+        return fal2muc_render_input(ctx, input, in_opt->format, sink);
+    }
+
+    return fal2muc_convert_input(ctx, input, sink);
+}
 
 typedef enum
 {
-    SOUND_TYPE_NONE		= 0x0000,
-    SOUND_TYPE_FM		= 0x0001,
-    SOUND_TYPE_SSG		= 0x0002,
-    SOUND_TYPE_STEREO	= 0x0004,
-    SOUND_TYPE_OPM		= 0x0008,
-    SOUND_TYPE_RHYTHM	= 0x0010,
-    SOUND_TYPE_DUMMY	= 0x8000,
-} SOUND_TYPE;
-
-#ifdef USE_SSG_ENV_MACRO
-const char g_ssg_inst[] = 
-"# *0{E$ff,$ff,$ff,$ff,$00,$ff}\n"
-"# *1{E$ff,$ff,$ff,$c8,$00,$0a}\n"
-"# *2{E$ff,$ff,$ff,$c8,$01,$0a}\n"
-"# *3{E$ff,$ff,$ff,$be,$00,$0a}\n"
-"# *4{E$ff,$ff,$ff,$be,$01,$0a}\n"
-"# *5{E$ff,$ff,$ff,$be,$04,$0a}\n"
-"# *6{E$ff,$ff,$ff,$be,$0a,$0a}\n"
-"# *7{E$ff,$ff,$ff,$01,$ff,$ff}\n"
-"# *8{E$ff,$ff,$ff,$ff,$01,$0a}\n"
-"# *9{E$64,$64,$ff,$ff,$01,$0a}\n"
-"# *10{E$28,$02,$ff,$f0,$00,$0a}\n"
-"# *11{E$ff,$ff,$ff,$c8,$01,$28}\n"
-"";
-#else /* USE_SSG_ENV_MACRO */
-const uint8_t g_ssg_env[12][6] =
+    RESULT_PENDING,
+    RESULT_OK,
+    RESULT_WARNING,
+    RESULT_FAILED,
+} RESULT;
+
+/* work-stealing deque: the owner takes from head, thieves take from tail */
+typedef struct
 {
-    {0xff, 0xff, 0xff, 0xff, 0x00, 0xff},
-    {0xff, 0xff, 0xff, 0xc8, 0x00, 0x0a},
-    {0xff, 0xff, 0xff, 0xc8, 0x01, 0x0a},
-    {0xff, 0xff, 0xff, 0xbe, 0x00, 0x0a},
-    {0xff, 0xff, 0xff, 0xbe, 0x01, 0x0a},
-    {0xff, 0xff, 0xff, 0xbe, 0x04, 0x0a},
-    {0xff, 0xff, 0xff, 0xbe, 0x0a, 0x0a},
-    {0xff, 0xff, 0xff, 0x01, 0xff, 0xff},
-    {0xff, 0xff, 0xff, 0xff, 0x01, 0x0a},
-    {0x64, 0x64, 0xff, 0xff, 0x01, 0x0a},
-    {0x28, 0x02, 0xff, 0xf0, 0x00, 0x0a},
-    {0xff, 0xff, 0xff, 0xc8, 0x01, 0x28},
-};
-#endif /* USE_SSG_ENV_MACRO */
-
-int DBG(const char *format, ...)
+    pthread_mutex_t lock;
+    uint32_t head;
+    uint32_t tail;
+} WORK_QUEUE;
+
+typedef struct
 {
-    va_list va;
-    int ret = 0;
+    const FILE_LIST *list;
+    const char *outdir;
+    const fal2muc_option *opt;
+    const INPUT_OPTION *in_opt;
+    WORK_QUEUE *queue;
+    uint32_t nqueue;
+    RESULT *result;
+    fal2muc_stats *stats;
+    uint32_t *songs;			/* songs found in each D88 image */
+    uint32_t reported;
+    uint32_t failed;
+    pthread_mutex_t report_lock;
+} BATCH;
+
+typedef struct
+{
+    BATCH *batch;
+    uint32_t id;
+    pthread_t thread;
+} WORKER;
+
+/* FNV-1a */
+uint64_t hash_update(uint64_t h, const void *buf, size_t size)
+{
+    const uint8_t *p = buf;
 
-    va_start(va, format);
-    if (g_opt_verbose)
+    while (size-- > 0)
     {
-        ret = vprintf(format, va);
+        h ^= *p++;
+        h *= UINT64_C(0x100000001b3);
     }
-    va_end(va);
 
-    return ret;
+    return h;
 }
 
-int WARN(const char *format, ...)
+uint64_t hash_string(uint64_t h, const char *str)
 {
-    va_list va;
-    int ret = 0;
+    /* distinguish NULL from "" */
+    uint8_t tag = (str != NULL) ? 1 : 0;
 
-    va_start(va, format);
-    if (g_opt_verbose || !g_opt_ignore_warning)
+    h = hash_update(h, &tag, 1);
+    if (str != NULL)
     {
-        ret = vprintf(format, va);
+        h = hash_update(h, str, strlen(str) + 1);
     }
-    va_end(va);
 
-    if (!g_opt_ignore_warning)
+    return h;
+}
+
+/* key of the cache: data and every option changing the output */
+void cache_path(char *path, size_t size, const char *cachedir,
+                const fal2muc_option *opt, const fal2muc_input *input)
+{
+    static const char magic[] = "fal2muc-cache";
+    uint64_t h = UINT64_C(0xcbf29ce484222325);
+    uint32_t v;
+
+    h = hash_update(h, magic, sizeof(magic));
+    v = FAL2MUC_OUTPUT_VERSION;
+    h = hash_update(h, &v, sizeof(v));
+    v = (opt->driver_type != DRIVER_TYPE_UNKNOWN)
+        ? (uint32_t)opt->driver_type
+        : (uint32_t)detect_driver_type_quiet(input->data);
+    h = hash_update(h, &v, sizeof(v));
+    v = opt->ignore_warning ? 1 : 0;
+    h = hash_update(h, &v, sizeof(v));
+    v = opt->optimize ? 1 : 0;
+    h = hash_update(h, &v, sizeof(v));
+    v = opt->dedup_inst ? 1 : 0;
+    h = hash_update(h, &v, sizeof(v));
+    v = (opt->bank != NULL) ? opt->bank->count : UINT32_MAX;
+    h = hash_update(h, &v, sizeof(v));
+    if (opt->bank != NULL)
     {
-        fprintf(stderr, "exit with warning. try -w option to apply workaround.\n");
-        exit(1);
+        h = hash_update(h, opt->bank->voice, opt->bank->count * sizeof(opt->bank->voice[0]));
+    }
+    h = hash_string(h, opt->mucom88ver);
+    h = hash_string(h, opt->title);
+    h = hash_string(h, opt->author);
+    h = hash_string(h, opt->composer);
+    h = hash_string(h, opt->date);
+    h = hash_string(h, opt->comment);
+    h = hash_update(h, input->data, input->size);
+
+    snprintf(path, size, "%s/%016llx-%zx.muc", cachedir, (unsigned long long)h, input->size);
+}
+
+typedef enum
+{
+    CACHE_MISS,				/* not cached or unreadable, nothing is written */
+    CACHE_HIT,
+    CACHE_WRITE_ERROR,
+} CACHE_RESULT;
+
+/* copy a cached output */
+CACHE_RESULT cache_copy(const char *path, const fal2muc_sink *out)
+{
+    char buf[0x4000];
+    FILE *cp;
+    size_t n;
+    size_t written = 0;
+    CACHE_RESULT ret = CACHE_HIT;
+
+    cp = fopen(path, "rb");
+    if (cp == NULL)
+    {
+        return CACHE_MISS;
+    }
+    while ((n = fread(buf, 1, sizeof(buf), cp)) > 0)
+    {
+        if (out->write(out->opaque, buf, n) != n)
+        {
+            ret = CACHE_WRITE_ERROR;
+            break;
+        }
+        written += n;
+    }
+    if (ret == CACHE_HIT && ferror(cp))
+    {
+        /* converted again only if nothing has been written */
+        ret = (written == 0) ? CACHE_MISS : CACHE_WRITE_ERROR;
     }
+    fclose(cp);
 
     return ret;
 }
 
-uint32_t get_word(const uint8_t *p)
+/* sink writing the output and a new cache entry */
+typedef struct
 {
-    return (uint32_t)p[0] + ((uint32_t)p[1] << 8);
+    fal2muc_sink out;
+    FILE *cache;
+} TEE_SINK;
+
+size_t tee_write(void *opaque, const void *buf, size_t size)
+{
+    TEE_SINK *tee = opaque;
+
+    if (tee->cache != NULL && fwrite(buf, 1, size, tee->cache) != size)
+    {
+        fclose(tee->cache);
+        tee->cache = NULL;
+    }
+
+    return tee->out.write(tee->out.opaque, buf, size);
 }
 
-void dump_inst(FILE *fp, uint32_t num, const uint8_t *data, uint32_t offset)
+size_t bas_write(void *opaque, const void *buf, size_t size)
 {
-    const unsigned char *d = data;
-    uint32_t o = offset;
-
-    fprintf(fp, "  @%%%03u\n", num + 1);
-    fprintf(fp, "  $%03X,$%03X,$%03X,$%03X\n", d[o], d[o+1], d[o+2], d[o+3]); o += 4; // DT/ML
-    fprintf(fp, "  $%03X,$%03X,$%03X,$%03X\n", d[o], d[o+1], d[o+2], d[o+3]); o += 4; // TL
-    fprintf(fp, "  $%03X,$%03X,$%03X,$%03X\n", d[o], d[o+1], d[o+2], d[o+3]); o += 4; // KS/AR
-    fprintf(fp, "  $%03X,$%03X,$%03X,$%03X\n", d[o], d[o+1], d[o+2], d[o+3]); o += 4; // DR
-    fprintf(fp, "  $%03X,$%03X,$%03X,$%03X\n", d[o], d[o+1], d[o+2], d[o+3]); o += 4; // SR
-    fprintf(fp, "  $%03X,$%03X,$%03X,$%03X\n", d[o], d[o+1], d[o+2], d[o+3]); o += 4; // SL/RR
-    fprintf(fp, "  $%03X\n"   , d[o]); // FB/AL
-    fprintf(fp, "\n");
+    return n88bas_write(opaque, buf, size) ? size : 0;
 }
 
-void convert_inst(FILE *fp, const uint8_t *data, uint32_t offset)
+/* finish the program, returns false on error */
+bool bas_end(N88BAS *bas)
 {
-    uint32_t i;
-    uint32_t n = (get_word(data) - offset) / 0x0020;
+    bool ret = (n88bas_end(bas) != 0);
 
-    for (i = 0; i < n; i++)
+    if (bas->overflow)
     {
-        dump_inst(fp, i, data, offset + i * 0x20);
+        fprintf(stderr, "Program too large for N88-BASIC (line %u)\n", (unsigned)bas->lineno);
     }
+
+    return ret;
 }
 
-void detect_clock(const uint32_t len_count[256], uint32_t *clock, uint32_t *deflen)
+double now(void)
 {
-    const struct {
-        uint32_t clock;
-        uint32_t count;
-    } count_table[] = {
-        { 192, len_count[192] + len_count[96] + len_count[48] + len_count[24] + len_count[12] + len_count[6] + len_count[3]},
-        { 144, len_count[144] + len_count[72] + len_count[36] + len_count[18] + len_count[ 9]},
-        { 128, len_count[128] + len_count[64] + len_count[32] + len_count[16] + len_count[ 8] + len_count[4] + len_count[2]},
-        { 112, len_count[112] + len_count[56] + len_count[28] + len_count[14] + len_count[7]},
-        { 0, 0},
-    };
-    uint32_t c;
-    uint32_t l;
+    struct timespec ts;
+
+    timespec_get(&ts, TIME_UTC);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+void print_error(const char *infile, const fal2muc_error *error)
+{
+    fprintf(stderr, "%s: %s", infile, fal2muc_error_string(error->code));
+    if (error->chname != NULL)
+    {
+        fprintf(stderr, " in channel %s", error->chname);
+    }
+    fprintf(stderr, " @ %04x\n", (unsigned)error->offset);
+}
+
+RESULT convert_file(fal2muc_ctx *ctx, const char *infile, const INPUT_OPTION *in_opt,
+                    const char *outfile, fal2muc_stats *stats)
+{
+    FILE *fp;
+    fal2muc_input input;
+    fal2muc_sink sink;
+    FAL2MUC_STATUS status;
+    double t = now();
+    bool opened;
+    bool use_cache;
+    CACHE_RESULT cache;
+    char cachefile[FILENAME_MAX];
+    char tmpfile[FILENAME_MAX + 8];
+    TEE_SINK tee;
+    N88BAS bas;
+    bool bas_ok = true;
+
+    /* map data in place */
+    opened = fal2muc_input_open(&input, infile, in_opt->offset, in_opt->length);
+    if (stats != NULL)
+    {
+        memset(stats, 0, sizeof(*stats));
+        stats->time_load = now() - t;
+    }
+    if (!opened)
+    {
+        fprintf(stderr, "Can't open '%s'\n", infile);
+        return RESULT_FAILED;
+    }
+
+    if (outfile != NULL)
+    {
+        fp = fopen(outfile, (in_opt->basic || in_opt->render) ? "wb" : "w");
+        if (fp == NULL)
+        {
+            fprintf(stderr, "Can't open '%s'\n", outfile);
+            fal2muc_input_close(&input);
+            return RESULT_FAILED;
+        }
+    }
+    else
+    {
+        fp = stdout;
+    }
+
+    /* MML is linked to the program while it's written */
+    tee.out = fal2muc_file_sink(fp);
+    tee.cache = NULL;
+    if (in_opt->basic)
+    {
+        n88bas_init(&bas, tee.out.write, tee.out.opaque);
+        tee.out.write = bas_write;
+        tee.out.opaque = &bas;
+    }
 
+    /* debug info is written to stdout, not to the sink */
+    use_cache = (in_opt->cachedir != NULL) && !ctx->opt.verbose && !in_opt->render;
+    if (use_cache)
     {
-        DBG("----------------\n");
-        for (uint32_t i = 0; count_table[i].clock != 0; i++)
+        cache_path(cachefile, sizeof(cachefile), in_opt->cachedir, &ctx->opt, &input);
+        cache = cache_copy(cachefile, &tee.out);
+        if (cache != CACHE_MISS)
         {
-            DBG("%3d: %4d\n", count_table[i].clock, count_table[i].count);
+            fal2muc_input_close(&input);
+            if (cache == CACHE_WRITE_ERROR || (in_opt->basic && !bas_end(&bas)))
+            {
+                fprintf(stderr, "Can't write '%s'\n", (outfile != NULL) ? outfile : "stdout");
+                bas_ok = false;
+            }
+            if (outfile != NULL)
+            {
+                fclose(fp);
+            }
+            else
+            {
+                fflush(fp);
+            }
+            return bas_ok ? RESULT_OK : RESULT_FAILED;
         }
-        DBG("--------\n");
-        for (uint32_t i = 0; i < 20; i++)
+
+        /* written to a temporary file and renamed, other workers may read it */
+        snprintf(tmpfile, sizeof(tmpfile), "%s.XXXXXX", cachefile);
         {
-            DBG("%3d:", i*10);
-            for (uint32_t j = 0; j < 10; j++)
+            int fd = mkstemp(tmpfile);
+
+            if (fd >= 0)
             {
-                DBG(" %4d", len_count[i * 10 + j]);
+                tee.cache = fdopen(fd, "wb");
+                if (tee.cache == NULL)
+                {
+                    close(fd);
+                    remove(tmpfile);
+                }
             }
-            DBG("\n");
         }
-        DBG("----------------\n");
     }
 
-    c = 0;
-    for (uint32_t i = 1; count_table[i].clock != 0; i++)
+    sink.write = tee_write;
+    sink.opaque = &tee;
+    status = convert_input(ctx, in_opt, &input, &sink);
+    fal2muc_input_close(&input);
+    if (in_opt->basic && !bas_end(&bas) && status != FAL2MUC_UNKNOWN_DRIVER)
+    {
+        status = FAL2MUC_WRITE_ERROR;
+    }
+    if (stats != NULL)
+    {
+        t = stats->time_load;
+        *stats = ctx->stats;
+        stats->time_load = t;
+    }
+    if (status == FAL2MUC_UNKNOWN_DRIVER)
+    {
+        fprintf(stderr, "Unknown driver type\n");
+    }
+    else if (status == FAL2MUC_WRITE_ERROR)
+    {
+        fprintf(stderr, "Can't write '%s'\n", (outfile != NULL) ? outfile : "stdout");
+    }
+    else if (status == FAL2MUC_BAD_DATA)
+    {
+        print_error(infile, &ctx->error);
+    }
+
+    if (use_cache)
+    {
+        /* only complete outputs are cached */
+        if (tee.cache != NULL && fclose(tee.cache) == 0 && status == FAL2MUC_OK)
+        {
+            if (rename(tmpfile, cachefile) != 0)
+            {
+                remove(tmpfile);
+            }
+        }
+        else
+        {
+            remove(tmpfile);
+        }
+    }
+
+    if (outfile != NULL)
+    {
+        fclose(fp);
+    }
+    else
+    {
+        fflush(fp);
+    }
+
+    switch (status)
+    {
+    case FAL2MUC_OK:
+        return RESULT_OK;
+    case FAL2MUC_WARNING:
+    case FAL2MUC_BAD_DATA:
+        return RESULT_WARNING;
+    default:
+        return RESULT_FAILED;
+    }
+}
+
+bool is_directory(const char *path)
+{
+    struct stat st;
+
+    return (stat(path, &st) == 0) && S_ISDIR(st.st_mode);
+}
+
+void add_file(FILE_LIST *list, const char *name)
+{
+    if (list->count == list->size)
+    {
+        list->size = (list->size == 0) ? 64 : list->size * 2;
+        list->name = realloc(list->name, sizeof(char *) * list->size);
+        if (list->name == NULL)
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    list->name[list->count] = strdup(name);
+    if (list->name[list->count] == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    list->count++;
+}
+
+int compare_name(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* add regular files in a directory, sorted by name */
+void add_directory(FILE_LIST *list, const char *dirname)
+{
+    DIR *dir;
+    struct dirent *ent;
+    uint32_t first = list->count;
+    char path[FILENAME_MAX];
+
+    dir = opendir(dirname);
+    if (dir == NULL)
+    {
+        fprintf(stderr, "Can't open '%s'\n", dirname);
+        return;
+    }
+    while ((ent = readdir(dir)) != NULL)
     {
-        if (count_table[i].count > count_table[c].count)
+        if (ent->d_name[0] == '.')
         {
-            c = i;
+            continue;
         }
+        snprintf(path, sizeof(path), "%s/%s", dirname, ent->d_name);
+        if (!is_directory(path))
+        {
+            add_file(list, path);
+        }
+    }
+    closedir(dir);
+
+    qsort(&list->name[first], list->count - first, sizeof(char *), compare_name);
+}
+
+const char *base_name(const char *path)
+{
+    const char *p = strrchr(path, '/');
+#ifdef _WIN32
+    const char *q = strrchr(path, '\\');
+
+    if (q != NULL && (p == NULL || q > p))
+    {
+        p = q;
     }
+#endif /* _WIN32 */
 
-    l = 1;
-    for (uint32_t i = 1; i < 7; i++)
+    return (p != NULL) ? p + 1 : path;
+}
+
+int compare_base_name(const void *a, const void *b)
+{
+    return strcmp(base_name(*(char * const *)a), base_name(*(char * const *)b));
+}
+
+/* output files are named after the inputs, the same name would overwrite another */
+bool check_output_names(const FILE_LIST *list)
+{
+    char **name;
+    bool ok = true;
+
+    if (list->count < 2)
+    {
+        return true;
+    }
+    name = malloc(sizeof(char *) * list->count);
+    if (name == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    memcpy(name, list->name, sizeof(char *) * list->count);
+    qsort(name, list->count, sizeof(char *), compare_base_name);
+    for (uint32_t i = 1; i < list->count; i++)
     {
-        if (len_count[count_table[c].clock / (1 << i)] > len_count[count_table[c].clock / l])
+        if (compare_base_name(&name[i - 1], &name[i]) == 0)
         {
-            l = 1 << i;
+            fprintf(stderr, "'%s' and '%s' have the same output file name\n",
+                    name[i - 1], name[i]);
+            ok = false;
         }
     }
+    free(name);
 
-    *clock = count_table[c].clock;
-    *deflen = l;
+    return ok;
 }
 
-void parse_music(
-    const uint8_t *data, uint32_t offset, uint8_t *loop_flag, uint8_t *loop_nest,
-    uint32_t *end, uint32_t *clock, uint32_t *deflen)
+void stats_add(fal2muc_stats *sum, const fal2muc_stats *st)
 {
-    const uint8_t *d = data;
-    uint32_t o = offset;
-    uint32_t c;
-    uint32_t w;
-    uint32_t len;
-    bool quit = false;
-    uint32_t len_count[256];
+    sum->time_load += st->time_load;
+    sum->time_detect += st->time_detect;
+    sum->time_inst += st->time_inst;
+    sum->time_parse += st->time_parse;
+    sum->time_convert += st->time_convert;
+    sum->time_flush += st->time_flush;
+    sum->bytes_decoded += st->bytes_decoded;
+    sum->events += st->events;
+    sum->notes += st->notes;
+    sum->rests += st->rests;
+    for (uint32_t i = 0; i < 16; i++)
+    {
+        sum->cmds[i] += st->cmds[i];
+    }
+    sum->loops += st->loops;
+    sum->warnings += st->warnings;
+    sum->mml_bytes += st->mml_bytes;
+    sum->factored_loops += st->factored_loops;
+    sum->factored_bytes += st->factored_bytes;
+    sum->shared_inst += st->shared_inst;
+}
 
-    memset(len_count, 0, sizeof(len_count));
+/* read a whole file */
+uint8_t *read_all(const char *path, size_t *size)
+{
+    FILE *fp;
+    uint8_t *buf = NULL;
+    size_t n = 0;
+    size_t buf_size = 0;
+    size_t r;
 
-    while (!quit)
+    fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        return NULL;
+    }
+    do
     {
-        c = d[o++];
-        if (c >= 0xf0)
+        if (n == buf_size)
         {
-            switch (c)
+            uint8_t *p;
+
+            buf_size = (buf_size == 0) ? 0x40000 : buf_size * 2;
+            p = realloc(buf, buf_size);
+            if (p == NULL)
             {
-            case 0xfb:
-            case 0xfc:
-                break;
-            case 0xf0:
-            case 0xf1:
-            case 0xf2:
-            case 0xf3:
-            case 0xf4:
-            case 0xf5:
-            case 0xfe:
-                o++;
-                break;
-            case 0xf8:
-            case 0xfa:
-            case 0xfd:
-                o += 2;
-                break;
-            case 0xf7:
-                o += 5;
-                break;
-            case 0xf9:
-                o += 6;
-                break;
-            case 0xf6:
-                o++;
-                o++;
-                w = get_word(&d[o]);
-                o += 2;
-                loop_nest[o - w]++;
-                break;
-            case 0xff:
-                w = get_word(&d[o]);
-                o += 2;
-                if (w != 0)
-                {
-                    loop_flag[o - w] = 1;
-                }
-                quit = true;
-                break;
+                free(buf);
+                fclose(fp);
+                return NULL;
+            }
+            buf = p;
+        }
+        r = fread(&buf[n], 1, buf_size - n, fp);
+        n += r;
+    } while (r > 0);
+    fclose(fp);
+    *size = n;
+
+    return buf;
+}
+
+/*
+ * convert all songs found in D88 disk images.
+ * songs are searched at every sector boundary of the sectors in order,
+ * the output is named by the disk number and the ID of the first sector.
+ */
+RESULT convert_d88(fal2muc_ctx *ctx, const char *infile, const INPUT_OPTION *in_opt,
+                   const char *outdir, fal2muc_stats *stats, uint32_t *songs)
+{
+    uint8_t *image;
+    size_t image_size;
+    size_t offset;
+    uint32_t disk;
+    DRIVER_TYPE driver_type = ctx->opt.driver_type;
+    RESULT ret = RESULT_OK;
+    double t = now();
+
+    *songs = 0;
+    if (stats != NULL)
+    {
+        memset(stats, 0, sizeof(*stats));
+    }
+    image = read_all(infile, &image_size);
+    if (image == NULL)
+    {
+        fprintf(stderr, "Can't open '%s'\n", infile);
+        return RESULT_FAILED;
+    }
+    if (stats != NULL)
+    {
+        stats->time_load = now() - t;
+    }
+
+    /* an image file may have several disks */
+    for (offset = 0, disk = 0; offset < image_size; disk++)
+    {
+        D88 d88;
+        uint8_t *linear;
+        size_t skip = 0;
+
+        if (!d88_parse(&d88, &image[offset], image_size - offset))
+        {
+            if (disk == 0)
+            {
+                fprintf(stderr, "'%s' is not a D88 image\n", infile);
+                ret = RESULT_FAILED;
+            }
+            break;
+        }
+        /* read past the end of a song as zero, like fal2muc_convert() */
+        linear = d88_linearize(&d88, &image[offset], FAL2MUC_VIEW_SIZE);
+        if (linear == NULL)
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+
+        for (uint32_t i = 0; i < d88.count; i++)
+        {
+            const D88_SECTOR *s = &d88.sector[i];
+            size_t pos = s->linear;
+            size_t used;
+            DRIVER_TYPE type;
+            fal2muc_input input;
+            char path[FILENAME_MAX];
+            FILE *fp;
+            fal2muc_sink sink;
+            N88BAS bas;
+            FAL2MUC_STATUS status;
+
+            if (pos < skip || s->size == 0)
+            {
+                continue;
+            }
+            type = fal2muc_probe(ctx, &linear[pos], d88.data_size - pos, &used);
+            if (type == DRIVER_TYPE_UNKNOWN)
+            {
+                continue;
+            }
+            skip = pos + used;
+
+            snprintf(path, sizeof(path), "%s/%s.%u.c%02uh%ur%02u.%s", outdir, base_name(infile),
+                     disk, s->c, s->h, s->r, output_ext(in_opt));
+            fp = fopen(path, (in_opt->basic || in_opt->render) ? "wb" : "w");
+            if (fp == NULL)
+            {
+                fprintf(stderr, "Can't open '%s'\n", path);
+                ret = RESULT_FAILED;
+                continue;
+            }
+
+            input.data = &linear[pos];
+            input.size = d88.data_size - pos;
+            input.map = NULL;
+            input.map_size = 0;
+            if (input.size > FAL2MUC_BUFF_SIZE)
+            {
+                input.size = FAL2MUC_BUFF_SIZE;
+            }
+            sink = fal2muc_file_sink(fp);
+            if (in_opt->basic)
+            {
+                n88bas_init(&bas, sink.write, sink.opaque);
+                sink.write = bas_write;
+                sink.opaque = &bas;
+            }
+            /* the probed type, unless it's given by -F */
+            ctx->opt.driver_type = (driver_type != DRIVER_TYPE_UNKNOWN) ? driver_type : type;
+            status = convert_input(ctx, in_opt, &input, &sink);
+            ctx->opt.driver_type = driver_type;
+            if (in_opt->basic && !bas_end(&bas))
+            {
+                status = FAL2MUC_WRITE_ERROR;
+            }
+            fclose(fp);
+            (*songs)++;
+            if (stats != NULL)
+            {
+                stats_add(stats, &ctx->stats);
             }
 
+            if (status == FAL2MUC_BAD_DATA)
+            {
+                print_error(path, &ctx->error);
+            }
+            if ((status == FAL2MUC_WARNING || status == FAL2MUC_BAD_DATA) && ret == RESULT_OK)
+            {
+                ret = RESULT_WARNING;
+            }
+            else if (status == FAL2MUC_WRITE_ERROR)
+            {
+                fprintf(stderr, "Can't write '%s'\n", path);
+                ret = RESULT_FAILED;
+            }
         }
-        else if (c >= 0x80)
+
+        free(linear);
+        offset += d88.disk_size;
+        d88_free(&d88);
+    }
+
+    free(image);
+
+    return ret;
+}
+
+/* take a file from own queue, or steal one from the others */
+bool get_work(BATCH *batch, uint32_t id, uint32_t *index)
+{
+    uint32_t i;
+
+    for (i = 0; i < batch->nqueue; i++)
+    {
+        WORK_QUEUE *q = &batch->queue[(id + i) % batch->nqueue];
+        bool found = false;
+
+        pthread_mutex_lock(&q->lock);
+        if (q->head < q->tail)
         {
-            len = c & 0x7f;
-#ifdef COMBINE_LONG_REST
-            if ((len == 0x6f)							// length
-                && (d[o] < 0xf0 && d[o] >= 0x80)		// next command
-                )
+            if (i == 0)
+            {
+                *index = q->head++;
+            }
+            else
             {
-                len += d[o] & 0x7f;
-                o++;
+                *index = --q->tail;
             }
-#endif /* COMBINE_LONG_REST */
-            len_count[len]++;
+            found = true;
+        }
+        pthread_mutex_unlock(&q->lock);
+
+        if (found)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* report results in input order as soon as they are available */
+void report_result(BATCH *batch, uint32_t index, RESULT result)
+{
+    static const char *result_str[] = {"", "ok", "warning", "failed"};
+
+    pthread_mutex_lock(&batch->report_lock);
+    batch->result[index] = result;
+    while (batch->reported < batch->list->count
+           && batch->result[batch->reported] != RESULT_PENDING)
+    {
+        result = batch->result[batch->reported];
+        if (result != RESULT_OK)
+        {
+            batch->failed++;
+        }
+        if (batch->songs != NULL)
+        {
+            fprintf(stderr, "%s: %s (%u song(s))\n", batch->list->name[batch->reported],
+                    result_str[result], batch->songs[batch->reported]);
+        }
+        else
+        {
+            fprintf(stderr, "%s: %s\n", batch->list->name[batch->reported], result_str[result]);
+        }
+        batch->reported++;
+    }
+    pthread_mutex_unlock(&batch->report_lock);
+}
+
+void *batch_worker(void *arg)
+{
+    WORKER *worker = arg;
+    BATCH *batch = worker->batch;
+    fal2muc_ctx *ctx = fal2muc_ctx_new(batch->opt);
+    char path[FILENAME_MAX];
+    uint32_t index;
+
+    if (ctx == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    while (get_work(batch, worker->id, &index))
+    {
+        const char *infile = batch->list->name[index];
+
+        if (batch->in_opt->d88)
+        {
+            report_result(batch, index,
+                          convert_d88(ctx, infile, batch->in_opt, batch->outdir,
+                                      (batch->stats != NULL) ? &batch->stats[index] : NULL,
+                                      &batch->songs[index]));
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s.%s", batch->outdir, base_name(infile),
+                 output_ext(batch->in_opt));
+        report_result(batch, index,
+                      convert_file(ctx, infile, batch->in_opt, path,
+                                   (batch->stats != NULL) ? &batch->stats[index] : NULL));
+    }
+    fal2muc_ctx_free(ctx);
+
+    return NULL;
+}
+
+/*
+ * convert all files with the given number of threads.
+ * result (and stats if not NULL) must have list->count entries.
+ */
+uint32_t convert_batch(const FILE_LIST *list, const char *outdir,
+                       const fal2muc_option *opt, const INPUT_OPTION *in_opt, uint32_t jobs,
+                       RESULT *result, fal2muc_stats *stats)
+{
+    BATCH batch;
+    WORKER *worker;
+    uint32_t i;
+
+    if (jobs > list->count)
+    {
+        jobs = (list->count == 0) ? 1 : list->count;
+    }
+
+    batch.list = list;
+    batch.outdir = outdir;
+    batch.opt = opt;
+    batch.in_opt = in_opt;
+    batch.nqueue = jobs;
+    batch.queue = malloc(sizeof(WORK_QUEUE) * jobs);
+    batch.result = result;
+    batch.stats = stats;
+    batch.songs = in_opt->d88 ? calloc(list->count + 1, sizeof(uint32_t)) : NULL;
+    batch.reported = 0;
+    batch.failed = 0;
+    worker = malloc(sizeof(WORKER) * jobs);
+    if (batch.queue == NULL || worker == NULL || (in_opt->d88 && batch.songs == NULL))
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    pthread_mutex_init(&batch.report_lock, NULL);
+
+    /* give each worker a contiguous range, idle workers steal the rest */
+    for (i = 0; i < jobs; i++)
+    {
+        pthread_mutex_init(&batch.queue[i].lock, NULL);
+        batch.queue[i].head = (uint32_t)((uint64_t)list->count * i / jobs);
+        batch.queue[i].tail = (uint32_t)((uint64_t)list->count * (i + 1) / jobs);
+        worker[i].batch = &batch;
+        worker[i].id = i;
+    }
+
+    for (i = 1; i < jobs; i++)
+    {
+        if (pthread_create(&worker[i].thread, NULL, batch_worker, &worker[i]) != 0)
+        {
+            fprintf(stderr, "Can't create thread\n");
+            exit(1);
+        }
+    }
+    batch_worker(&worker[0]);
+    for (i = 1; i < jobs; i++)
+    {
+        pthread_join(worker[i].thread, NULL);
+    }
+
+    for (i = 0; i < jobs; i++)
+    {
+        pthread_mutex_destroy(&batch.queue[i].lock);
+    }
+    pthread_mutex_destroy(&batch.report_lock);
+    free(worker);
+    free(batch.queue);
+    free(batch.songs);
+
+    return batch.failed;
+}
+
+/*
+ * collect the voices of all files in order and write them into a bank file,
+ * before the conversion so that the numbers don't depend on the threads.
+ */
+bool make_bank(fal2muc_bank *bank, const char *bankfile, const FILE_LIST *list,
+               const fal2muc_option *opt, const INPUT_OPTION *in_opt)
+{
+    fal2muc_ctx *ctx = fal2muc_ctx_new(opt);
+    fal2muc_input input;
+    fal2muc_sink sink;
+    FAL2MUC_STATUS status;
+    FILE *fp;
+    bool ret = true;
+
+    if (ctx == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return false;
+    }
+    for (uint32_t i = 0; i < list->count && ret; i++)
+    {
+        /* unreadable files are reported by the conversion */
+        if (!fal2muc_input_open(&input, list->name[i], in_opt->offset, in_opt->length))
+        {
+            continue;
+        }
+        if (!fal2muc_bank_add(ctx, bank, &input))
+        {
+            fprintf(stderr, "Too many voices for a bank (%s)\n", list->name[i]);
+            ret = false;
+        }
+        fal2muc_input_close(&input);
+    }
+
+    if (ret)
+    {
+        fp = fopen(bankfile, "w");
+        if (fp == NULL)
+        {
+            fprintf(stderr, "Can't open '%s'\n", bankfile);
+            ret = false;
         }
         else
         {
-            len = c;
-#ifdef COMBINE_LONG_TONE
-            if ((len == 0x6f)							// length
-                && (d[o] & 0x80)						// &
-                && (d[o + 1] < 0x80)					// next command
-                && ((d[o + 2] & 0x7f) == (d[o] & 0x7f))	// next note
-                )
+            sink = fal2muc_file_sink(fp);
+            status = fal2muc_convert_bank(ctx, bank, &sink);
+            if (fclose(fp) != 0 || status != FAL2MUC_OK)
             {
-                len += d[o + 1];
-                o += 2;
+                fprintf(stderr, "Can't write '%s'\n", bankfile);
+                ret = false;
             }
-#endif /* COMBINE_LONG_TONE */
-            len_count[len]++;
-            o++;
         }
     }
+    fal2muc_ctx_free(ctx);
+
+    return ret;
+}
+
+void json_string(FILE *fp, const char *str)
+{
+    fputc('"', fp);
+    for (; *str != '\0'; str++)
+    {
+        uint8_t c = (uint8_t)*str;
 
-    *end = o;
+        if (c == '"' || c == '\\')
+        {
+            fprintf(fp, "\\%c", c);
+        }
+        else if (c < 0x20)
+        {
+            fprintf(fp, "\\u%04x", c);
+        }
+        else
+        {
+            fputc(c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+void json_stats(FILE *fp, const fal2muc_stats *st, const char *indent)
+{
+    fprintf(fp, "%s\"time\": {\"load\": %.9f, \"detect\": %.9f, \"inst\": %.9f, "
+            "\"parse\": %.9f, \"convert\": %.9f, \"flush\": %.9f},\n",
+            indent, st->time_load, st->time_detect, st->time_inst,
+            st->time_parse, st->time_convert, st->time_flush);
+    fprintf(fp, "%s\"counters\": {\"bytes_decoded\": %llu, \"events\": %llu, "
+            "\"notes\": %llu, \"rests\": %llu, \"loops\": %llu, \"warnings\": %llu, "
+            "\"mml_bytes\": %llu, \"factored_loops\": %llu, \"factored_bytes\": %llu, "
+            "\"shared_inst\": %llu,\n",
+            indent,
+            (unsigned long long)st->bytes_decoded, (unsigned long long)st->events,
+            (unsigned long long)st->notes, (unsigned long long)st->rests,
+            (unsigned long long)st->loops, (unsigned long long)st->warnings,
+            (unsigned long long)st->mml_bytes, (unsigned long long)st->factored_loops,
+            (unsigned long long)st->factored_bytes, (unsigned long long)st->shared_inst);
+    fprintf(fp, "%s  \"commands\": {", indent);
+    for (uint32_t i = 0; i < 16; i++)
+    {
+        fprintf(fp, "%s\"%02x\": %llu", (i == 0) ? "" : ", ",
+                0xf0 + i, (unsigned long long)st->cmds[i]);
+    }
+    fprintf(fp, "}}");
+}
+
+/* write per file stats and the total in JSON */
+void write_stats(const char *statsfile, const FILE_LIST *list, const RESULT *result,
+                 const fal2muc_stats *stats, double wall)
+{
+    static const char *result_str[] = {"", "ok", "warning", "failed"};
+    fal2muc_stats sum;
+    FILE *fp = stderr;
+
+    if (statsfile != NULL)
+    {
+        fp = fopen(statsfile, "w");
+        if (fp == NULL)
+        {
+            fprintf(stderr, "Can't open '%s'\n", statsfile);
+            return;
+        }
+    }
+
+    memset(&sum, 0, sizeof(sum));
+    fprintf(fp, "{\n  \"files\": [\n");
+    for (uint32_t i = 0; i < list->count; i++)
+    {
+        const fal2muc_stats *st = &stats[i];
+
+        fprintf(fp, "    {\n      \"file\": ");
+        json_string(fp, list->name[i]);
+        fprintf(fp, ",\n      \"status\": \"%s\",\n", result_str[result[i]]);
+        json_stats(fp, st, "      ");
+        fprintf(fp, ",\n      \"calls\": [");
+        for (uint32_t j = 0; j < st->calls && j < FAL2MUC_STATS_CALL_MAX; j++)
+        {
+            fprintf(fp, "%s\n        {\"channel\": ", (j == 0) ? "" : ",");
+            json_string(fp, st->call[j].chname);
+            fprintf(fp, ", \"parse\": %.9f, \"convert\": %.9f}",
+                    st->call[j].time_parse, st->call[j].time_convert);
+        }
+        fprintf(fp, "%s]\n    }%s\n", (st->calls > 0) ? "\n      " : "",
+                (i + 1 < list->count) ? "," : "");
+        stats_add(&sum, st);
+    }
+    fprintf(fp, "  ],\n  \"total\": {\n    \"files\": %u,\n    \"wall\": %.9f,\n",
+            list->count, wall);
+    json_stats(fp, &sum, "    ");
+    fprintf(fp, "\n  }\n}\n");
 
-    detect_clock(len_count, clock, deflen);
+    if (statsfile != NULL)
+    {
+        fclose(fp);
+    }
 }
 
-int print_length(FILE *fp, uint32_t clock, uint32_t deflen, uint32_t len)
+/* simulate the songs and write their lengths in JSON, nothing is converted */
+int write_timing(const char *timingfile, const FILE_LIST *list, const fal2muc_option *opt,
+                 const INPUT_OPTION *in_opt)
 {
-    int ret = 0;
+    static const char *result_str[] = {"", "ok", "warning", "failed"};
+    fal2muc_ctx *ctx;
+    FILE *fp = stdout;
+    uint32_t failed = 0;
+
+    ctx = fal2muc_ctx_new(opt);
+    if (ctx == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    if (timingfile != NULL)
+    {
+        fp = fopen(timingfile, "w");
+        if (fp == NULL)
+        {
+            fprintf(stderr, "Can't open '%s'\n", timingfile);
+            fal2muc_ctx_free(ctx);
+            return 1;
+        }
+    }
 
-    if (clock % len == 0)
+    fprintf(fp, "{\n  \"files\": [");
+    for (uint32_t i = 0; i < list->count; i++)
     {
-        if (clock / len == deflen)
+        fal2muc_input input;
+        fal2muc_timing timing;
+        FAL2MUC_STATUS status = FAL2MUC_UNKNOWN_DRIVER;
+        RESULT result = RESULT_FAILED;
+
+        memset(&timing, 0, sizeof(timing));
+        if (!fal2muc_input_open(&input, list->name[i], in_opt->offset, in_opt->length))
         {
-            /* nothing */
+            fprintf(stderr, "Can't open '%s'\n", list->name[i]);
         }
         else
         {
-            ret += fprintf(fp, "%u", clock / len);
+            status = fal2muc_simulate_input(ctx, &input, &timing);
+            fal2muc_input_close(&input);
         }
-    }
-    else if ((len % 3 == 0) && (clock % (len / 3 * 2) == 0))
-    {
-        if (clock / (len / 3 * 2) == deflen)
+        if (status == FAL2MUC_OK)
+        {
+            result = RESULT_OK;
+        }
+        else if (status == FAL2MUC_UNKNOWN_DRIVER)
         {
-            ret += fprintf(fp, ".");
+            fprintf(stderr, "%s: Unknown driver type\n", list->name[i]);
+        }
+        else if (status == FAL2MUC_BAD_DATA)
+        {
+            /* failed as the conversion does */
+            print_error(list->name[i], &ctx->error);
         }
         else
         {
-            ret += fprintf(fp, "%u.", clock / (len / 3 * 2));
+            result = RESULT_WARNING;
+        }
+        if (result == RESULT_FAILED)
+        {
+            failed++;
+        }
+
+        fprintf(fp, "%s\n    {\n      \"file\": ", (i == 0) ? "" : ",");
+        json_string(fp, list->name[i]);
+        fprintf(fp, ",\n      \"status\": \"%s\",\n", result_str[result]);
+        fprintf(fp, "      \"ticks\": {\"intro\": %u, \"loop\": %u},\n",
+                timing.intro, timing.loop);
+        fprintf(fp, "      \"seconds\": {\"intro\": %.3f, \"loop\": %.3f},\n",
+                timing.intro_sec, timing.loop_sec);
+        fprintf(fp, "      \"desync\": %s,\n      \"channels\": [",
+                timing.desync ? "true" : "false");
+        for (uint32_t j = 0; j < timing.channels; j++)
+        {
+            const fal2muc_channel_time *t = &timing.ch[j];
+
+            fprintf(fp, "%s\n        {\"channel\": ", (j == 0) ? "" : ",");
+            json_string(fp, t->chname);
+            fprintf(fp, ", \"ticks\": %u, \"intro\": %u, \"loop\": %u}",
+                    t->ticks, t->intro, t->loop);
         }
+        fprintf(fp, "%s]\n    }", (timing.channels > 0) ? "\n      " : "");
+    }
+    fprintf(fp, "%s]\n}\n", (list->count > 0) ? "\n  " : "");
+
+    if (timingfile != NULL)
+    {
+        fclose(fp);
     }
     else
     {
-        ret += fprintf(fp, "%%%u", len);
+        fflush(fp);
     }
-    return ret;
+    fal2muc_ctx_free(ctx);
+
+    return (failed == 0) ? 0 : 1;
 }
 
-void convert_music(FILE *fp, uint32_t ch, SOUND_TYPE sound_type, const char *chname,
-                   const uint8_t *data, uint8_t *loop_flag, uint8_t *loop_nest)
+#define SIMILARITY_MIN (0.5)		/* songs in a group of near-duplicates */
+
+/* fingerprint the songs and write them with the groups of near-duplicates in JSON */
+int write_fingerprint(const char *fpfile, const FILE_LIST *list, const fal2muc_option *opt,
+                      const INPUT_OPTION *in_opt)
 {
-    static const char *notestr[16] = {
-        "c", "c+", "d", "d+", "e", "f", "f+", "g", "g+", "a", "a+", "b",
-        "?", "?", "?", "?"
-    };
-    static const uint8_t x1_illegal_note[] = {
-        0x4e, 0x0b, 0x0e, 0x0b, 0x36, 0x0b, 0x08, 0x09,
-        0x41, 0x09, 0x21, 0x09, 0x08, 0x08, 0x57, 0x08,
-        0x4b, 0x08, 0x47, 0x06, 0x47, 0x06, 0x4d, 0x06,
-        0x20, 0x1e, 0x1d, 0x1a, 0x18, 0x17, 0x14, 0x12,
-    };
-    uint8_t rhy_vol[6] = {
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00
-    };
-    const uint8_t *d = data;
-    uint32_t o = get_word(&data[ch * 2]);
-    uint32_t end;
-    uint32_t c;
-    uint32_t rhy_comb;
-    uint32_t prev_oct, oct, note, len;
-    uint32_t ssg_mixer;
-    uint32_t ssg_noise;
-    uint32_t nest;
-    uint32_t clock, deflen;
-    uint32_t timerb_on_ssg = UINT32_MAX;
-    bool init = false;
-    bool quit = false;
-    int ll;
-
-#define DUMMY(x) if (sound_type & SOUND_TYPE_DUMMY) { o += x; break; }
-
-    parse_music(data, o, loop_flag, loop_nest, &end, &clock, &deflen);
-
-    ll = 0;
-    prev_oct = 0xff;
-    ssg_mixer = 0x02;
-    ssg_noise = 0xff;
-
-    while (!quit)
-    {
-        if (ll <= 0)
+    static const char *result_str[] = {"", "ok", "warning", "failed"};
+    fal2muc_ctx *ctx;
+    fal2muc_signature *sig;
+    uint32_t *group;
+    FILE *fp = stdout;
+    uint32_t failed = 0;
+    bool first;
+
+    ctx = fal2muc_ctx_new(opt);
+    sig = calloc((list->count > 0) ? list->count : 1, sizeof(fal2muc_signature));
+    group = calloc((list->count > 0) ? list->count : 1, sizeof(uint32_t));
+    if (ctx == NULL || sig == NULL || group == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        fal2muc_ctx_free(ctx);
+        free(sig);
+        free(group);
+        return 1;
+    }
+    if (fpfile != NULL)
+    {
+        fp = fopen(fpfile, "w");
+        if (fp == NULL)
         {
-            fprintf(fp, "\n");
-            ll = 70;
-            ll -= fprintf(fp, "%s ", chname);
-            if (!init)
-            {
-                ll -= fprintf(fp, "C%ul%u", clock, deflen);
-                init = true;
-            }
+            fprintf(stderr, "Can't open '%s'\n", fpfile);
+            fal2muc_ctx_free(ctx);
+            free(sig);
+            free(group);
+            return 1;
         }
+    }
+
+    fprintf(fp, "{\n  \"files\": [");
+    for (uint32_t i = 0; i < list->count; i++)
+    {
+        fal2muc_input input;
+        FAL2MUC_STATUS status = FAL2MUC_UNKNOWN_DRIVER;
+        RESULT result = RESULT_FAILED;
 
-        if (loop_flag[o] || loop_nest[o])
+        if (!fal2muc_input_open(&input, list->name[i], in_opt->offset, in_opt->length))
         {
-            ssg_mixer = 0xff;
-            ssg_noise = 0xff;
+            fprintf(stderr, "Can't open '%s'\n", list->name[i]);
         }
-        if (loop_flag[o])
+        else
         {
-            ll -= fprintf(fp, " L ");
+            status = fal2muc_fingerprint_input(ctx, &input, &sig[i]);
+            fal2muc_input_close(&input);
         }
-        for (nest = 0; nest < loop_nest[o]; nest++)
+        if (status == FAL2MUC_OK)
         {
-            ll -= fprintf(fp, "[");
+            result = RESULT_OK;
         }
-        if (loop_nest[o])
+        else if (status == FAL2MUC_UNKNOWN_DRIVER)
         {
-            DBG("{%04x}", o);
+            fprintf(stderr, "%s: Unknown driver type\n", list->name[i]);
         }
-
-        c = d[o++];
-        if (c >= 0xf0)
+        else if (status == FAL2MUC_BAD_DATA)
         {
-            switch (c)
-            {
-            case 0xf0:
-                if ((sound_type & SOUND_TYPE_RHYTHM) && ch == 9)
-                {
-                    rhy_comb = (uint32_t)d[o++] + 1;
-                    ll -= fprintf(fp, "@%u", rhy_comb);
-                }
-                else if (sound_type & SOUND_TYPE_FM)
-                {
-                    ll -= fprintf(fp, "@%u", (uint32_t)d[o++] + 1);
-                }
-                else if (sound_type & SOUND_TYPE_SSG)
-                {
-#ifdef USE_SSG_ENV_MACRO
-                    ll -= fprintf(fp, "*%u", (uint32_t)d[o++]);
-#else /* USE_SSG_ENV_MACRO */
-                    c = d[o++];
-                    ll -= fprintf(fp, "E%d,%d,%d,%d,%d,%d",
-                                  g_ssg_env[c][0], g_ssg_env[c][1], g_ssg_env[c][2],
-                                  g_ssg_env[c][3], g_ssg_env[c][4], g_ssg_env[c][5]);
-#endif /* USE_SSG_ENV_MACRO */
-                }
-                else
-                {
-                    o++;
-                }
-                break;
-            case 0xf1: DUMMY(1);
-                if ((sound_type & DRIVER_TYPE_OPNA_RHYTHM) && ch == 9)
-                {
-                    int i;
-                    c = d[o++];
-                    for (i = 0; i < 6; i++)
-                    {
-                        if (rhy_comb & (1 << i))
-                        {
-                            rhy_vol[i] |= (c << 1) + 1;
-                        }
-                    }
-                    ll -= fprintf(fp, "v63,%d,%d,%d,%d,%d,%d",
-                                  rhy_vol[0], rhy_vol[1], rhy_vol[2],
-                                  rhy_vol[3], rhy_vol[4], rhy_vol[5]);
-                }
-                else
-                {
-                    ll -= fprintf(fp, "v%u", d[o++]);
-                }
-                break;
-            case 0xf2: DUMMY(1);
-                ll -= fprintf(fp, "q%u", d[o++]);
-                break;
-            case 0xf3: DUMMY(1);
-                ll -= fprintf(fp, "D%d", (char)d[o++]);
-                break;
-            case 0xf4: DUMMY(1);
-                if (sound_type & SOUND_TYPE_FM)
-                {
-                    /* not supported in MUCOM88 */
-                    ll -= fprintf(fp, "??@v%d", d[o++]);
-                }
-                else if (sound_type & SOUND_TYPE_SSG)
-                {
-                    c = d[o++];
-                    if ((c>>6) != ssg_mixer)
-                    {
-                        ssg_mixer = c >> 6;
-                        ll -= fprintf(fp, "P%u", ssg_mixer ^ 3);
-                    }
-                    if ((c&0x1f) != ssg_noise)
-                    {
-                        ssg_noise = c & 0x1f;
-                        ll -= fprintf(fp, "w%u", ssg_noise);
-                    }
-                }
-                else
-                {
-                    o++;
-                }
-                break;
-            case 0xf5:
-                ll -= fprintf(fp, "t%u", (uint32_t)d[o]);
-                if (sound_type & SOUND_TYPE_SSG)
-                {
-                    if (g_ssg_tempo_prev == UINT32_MAX)
-                    {
-                        g_ssg_tempo_prev = (uint32_t)d[o];
-                    }
-                    else if (g_ssg_tempo_prev != (uint32_t)d[o])
-                    {
-                        g_ssg_tempo_prev = (uint32_t)d[o];
-                        g_ssg_tempo_count++;
-                    }
-                    DBG("{%04x}", o - 2);
-                }
-                o++;
-                break;
-            case 0xf6:
-                DBG("{%04x:%04x}", o - 1, o + 4 - get_word(&d[o + 2]));
-                ll -= fprintf(fp, "]%u", d[o++]);
-                ssg_mixer = 0xff;
-                ssg_noise = 0xff;
-                o++;
-                o += 2;
-                break;
-            case 0xf7: DUMMY(5);
-                ll -= fprintf(fp, "M%u,%u,%d,%u",
-                              (uint32_t)d[o], (uint32_t)d[o + 1],
-                              (int16_t)get_word(&d[o + 2]), (uint32_t)d[o + 4]);
-                o += 5;
-                break;
-            case 0xf8: DUMMY(2);
-                if (d[o] == 0x10)
-                {
-                    ll -= fprintf(fp, "MF%d", (d[o + 1] == 0) ? 0 : 1);
-                }
-                else
-                {
-                    /* not supported in MUCOM88 */
-                    ll -= fprintf(fp, "??work");
-                }
-                o += 2;
-                break;
-            case 0xf9: DUMMY(6);
-                ll -= fprintf(fp, "E%u,%u,%u,%u,%u,%u",
-                              (uint32_t)d[o + 0], (uint32_t)d[o + 1], (uint32_t)d[o + 2],
-                              (uint32_t)d[o + 3], (uint32_t)d[o + 4], (uint32_t)d[o + 5]);
-                if (sound_type & SOUND_TYPE_FM)
-                {
-                    DBG("{%04x}", o - 1);
-                }
-                o += 6;
-                break;
-            case 0xfa: DUMMY(2);
-                ll -= fprintf(fp, "y%u,%u", (uint32_t)d[o], (uint32_t)d[o + 1]);
-                if (sound_type & SOUND_TYPE_SSG)
-                {
-                    DBG("{%04x}", o - 1);
-                }
-                o += 2;
-                break;
-            case 0xfb: DUMMY(0);
-                /* not compatible with MUCOM88 */
-                ll -= fprintf(fp, "(");
-                break;
-            case 0xfc: DUMMY(0);
-                /* not compatible with MUCOM88 */
-                ll -= fprintf(fp, ")");
-                break;
-            case 0xfd:
-                if (o + 2 + (int)get_word(&d[o]) >= end)
-                {
-                    /* workaround */
-                    /*  [PC-8801] Eiyu Densetsu II / MUS002 */
-                    /*  [PC-8801] DINOSAUR / 049 */
-                    WARN("\nDetect wrong '/' command @ %04x\n", o - 1);
-                }
-                else
-                {
-                    ll -= fprintf(fp, "/");
-                    DBG("{%04x:%04x}", o - 1, o + 2 + get_word(&d[o]));
-                }
-                o += 2;
-                break;
-            case 0xfe: DUMMY(1);
-                if (sound_type & SOUND_TYPE_STEREO)
-                {
-                    ll -= fprintf(fp, "p%u", (uint32_t)(d[o] >> 6));
-                }
-                o++;
-                break;
-            case 0xff:
-                quit = true;
-                break;
-            }
-
+            /* failed as the conversion does */
+            print_error(list->name[i], &ctx->error);
         }
-        else if (c >= 0x80)
+        else
         {
-            len = c & 0x7f;
-#ifdef COMBINE_LONG_REST
-            if ((len == 0x6f)							// length
-                && (d[o] < 0xf0 && d[o] >= 0x80)		// next command
-                && (!loop_flag[o] && !loop_nest[o])
-                )
-            {
-                len += d[o] & 0x7f;
-                o++;
-            }
-#endif /* COMBINE_LONG_REST */
-            ll -= fprintf(fp, "r");
-            ll -= print_length(fp, clock, deflen, len);
+            result = RESULT_WARNING;
         }
-        else if (sound_type & SOUND_TYPE_DUMMY)
+        if (result == RESULT_FAILED)
         {
-            len = c;
-#ifdef COMBINE_LONG_REST
-            if ((len == 0x6f)							// length
-                && (d[o] & 0x80)						// &
-                && (d[o + 1] < 0x80)					// next command
-                && ((d[o + 2] & 0x7f) == (d[o] & 0x7f))	// next note
-                && (!loop_flag[o + 1] && !loop_nest[o + 1])
-                )
-            {
-                len += d[o+1];
-                o += 2;
-            }
-#endif /* COMBINE_LONG_TONE */
-            ll -= fprintf(fp, "|r"); /* '|' is workaround for MUCOM88 bug */
-            ll -= print_length(fp, clock, deflen, len);
-            o++;
+            failed++;
+            sig[i].shingles = 0;
         }
-        else
+
+        fprintf(fp, "%s\n    {\n      \"file\": ", (i == 0) ? "" : ",");
+        json_string(fp, list->name[i]);
+        fprintf(fp, ",\n      \"status\": \"%s\",\n", result_str[result]);
+        fprintf(fp, "      \"shingles\": %u,\n      \"signature\": \"", sig[i].shingles);
+        for (uint32_t k = 0; k < FAL2MUC_SIGNATURE_SIZE && sig[i].shingles > 0; k++)
         {
-            len = c;
-#ifdef COMBINE_LONG_TONE
-            if ((len == 0x6f)							// length
-                && (d[o] & 0x80)						// &
-                && (d[o + 1] < 0x80)					// next command
-                && ((d[o + 2] & 0x7f) == (d[o] & 0x7f))	// next note
-                && (!loop_flag[o + 1] && !loop_nest[o + 1])
-                )
-            {
-                len += d[o+1];
-                o += 2;
-            }
-#endif /* COMBINE_LONG_TONE */
-            if (!(sound_type & SOUND_TYPE_OPM))
-            {
-                oct = ((d[o] >> 4) & 0x07) + 1;
-                note = d[o] & 0x0f;
-            }
-            else
-            {
-                c = d[o] & 0x7f;
-#if 0
-                if (d[o] == 0xfc)
-                {
-                    /* workaround for [X1] SORCERIAN / SS086 */
-                    c = 0xdc;
-                }
-#endif
-                if (c >= 0x60)
-                {
-                    WARN("\nDetect too high tone %02x @ %04x\n", c, o - 1);
-                    c = x1_illegal_note[(c & 0x7f) - 0x60];
-                }
-                oct = (c + 15) / 12;
-                note = (c + 15) % 12;
-            }
-            if (oct != prev_oct)
+            fprintf(fp, "%08x", sig[i].hash[k]);
+        }
+        fprintf(fp, "\"\n    }");
+    }
+    fprintf(fp, "%s],\n  \"groups\": [", (list->count > 0) ? "\n  " : "");
+
+    /* the groups of 2 or more songs, in the order of the first song */
+    first = true;
+    if (!fal2muc_signature_group(sig, list->count, SIMILARITY_MIN, group))
+    {
+        fprintf(stderr, "Out of memory\n");
+        failed++;
+    }
+    else
+    {
+        for (uint32_t i = 0; i < list->count; i++)
+        {
+            uint32_t n = 0;
+
+            for (uint32_t j = i; j < list->count; j++)
             {
-                if (oct == prev_oct + 1)
+                if (group[j] != i)
                 {
-                    ll -= fprintf(fp, ">");
+                    continue;
                 }
-                else if (oct == prev_oct - 1)
+                if (n == 1)
                 {
-                    ll -= fprintf(fp, "<");
+                    fprintf(fp, "%s\n    [", first ? "" : ",");
+                    json_string(fp, list->name[i]);
+                    first = false;
                 }
-                else
+                if (n >= 1)
                 {
-                    ll -= fprintf(fp, "o%u", oct);
+                    fprintf(fp, ", ");
+                    json_string(fp, list->name[j]);
                 }
-                prev_oct = oct;
+                n++;
             }
-            ll -= fprintf(fp, "%s", notestr[note]);
-            ll -= print_length(fp, clock, deflen, len);
-            if (d[o] & 0x80)
+            if (n > 1)
             {
-                ll -= fprintf(fp, "&");
+                fprintf(fp, "]");
             }
-            o++;
         }
     }
+    fprintf(fp, "%s]\n}\n", first ? "" : "\n  ");
 
-    fprintf(fp, "\n");
-
-    if (timerb_on_ssg != UINT32_MAX)
+    if (fpfile != NULL)
     {
-        DBG("set Timer-B on ch.A\n");
-        fprintf(fp, "A C192t%u\n", timerb_on_ssg);
+        fclose(fp);
     }
-
-}
-
-DRIVER_TYPE detect_driver_type(unsigned char *data)
-{
-    DRIVER_TYPE ret = DRIVER_TYPE_OPN;
-    uint32_t ch9;
-
-    if ((get_word(data) / 16) % 2 == 0)
+    else
     {
-        ch9 = get_word(&data[0x0012]);
-        if (ch9 == 0)
-        {
-            if (get_word(&data[0x001a]) == 0)
-            {
-                ret = DRIVER_TYPE_OPNA_VA;
-            }
-            else
-            {
-                ret = DRIVER_TYPE_X1_OPM;
-            }
-        }
-        else
-        {
-            if (data[ch9] == 0xff)
-            {
-                ret = DRIVER_TYPE_OPNA;
-            }
-            else if (data[ch9] == 0xf0)
-            {
-                ret = DRIVER_TYPE_OPNA_RHYTHM;
-            }
-            else
-            {
-                fprintf(stderr, "Unknown driver type: ch9:%04x [%02x %02x %02x %02x]\n",
-                        ch9, data[ch9 + 0], data[ch9 + 1], data[ch9 + 2], data[ch9 + 3]);
-                ret = DRIVER_TYPE_UNKNOWN;
-            }
-        }
+        fflush(fp);
     }
+    fal2muc_ctx_free(ctx);
+    free(sig);
+    free(group);
 
-    return ret;
-}
-
-void help(void)
-{
-    fprintf(stderr, "Usage: fal2muc [option(s)] file\n");
-    fprintf(stderr, "  -h\t\tprint this help message and exit\n");
-    fprintf(stderr, "  -v\t\tverbose (debug info)\n");
-    fprintf(stderr, "  -w\t\tapply workaround and ignore warnings\n");
-    fprintf(stderr, "  -o FILE\toutput file (default: stdout)\n");
-    fprintf(stderr, "  -m VERSION\tMUCOM88 version\n");
-    fprintf(stderr, "  -t TITLE\ttitle for tag\n");
-    fprintf(stderr, "  -a AUTHOR\tauthor for tag\n");
-    fprintf(stderr, "  -c COMPOSER\tcomposer for tag\n");
-    fprintf(stderr, "  -d DATE\tdate for tag\n");
-    fprintf(stderr, "  -C COMMENT\tcomment for tag\n");
-    fprintf(stderr, "  -F FORMAT\tfile format (default: auto detect)\n");
-    fprintf(stderr, "\t\t          Data          / Playback\n");
-    fprintf(stderr, "\t\t  opn   = OPN           / OPN\n");
-    fprintf(stderr, "\t\t  opna  = OPNA          / OPNA\n");
-    fprintf(stderr, "\t\t  opnar = OPNA(RHYTHM)  / OPNA\n");
-    fprintf(stderr, "\t\t  va    = OPNA(PC-88VA) / OPNA\n");
-    fprintf(stderr, "\t\t  mono  = OPNA          / OPN\n");
-    fprintf(stderr, "\t\t  x1opm = OPM+PSG(X1)   / OPNA\n");
-    fprintf(stderr, "\t\t  x1psg = PSG(X1)       / OPN\n");
-    exit(1);
+    return (failed == 0) ? 0 : 1;
 }
 
 int main(int argc, char *argv[])
 {
     int c;
-    FILE *fp;
-    uint8_t *data = &g_data[0x0000];
-    uint32_t ch;
-    const char *chname[] = {"A", "B", "C", "D", "E", "F", "H", "I", "J", "G"};
-    typedef enum
-    {
-        CH_ASSIGN_FM0 = 0,
-        CH_ASSIGN_SSG = 3,
-        CH_ASSIGN_FM3 = 6,
-    } CH_ASSIGN;
-    const char *mucom88ver = NULL;
-    const char *title = NULL;
-    const char *author = NULL;
-    const char *composer = NULL;
-    const char *date = NULL;
-    const char *comment = NULL;
     const char *outfile = NULL;
-    DRIVER_TYPE driver_type = DRIVER_TYPE_UNKNOWN;
-    struct {
-        SOUND_TYPE type;
-        CH_ASSIGN assign;
-    } ch_info[3];
-    uint32_t inst_offset;
+    const char *outdir = NULL;
+    fal2muc_option opt;
+    FILE_LIST list = {NULL, 0, 0};
+    uint32_t i;
+    uint32_t failed;
+    uint32_t jobs = 1;
+    INPUT_OPTION in_opt = {0, 0, NULL, false, false, false, FAL2MUC_RENDER_VGM};
+    bool stats_on = false;
+    const char *statsfile = NULL;
+    bool timing_on = false;
+    const char *timingfile = NULL;
+    bool fingerprint_on = false;
+    const char *fpfile = NULL;
+    const char *bankfile = NULL;
+    fal2muc_bank *bank = NULL;
+    RESULT *result;
+    fal2muc_stats *stats = NULL;
+    double wall;
+    const struct option long_options[] = {
+        {"stats",	optional_argument,	NULL,	'S'},
+        {"cache",	required_argument,	NULL,	'K'},
+        {"timing",	optional_argument,	NULL,	'T'},
+        {"render",	required_argument,	NULL,	'R'},
+        {"fingerprint",	optional_argument,	NULL,	'P'},
+        {NULL,		0,					NULL,	0},
+    };
     const struct {
         const char *name;
         DRIVER_TYPE type;
@@ -816,47 +1410,121 @@ int main(int argc, char *argv[])
         {NULL,		DRIVER_TYPE_UNKNOWN		},
     };
 
+    memset(&opt, 0, sizeof(opt));
+    opt.driver_type = DRIVER_TYPE_UNKNOWN;
+
     /* command line options */
-    while ((c = getopt(argc, argv, "vwo:m:t:a:c:d:C:F:")) != -1)
+    while ((c = getopt_long(argc, argv, "vwziI:o:O:j:BDs:l:m:t:a:c:d:C:F:", long_options, NULL)) != -1)
     {
         switch (c)
         {
         case 'v':
             /* debug option */
-            g_opt_verbose = true;
+            opt.verbose = true;
             break;
         case 'w':
             /* apply workaround and ignore warnings */
-            g_opt_ignore_warning = true;
+            opt.ignore_warning = true;
+            break;
+        case 'z':
+            opt.optimize = true;
+            break;
+        case 'i':
+            opt.dedup_inst = true;
+            break;
+        case 'I':
+            bankfile = optarg;
             break;
         case 'o':
             outfile = optarg;
             break;
+        case 'O':
+            outdir = optarg;
+            break;
+        case 'j':
+            jobs = (uint32_t)strtoul(optarg, NULL, 0);
+            if (jobs == 0)
+            {
+                long n = sysconf(_SC_NPROCESSORS_ONLN);
+                jobs = (n > 0) ? (uint32_t)n : 1;
+            }
+            break;
+        case 'B':
+            in_opt.basic = true;
+            break;
+        case 'D':
+            in_opt.d88 = true;
+            break;
+        case 's':
+            in_opt.offset = (size_t)strtoul(optarg, NULL, 0);
+            break;
+        case 'l':
+            in_opt.length = (size_t)strtoul(optarg, NULL, 0);
+            break;
+        case 'S':
+            stats_on = true;
+            statsfile = optarg;
+            break;
+        case 'T':
+            timing_on = true;
+            timingfile = optarg;
+            break;
+        case 'P':
+            fingerprint_on = true;
+            fpfile = optarg;
+            break;
+        case 'R':
+            in_opt.render = true;
+            if (strcmp(optarg, "vgm") == 0)
+            {
+                in_opt.format = FAL2MUC_RENDER_VGM;
+            }
+            else if (strcmp(optarg, "s98") == 0)
+            {
+                in_opt.format = FAL2MUC_RENDER_S98;
+            }
+            else if (strcmp(optarg, "wav") == 0)
+            {
+                in_opt.format = FAL2MUC_RENDER_WAV;
+            }
+            else
+            {
+                help();
+            }
+            break;
+        case 'K':
+            in_opt.cachedir = optarg;
+#ifdef _WIN32
+            mkdir(optarg);
+#else /* _WIN32 */
+            mkdir(optarg, 0777);
+#endif /* _WIN32 */
+            break;
         case 'm':
             /* 1.7 is required for using "r%n" */
-            mucom88ver = optarg;
+            opt.mucom88ver = optarg;
             break;
         case 't':
-            title = optarg;
+            opt.title = optarg;
             break;
         case 'a':
-            author = optarg;
+            opt.author = optarg;
             break;
         case 'c':
-            composer = optarg;
+            opt.composer = optarg;
             break;
         case 'd':
-            date = optarg;
+            opt.date = optarg;
             break;
         case 'C':
-            comment = optarg;
+            opt.comment = optarg;
             break;
         case 'F':
             for (int i = 0; driver_type_table[i].name != NULL; i++)
             {
                 if (strcmp(optarg, driver_type_table[i].name) == 0)
                 {
-                    driver_type = driver_type_table[i].type;
+                    opt.driver_type = driver_type_table[i].type;
                     break;
                 }
             }
@@ -867,191 +1535,158 @@ int main(int argc, char *argv[])
         }
     }
 
-    if (optind != argc - 1)
+    opt.stats = stats_on;
+    if (in_opt.render && (in_opt.basic || bankfile != NULL))
     {
         help();
     }
 
-    /* read data to buffer */
-    fp = fopen(argv[optind], "rb");
-    if (fp == NULL)
+    if (timing_on || fingerprint_on)
     {
-        fprintf(stderr, "Can't open '%s'\n", argv[optind]);
-        exit(1);
-    }
-    fread(g_data, sizeof(uint8_t), sizeof(g_data), fp);
-    fclose(fp);
+        int ret;
 
-    if (outfile != NULL)
-    {
-        fp = fopen(outfile, "w");
-        if (fp == NULL)
+        if (optind >= argc || in_opt.d88 || outdir != NULL || outfile != NULL
+            || (timing_on && fingerprint_on))
         {
-            fprintf(stderr, "Can't open '%s'\n", outfile);
-            exit(1);
+            help();
         }
-    }
-    else
-    {
-        fp = stdout;
-    }
+        for (c = optind; c < argc; c++)
+        {
+            if (is_directory(argv[c]))
+            {
+                add_directory(&list, argv[c]);
+            }
+            else
+            {
+                add_file(&list, argv[c]);
+            }
+        }
+        if (timing_on)
+        {
+            ret = write_timing(timingfile, &list, &opt, &in_opt);
+        }
+        else
+        {
+            ret = write_fingerprint(fpfile, &list, &opt, &in_opt);
+        }
+        for (i = 0; i < list.count; i++)
+        {
+            free(list.name[i]);
+        }
+        free(list.name);
 
-    /* driver type */
-    if (driver_type == DRIVER_TYPE_UNKNOWN)
-    {
-        driver_type = detect_driver_type(g_data);
-    }
-
-    switch (driver_type)
-    {
-    case DRIVER_TYPE_OPN:
-        inst_offset = 0x0010;
-        ch_info[0].type = SOUND_TYPE_FM;
-        ch_info[1].type = SOUND_TYPE_SSG;
-        ch_info[2].type = SOUND_TYPE_NONE;
-        ch_info[0].assign = CH_ASSIGN_FM0;
-        ch_info[1].assign = CH_ASSIGN_SSG;
-        ch_info[2].assign = CH_ASSIGN_FM3;
-        break;
-    case DRIVER_TYPE_OPNA:
-        inst_offset = 0x0020;
-        ch_info[0].type = SOUND_TYPE_FM | SOUND_TYPE_STEREO;
-        ch_info[1].type = SOUND_TYPE_FM | SOUND_TYPE_STEREO;
-        ch_info[2].type = SOUND_TYPE_SSG;
-        ch_info[0].assign = CH_ASSIGN_FM3;
-        ch_info[1].assign = CH_ASSIGN_FM0;
-        ch_info[2].assign = CH_ASSIGN_SSG;
-        break;
-    case DRIVER_TYPE_OPNA_RHYTHM:
-        inst_offset = 0x0020;
-        ch_info[0].type = SOUND_TYPE_FM | SOUND_TYPE_STEREO | SOUND_TYPE_RHYTHM;
-        ch_info[1].type = SOUND_TYPE_FM | SOUND_TYPE_STEREO;
-        ch_info[2].type = SOUND_TYPE_SSG;
-        ch_info[0].assign = CH_ASSIGN_FM3;
-        ch_info[1].assign = CH_ASSIGN_FM0;
-        ch_info[2].assign = CH_ASSIGN_SSG;
-        break;
-    case DRIVER_TYPE_OPNA_VA:
-        inst_offset = 0x0020;
-        ch_info[0].type = SOUND_TYPE_FM | SOUND_TYPE_STEREO;
-        ch_info[1].type = SOUND_TYPE_SSG;
-        ch_info[2].type = SOUND_TYPE_FM | SOUND_TYPE_STEREO;
-        ch_info[0].assign = CH_ASSIGN_FM0;
-        ch_info[1].assign = CH_ASSIGN_SSG;
-        ch_info[2].assign = CH_ASSIGN_FM3;
-        break;
-    case DRIVER_TYPE_OPNA_MONO:
-        inst_offset = 0x0020;
-        ch_info[0].type = SOUND_TYPE_NONE;
-        ch_info[1].type = SOUND_TYPE_FM;
-        ch_info[2].type = SOUND_TYPE_SSG;
-        ch_info[0].assign = CH_ASSIGN_FM3;
-        ch_info[1].assign = CH_ASSIGN_FM0;
-        ch_info[2].assign = CH_ASSIGN_SSG;
-        break;
-    case DRIVER_TYPE_X1_OPM:
-        inst_offset = 0x0020;
-        ch_info[0].type = SOUND_TYPE_FM | SOUND_TYPE_STEREO | SOUND_TYPE_OPM;
-        ch_info[1].type = SOUND_TYPE_SSG;
-        ch_info[2].type = SOUND_TYPE_FM | SOUND_TYPE_STEREO | SOUND_TYPE_OPM;
-        ch_info[0].assign = CH_ASSIGN_FM0;
-        ch_info[1].assign = CH_ASSIGN_SSG;
-        ch_info[2].assign = CH_ASSIGN_FM3;
-        break;
-    case DRIVER_TYPE_X1_PSG:
-        data = &g_data[get_word(&g_data[0x001a])];
-        inst_offset = 0x0010;
-        ch_info[0].type = SOUND_TYPE_NONE;
-        ch_info[1].type = SOUND_TYPE_SSG;
-        ch_info[2].type = SOUND_TYPE_NONE;
-        ch_info[0].assign = CH_ASSIGN_FM0;
-        ch_info[1].assign = CH_ASSIGN_SSG;
-        ch_info[2].assign = CH_ASSIGN_FM3;
-        break;
-    default:
-        fprintf(stderr, "Unknown driver type\n");
-        exit(1);
-        break;
+        return ret;
     }
 
-    /* insert tag */
-    if (mucom88ver != NULL)
+    if (outdir == NULL)
     {
-        fprintf(fp, "#mucom88 %s\n", mucom88ver);
+        fal2muc_ctx *ctx;
+        RESULT single;
+        fal2muc_stats st;
+
+        if (optind != argc - 1 || in_opt.d88 || bankfile != NULL)
+        {
+            help();
+        }
+
+        /* channels of the song in parallel */
+        opt.threads = jobs;
+        ctx = fal2muc_ctx_new(&opt);
+        if (ctx == NULL)
+        {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        wall = now();
+        single = convert_file(ctx, argv[optind], &in_opt, outfile,
+                              stats_on ? &st : NULL);
+        wall = now() - wall;
+        /* bad data has been reported, -w doesn't help it */
+        if (single == RESULT_WARNING && !opt.ignore_warning
+            && ctx->error.code == FAL2MUC_ERROR_NONE)
+        {
+            fprintf(stderr, "exit with warning. try -w option to apply workaround.\n");
+        }
+        fal2muc_ctx_free(ctx);
+
+        if (stats_on)
+        {
+            add_file(&list, argv[optind]);
+            write_stats(statsfile, &list, &single, &st, wall);
+            free(list.name[0]);
+            free(list.name);
+        }
+
+        return (single == RESULT_OK) ? 0 : 1;
     }
-    if (title != NULL)
+
+    /* batch mode */
+    if (optind >= argc || outfile != NULL || (bankfile != NULL && in_opt.d88))
     {
-        fprintf(fp, "#title %s\n", title);
+        help();
     }
-    if (author != NULL)
+
+    for (c = optind; c < argc; c++)
     {
-        fprintf(fp, "#author %s\n", author);
+        if (is_directory(argv[c]))
+        {
+            add_directory(&list, argv[c]);
+        }
+        else
+        {
+            add_file(&list, argv[c]);
+        }
     }
-    if (composer != NULL)
+
+    if (!check_output_names(&list))
     {
-        fprintf(fp, "#composer %s\n", composer);
+        return 1;
     }
-    if (date != NULL)
+
+    result = calloc(list.count + 1, sizeof(RESULT));
+    if (stats_on)
     {
-        fprintf(fp, "#date %s\n", date);
+        stats = calloc(list.count + 1, sizeof(fal2muc_stats));
     }
-    if (comment != NULL)
+    if (result == NULL || (stats_on && stats == NULL))
     {
-        fprintf(fp, "#comment %s\n", comment);
+        fprintf(stderr, "Out of memory\n");
+        return 1;
     }
-    fprintf(fp, "\n");
 
-    /* convert */
-    memset(g_loop_flag, 0, sizeof(g_loop_flag));
-    memset(g_loop_nest, 0, sizeof(g_loop_nest));
-
-    convert_inst(fp, data, inst_offset);
-
-#ifdef USE_SSG_ENV_MACRO
-    fprintf(fp, "%s", g_ssg_inst);
-#endif /* USE_SSG_ENV_MACRO */
-
-    for (ch = 0; ch < 9; ch++)
+    wall = now();
+    if (bankfile != NULL)
     {
-        if (ch_info[ch / 3].type != SOUND_TYPE_NONE)
+        bank = calloc(1, sizeof(fal2muc_bank));
+        if (bank == NULL)
         {
-            convert_music(
-                fp,
-                ch, ch_info[ch / 3].type,
-                chname[ch_info[ch / 3].assign + (ch % 3)],
-                data, g_loop_flag, g_loop_nest);
+            fprintf(stderr, "Out of memory\n");
+            return 1;
         }
+        if (!make_bank(bank, bankfile, &list, &opt, &in_opt))
+        {
+            return 1;
+        }
+        opt.bank = bank;
     }
-    if (ch_info[0].type & SOUND_TYPE_RHYTHM)
-    {
-        convert_music(
-            fp,
-            9, ch_info[0].type,
-            chname[9],
-            data, g_loop_flag, g_loop_nest);
-    }
+    failed = convert_batch(&list, outdir, &opt, &in_opt, jobs, result, stats);
+    wall = now() - wall;
 
-    /* Control tempo in X1 PSG data */
-    if (g_ssg_tempo_count > 1 && driver_type == DRIVER_TYPE_X1_PSG)
-    {
-        DBG("Use FM channel for changing tempo\n");
-        memset(g_loop_flag, 0, sizeof(g_loop_flag));
-        memset(g_loop_nest, 0, sizeof(g_loop_nest));
+    fprintf(stderr, "%u file(s) converted, %u failed\n", list.count - failed, failed);
 
-        for (ch = 0; ch < 3; ch++)
-        {
-            convert_music(
-                fp,
-                3 + ch, SOUND_TYPE_DUMMY,
-                chname[CH_ASSIGN_FM0 + ch],
-                data, g_loop_flag, g_loop_nest);
-        }
+    if (stats_on)
+    {
+        write_stats(statsfile, &list, result, stats, wall);
     }
 
-    if (outfile)
+    for (i = 0; i < list.count; i++)
     {
-        fclose(fp);
+        free(list.name[i]);
     }
+    free(list.name);
+    free(result);
+    free(stats);
+    free(bank);
 
-    return 0;
+    return (failed == 0) ? 0 : 1;
 }
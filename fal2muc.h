@@ -0,0 +1,368 @@
+/*
+ * fal2muc: decompiler from Falcom Sound Data to MUCOM88 MML
+ *
+ * Copyright (c) 2019 Hirokuni Yano
+ *
+ * Released under the MIT license.
+ * see https://opensource.org/licenses/MIT
+ */
+
+#ifndef FAL2MUC_H
+#define FAL2MUC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FAL2MUC_BUFF_SIZE (0x10000)
+/*
+ * readable bytes required from the start of a song image.
+ * a song at an offset in the image (PSG song of X1 data) is read
+ * only up to the end of this view, not FAL2MUC_VIEW_SIZE bytes from the offset.
+ */
+#define FAL2MUC_VIEW_SIZE (FAL2MUC_BUFF_SIZE + 0x0100)
+/* changed whenever the output for the same song and options changes (cache keys) */
+#define FAL2MUC_OUTPUT_VERSION (4)
+
+typedef enum
+{
+    DRIVER_TYPE_UNKNOWN,
+    DRIVER_TYPE_OPN,
+    DRIVER_TYPE_OPNA,
+    DRIVER_TYPE_OPNA_RHYTHM,
+    DRIVER_TYPE_OPNA_VA,
+    DRIVER_TYPE_OPNA_MONO,
+    DRIVER_TYPE_X1_OPM,
+    DRIVER_TYPE_X1_PSG,
+} DRIVER_TYPE;
+
+typedef enum
+{
+    SOUND_TYPE_NONE		= 0x0000,
+    SOUND_TYPE_FM		= 0x0001,
+    SOUND_TYPE_SSG		= 0x0002,
+    SOUND_TYPE_STEREO	= 0x0004,
+    SOUND_TYPE_OPM		= 0x0008,
+    SOUND_TYPE_RHYTHM	= 0x0010,
+    SOUND_TYPE_DUMMY	= 0x8000,
+} SOUND_TYPE;
+
+typedef enum
+{
+    FAL2MUC_OK,
+    FAL2MUC_WARNING,			/* stopped by a warning (see ignore_warning) */
+    FAL2MUC_UNKNOWN_DRIVER,		/* driver type can't be detected */
+    FAL2MUC_WRITE_ERROR,		/* output sink failed */
+    FAL2MUC_BAD_DATA,			/* data out of the song image (see fal2muc_error) */
+} FAL2MUC_STATUS;
+
+typedef enum
+{
+    FAL2MUC_ERROR_NONE,
+    FAL2MUC_ERROR_HEADER,		/* channel table or voices out of the image */
+    FAL2MUC_ERROR_CHANNEL,		/* channel starts out of the image */
+    FAL2MUC_ERROR_TRUNCATED,	/* channel runs past the end of the image */
+    FAL2MUC_ERROR_LOOP,			/* loop target out of the channel */
+} FAL2MUC_ERROR;
+
+/* the first broken data found by the last conversion */
+typedef struct
+{
+    FAL2MUC_ERROR code;
+    const char *chname;			/* NULL: not in a channel */
+    uint32_t offset;			/* in the song image */
+} fal2muc_error;
+
+#define FAL2MUC_BANK_MAX (255)
+
+/* FM voices shared by the songs of a title, defined as @1... */
+typedef struct
+{
+    uint32_t count;
+    uint8_t voice[FAL2MUC_BANK_MAX][0x20];
+} fal2muc_bank;
+
+typedef struct
+{
+    bool verbose;				/* print debug info to stdout */
+    bool ignore_warning;		/* apply workaround and ignore warnings */
+    const char *mucom88ver;		/* tags, NULL to omit */
+    const char *title;
+    const char *author;
+    const char *composer;
+    const char *date;
+    const char *comment;
+    DRIVER_TYPE driver_type;	/* DRIVER_TYPE_UNKNOWN: auto detect */
+    bool stats;					/* collect fal2muc_stats */
+    bool optimize;				/* make the MML smaller (not with verbose) */
+    bool dedup_inst;			/* define identical voices only once */
+    const fal2muc_bank *bank;	/* voices defined in the bank, not in the MML (NULL: none) */
+    uint32_t threads;			/* channels of a song converted at once (0, 1: one by one) */
+} fal2muc_option;
+
+/* output for the MML text, returns the number of bytes written */
+typedef struct
+{
+    size_t (*write)(void *opaque, const void *buf, size_t size);
+    void *opaque;
+} fal2muc_sink;
+
+/* one decoded note, rest or command of a channel */
+typedef struct
+{
+    uint16_t offset;			/* offset in the song image */
+    uint8_t cmd;				/* length for note, 0x80|length for rest, or command */
+    uint8_t size;				/* bytes including operands */
+} fal2muc_event;
+
+#define FAL2MUC_STATS_CALL_MAX (16)
+
+/* timing (seconds) and counters of the last conversion */
+typedef struct
+{
+    double time_load;			/* set by the caller */
+    double time_detect;
+    double time_inst;
+    double time_parse;
+    double time_convert;
+    double time_flush;
+    /* each channel conversion */
+    uint32_t calls;
+    struct
+    {
+        const char *chname;
+        double time_parse;
+        double time_convert;
+    } call[FAL2MUC_STATS_CALL_MAX];
+    uint64_t bytes_decoded;
+    uint64_t events;
+    uint64_t notes;
+    uint64_t rests;
+    uint64_t cmds[16];			/* 0xf0-0xff */
+    uint64_t loops;
+    uint64_t warnings;
+    uint64_t mml_bytes;
+    /* optimize */
+    uint64_t factored_loops;	/* loops made from repeated phrases */
+    uint64_t factored_bytes;	/* bytes removed by them */
+    uint64_t shared_inst;		/* voices not defined, same as another or in the bank */
+} fal2muc_stats;
+
+#define FAL2MUC_ATOM_LOOP_POINT	(0x01)	/* " L " */
+#define FAL2MUC_ATOM_CLOSE		(0x02)	/* "]n" after '[' */
+#define FAL2MUC_ATOM_EXIT		(0x04)	/* '/' after '[' */
+#define FAL2MUC_ATOM_TIE		(0x08)	/* ends with '&' */
+
+/* MML emitted for one event, for optimize */
+typedef struct
+{
+    uint32_t start;				/* offset in out */
+    uint8_t oct;				/* octave before the event, 0xff: not set */
+    uint8_t open;				/* '[' at the start */
+    uint8_t flags;				/* FAL2MUC_ATOM_* */
+} fal2muc_atom;
+
+#define FAL2MUC_CHANNEL_MAX (10)
+
+/* ticks of a channel, simulated as the driver plays it */
+typedef struct
+{
+    const char *chname;
+    uint32_t ticks;				/* up to the end of the first play */
+    uint32_t intro;				/* before the loop point */
+    uint32_t loop;				/* from the loop point to the end, 0: not looped */
+} fal2muc_channel_time;
+
+/* length of a song */
+typedef struct
+{
+    uint32_t channels;
+    fal2muc_channel_time ch[FAL2MUC_CHANNEL_MAX];
+    uint32_t intro;				/* ticks until all channels are in their loops */
+    uint32_t loop;				/* ticks until they are at the same place again, 0: not looped */
+    double intro_sec;			/* with the tempo commands of all channels */
+    double loop_sec;
+    bool desync;				/* looped channels have different loop lengths */
+} fal2muc_timing;
+
+struct fal2muc_workers;
+
+/* conversion state, one per thread */
+typedef struct
+{
+    fal2muc_option opt;
+    fal2muc_sink sink;
+    fal2muc_sink message;		/* debug info and warnings (NULL write: stdout) */
+    /* set by WARN() to stop converting the current song */
+    bool warning;
+    bool write_error;
+    /* MML output buffer, flushed to the sink per channel */
+    char *out;
+    size_t out_len;
+    size_t out_size;
+    uint32_t ssg_tempo_first;
+    uint32_t ssg_tempo_prev;
+    uint32_t ssg_tempo_count;
+    fal2muc_stats stats;
+    /* song image, either the caller's memory or a copy in buff */
+    const uint8_t *data;
+    size_t data_size;
+    size_t data_limit;			/* bytes of the song from data, up to the end of the view */
+    fal2muc_error error;
+    uint8_t buff[FAL2MUC_VIEW_SIZE];
+    uint8_t loop_flag[FAL2MUC_BUFF_SIZE];
+    uint8_t loop_nest[FAL2MUC_BUFF_SIZE];
+    /* events of the channel decoded by the last decode_music() */
+    uint32_t event_count;
+    uint32_t loop_error;		/* first loop out of the channel, UINT32_MAX: none */
+    fal2muc_event event[FAL2MUC_BUFF_SIZE];
+    /* MML of each event of the channel, allocated for optimize */
+    fal2muc_atom *atom;
+    /* '@' number of each voice of the song */
+    uint16_t inst_map[256];
+    /* contexts converting channels for opt.threads, allocated on demand */
+    struct fal2muc_workers *workers;
+} fal2muc_ctx;
+
+/*
+ * read-only view of a song image in a file.
+ * FAL2MUC_VIEW_SIZE bytes from data are always readable,
+ * bytes after the end of the file read as zero.
+ */
+typedef struct
+{
+    const uint8_t *data;
+    size_t size;
+    void *map;
+    size_t map_size;
+} fal2muc_input;
+
+fal2muc_ctx *fal2muc_ctx_new(const fal2muc_option *opt);
+void fal2muc_ctx_free(fal2muc_ctx *ctx);
+
+/*
+ * convert a whole song image to MML.
+ * the image is read in place if in_len >= FAL2MUC_VIEW_SIZE, otherwise it's copied.
+ */
+FAL2MUC_STATUS fal2muc_convert(fal2muc_ctx *ctx, const uint8_t *in, size_t in_len,
+                               const fal2muc_sink *out_sink);
+/* convert a song image mapped by fal2muc_input_open() without copying */
+FAL2MUC_STATUS fal2muc_convert_input(fal2muc_ctx *ctx, const fal2muc_input *input,
+                                     const fal2muc_sink *out_sink);
+
+/*
+ * check if data looks like a song image without printing anything.
+ * returns the detected driver type (DRIVER_TYPE_UNKNOWN if not a song),
+ * and the size used by the song.
+ * wrong '/' commands are accepted, they are handled by -w.
+ * FAL2MUC_VIEW_SIZE bytes from data must be readable.
+ */
+DRIVER_TYPE fal2muc_probe(fal2muc_ctx *ctx, const uint8_t *data, size_t size, size_t *used);
+
+/*
+ * add the voices of a song image which are not in the bank yet.
+ * returns false if the bank is full, an unknown song adds nothing.
+ */
+bool fal2muc_bank_add(fal2muc_ctx *ctx, fal2muc_bank *bank, const fal2muc_input *input);
+/* write the voices of a bank as MML */
+FAL2MUC_STATUS fal2muc_convert_bank(fal2muc_ctx *ctx, const fal2muc_bank *bank,
+                                    const fal2muc_sink *out_sink);
+
+/* map size bytes (0: up to the end) from offset of a file */
+bool fal2muc_input_open(fal2muc_input *input, const char *path, size_t offset, size_t size);
+void fal2muc_input_close(fal2muc_input *input);
+
+/*
+ * length of a song without converting it.
+ * the tempo is the value of Timer-B of OPN, 200 before the first tempo command.
+ * the image is read in place if in_len >= FAL2MUC_VIEW_SIZE, otherwise it's copied.
+ */
+FAL2MUC_STATUS fal2muc_simulate(fal2muc_ctx *ctx, const uint8_t *in, size_t in_len,
+                                fal2muc_timing *timing);
+FAL2MUC_STATUS fal2muc_simulate_input(fal2muc_ctx *ctx, const fal2muc_input *input,
+                                      fal2muc_timing *timing);
+
+#define FAL2MUC_SIGNATURE_SIZE (64)
+
+/* fingerprint of a song */
+typedef struct
+{
+    uint32_t hash[FAL2MUC_SIGNATURE_SIZE];	/* MinHash of runs of notes, UINT32_MAX: none */
+    uint32_t shingles;						/* runs of notes, 0: no melody */
+} fal2muc_signature;
+
+/*
+ * fingerprint of the melody and rhythm of a song, the same for the song
+ * transposed, played at another tempo or clock, or with other voices.
+ * the image is read in place if in_len >= FAL2MUC_VIEW_SIZE, otherwise it's copied.
+ */
+FAL2MUC_STATUS fal2muc_fingerprint(fal2muc_ctx *ctx, const uint8_t *in, size_t in_len,
+                                   fal2muc_signature *sig);
+FAL2MUC_STATUS fal2muc_fingerprint_input(fal2muc_ctx *ctx, const fal2muc_input *input,
+                                         fal2muc_signature *sig);
+/* estimate of the ratio of the runs of notes in common (0.0 - 1.0) */
+double fal2muc_signature_similarity(const fal2muc_signature *a, const fal2muc_signature *b);
+/*
+ * group the songs whose similarity is threshold or more, with the others in between.
+ * group[i] is the first song of the group of song i, returns false if out of memory.
+ */
+bool fal2muc_signature_group(const fal2muc_signature *sig, uint32_t count, double threshold,
+                             uint32_t *group);
+
+typedef enum
+{
+    FAL2MUC_RENDER_VGM,			/* VGM 1.51 */
+    FAL2MUC_RENDER_S98,			/* S98 version 3 */
+    FAL2MUC_RENDER_WAV,			/* synthesized, 44100Hz 16 bits stereo */
+} FAL2MUC_RENDER;
+
+/*
+ * play a song and write the register writes of the sound chip
+ * (YM2203 or YM2608, the playback of the MML) as a log.
+ * the intro and a loop are written, the log loops at the loop point.
+ * the image is read in place if in_len >= FAL2MUC_VIEW_SIZE, otherwise it's copied.
+ */
+FAL2MUC_STATUS fal2muc_render(fal2muc_ctx *ctx, const uint8_t *in, size_t in_len,
+                              FAL2MUC_RENDER format, const fal2muc_sink *out_sink);
+FAL2MUC_STATUS fal2muc_render_input(fal2muc_ctx *ctx, const fal2muc_input *input,
+                                    FAL2MUC_RENDER format, const fal2muc_sink *out_sink);
+
+/* message of an error code */
+const char *fal2muc_error_string(FAL2MUC_ERROR code);
+
+/* sink writing to a stdio stream */
+fal2muc_sink fal2muc_file_sink(FILE *fp);
+
+/* conversion steps used by fal2muc_convert() */
+DRIVER_TYPE detect_driver_type(const uint8_t *data);
+/* same without the messages of unknown data */
+DRIVER_TYPE detect_driver_type_quiet(const uint8_t *data);
+/*
+ * start a song for the steps below, required before calling them.
+ * sets the sink and clears the state of the last song,
+ * returns the data of the channels (data of convert_inst() and the others).
+ */
+const uint8_t *fal2muc_ctx_begin(fal2muc_ctx *ctx, const uint8_t *in, size_t in_len,
+                                DRIVER_TYPE driver_type, const fal2muc_sink *out_sink);
+void convert_inst(fal2muc_ctx *ctx, const uint8_t *data, uint32_t offset);
+void dump_inst(fal2muc_ctx *ctx, uint32_t num, const uint8_t *data, uint32_t offset);
+void detect_clock(fal2muc_ctx *ctx, const uint32_t len_count[256],
+                  uint32_t *clock, uint32_t *deflen);
+uint32_t decode_music(fal2muc_ctx *ctx, const uint8_t *data, uint32_t offset,
+                      uint8_t *loop_flag, uint8_t *loop_nest, uint32_t *end);
+void parse_music(fal2muc_ctx *ctx, const uint8_t *data, uint32_t offset,
+                 uint8_t *loop_flag, uint8_t *loop_nest,
+                 uint32_t *end, uint32_t *clock, uint32_t *deflen);
+void convert_music(fal2muc_ctx *ctx, uint32_t ch, SOUND_TYPE sound_type, const char *chname,
+                   const uint8_t *data, uint8_t *loop_flag, uint8_t *loop_nest);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FAL2MUC_H */
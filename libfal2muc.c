@@ -0,0 +1,4801 @@
+/*
+ * fal2muc: decompiler from Falcom Sound Data to MUCOM88 MML
+ *
+ * Copyright (c) 2019 Hirokuni Yano
+ *
+ * Released under the MIT license.
+ * see https://opensource.org/licenses/MIT
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#endif /* _WIN32 */
+
+#include "fal2muc.h"
+#include "opnsynth.h"
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* use macro instead of expanding envelope command. */
+#define USE_SSG_ENV_MACRO
+
+/* combine long length tones. */
+#define COMBINE_LONG_TONE
+
+/* combine long length rests. doesn't work due to MUCOM88 bug. */
+#undef COMBINE_LONG_REST
+
+#ifdef USE_SSG_ENV_MACRO
+static const char g_ssg_inst[] = 
+"# *0{E$ff,$ff,$ff,$ff,$00,$ff}\n"
+"# *1{E$ff,$ff,$ff,$c8,$00,$0a}\n"
+"# *2{E$ff,$ff,$ff,$c8,$01,$0a}\n"
+"# *3{E$ff,$ff,$ff,$be,$00,$0a}\n"
+"# *4{E$ff,$ff,$ff,$be,$01,$0a}\n"
+"# *5{E$ff,$ff,$ff,$be,$04,$0a}\n"
+"# *6{E$ff,$ff,$ff,$be,$0a,$0a}\n"
+"# *7{E$ff,$ff,$ff,$01,$ff,$ff}\n"
+"# *8{E$ff,$ff,$ff,$ff,$01,$0a}\n"
+"# *9{E$64,$64,$ff,$ff,$01,$0a}\n"
+"# *10{E$28,$02,$ff,$f0,$00,$0a}\n"
+"# *11{E$ff,$ff,$ff,$c8,$01,$28}\n"
+"";
+#endif /* USE_SSG_ENV_MACRO */
+
+/* SSG envelopes of the driver, also used by the renderer */
+static const uint8_t g_ssg_env[12][6] =
+{
+    {0xff, 0xff, 0xff, 0xff, 0x00, 0xff},
+    {0xff, 0xff, 0xff, 0xc8, 0x00, 0x0a},
+    {0xff, 0xff, 0xff, 0xc8, 0x01, 0x0a},
+    {0xff, 0xff, 0xff, 0xbe, 0x00, 0x0a},
+    {0xff, 0xff, 0xff, 0xbe, 0x01, 0x0a},
+    {0xff, 0xff, 0xff, 0xbe, 0x04, 0x0a},
+    {0xff, 0xff, 0xff, 0xbe, 0x0a, 0x0a},
+    {0xff, 0xff, 0xff, 0x01, 0xff, 0xff},
+    {0xff, 0xff, 0xff, 0xff, 0x01, 0x0a},
+    {0x64, 0x64, 0xff, 0xff, 0x01, 0x0a},
+    {0x28, 0x02, 0xff, 0xf0, 0x00, 0x0a},
+    {0xff, 0xff, 0xff, 0xc8, 0x01, 0x28},
+};
+
+#ifdef __GNUC__
+#define FORCE_INLINE inline __attribute__((always_inline))
+#else
+#define FORCE_INLINE inline
+#endif
+
+static void emit_flush(fal2muc_ctx *ctx);
+static void workers_free(struct fal2muc_workers *w);
+
+/* wall clock for fal2muc_stats */
+static double stats_time(void)
+{
+    struct timespec ts;
+
+    timespec_get(&ts, TIME_UTC);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* messages go to stdout with the MML unless the message sink is set */
+static int print_message(fal2muc_ctx *ctx, const char *format, va_list va)
+{
+    char buf[256];
+    char *p = buf;
+    va_list va2;
+    int ret;
+
+    if (ctx->message.write == NULL)
+    {
+        return vprintf(format, va);
+    }
+
+    va_copy(va2, va);
+    ret = vsnprintf(buf, sizeof(buf), format, va);
+    if (ret >= (int)sizeof(buf))
+    {
+        p = malloc(ret + 1);
+        if (p != NULL)
+        {
+            vsnprintf(p, ret + 1, format, va2);
+        }
+    }
+    va_end(va2);
+    if (ret > 0 && p != NULL)
+    {
+        ctx->message.write(ctx->message.opaque, p, ret);
+    }
+    if (p != buf)
+    {
+        free(p);
+    }
+
+    return ret;
+}
+
+static int DBG(fal2muc_ctx *ctx, const char *format, ...)
+{
+    va_list va;
+    int ret = 0;
+
+    va_start(va, format);
+    if (ctx->opt.verbose)
+    {
+        /* keep debug info in place when both go to stdout */
+        emit_flush(ctx);
+        ret = print_message(ctx, format, va);
+    }
+    va_end(va);
+
+    return ret;
+}
+
+static int WARN(fal2muc_ctx *ctx, const char *format, ...)
+{
+    va_list va;
+    int ret = 0;
+
+    va_start(va, format);
+    if (ctx->opt.verbose || !ctx->opt.ignore_warning)
+    {
+        emit_flush(ctx);
+        ret = print_message(ctx, format, va);
+    }
+    va_end(va);
+
+    if (!ctx->opt.ignore_warning)
+    {
+        ctx->warning = true;
+    }
+    ctx->stats.warnings++;
+
+    return ret;
+}
+
+/*
+ * MML output buffer.
+ * everything is appended to ctx->out and written to the sink by emit_flush(),
+ * the emit_*() functions return the number of bytes appended.
+ */
+static bool emit_reserve(fal2muc_ctx *ctx, size_t size)
+{
+    size_t n;
+    char *p;
+
+    if (ctx->out_len + size <= ctx->out_size)
+    {
+        return true;
+    }
+
+    n = (ctx->out_size == 0) ? 0x1000 : ctx->out_size;
+    while (n < ctx->out_len + size)
+    {
+        n *= 2;
+    }
+    p = realloc(ctx->out, n);
+    if (p == NULL)
+    {
+        ctx->write_error = true;
+        return false;
+    }
+    ctx->out = p;
+    ctx->out_size = n;
+
+    return true;
+}
+
+static inline int emit_char(fal2muc_ctx *ctx, char c)
+{
+    if (!emit_reserve(ctx, 1))
+    {
+        return 1;
+    }
+    ctx->out[ctx->out_len++] = c;
+
+    return 1;
+}
+
+static int emit_mem(fal2muc_ctx *ctx, const char *str, size_t size)
+{
+    if (!emit_reserve(ctx, size))
+    {
+        return (int)size;
+    }
+    memcpy(&ctx->out[ctx->out_len], str, size);
+    ctx->out_len += size;
+
+    return (int)size;
+}
+
+static inline int emit_str(fal2muc_ctx *ctx, const char *str)
+{
+    return emit_mem(ctx, str, strlen(str));
+}
+
+/* same as "%u" */
+static int emit_uint(fal2muc_ctx *ctx, uint32_t v)
+{
+    char buf[10];
+    int n = 0;
+    int i;
+
+    do
+    {
+        buf[n++] = '0' + (v % 10);
+        v /= 10;
+    } while (v != 0);
+
+    if (!emit_reserve(ctx, n))
+    {
+        return n;
+    }
+    for (i = n - 1; i >= 0; i--)
+    {
+        ctx->out[ctx->out_len++] = buf[i];
+    }
+
+    return n;
+}
+
+/* same as "%d" */
+static int emit_int(fal2muc_ctx *ctx, int32_t v)
+{
+    if (v < 0)
+    {
+        return emit_char(ctx, '-') + emit_uint(ctx, (uint32_t)0 - (uint32_t)v);
+    }
+
+    return emit_uint(ctx, (uint32_t)v);
+}
+
+/* same as "%03u" for values lower than 1000 */
+static int emit_uint3(fal2muc_ctx *ctx, uint32_t v)
+{
+    if (v >= 1000)
+    {
+        return emit_uint(ctx, v);
+    }
+    emit_char(ctx, '0' + (v / 100));
+    emit_char(ctx, '0' + (v / 10 % 10));
+    emit_char(ctx, '0' + (v % 10));
+
+    return 3;
+}
+
+/* same as "$%03X" for a byte */
+static int emit_hex(fal2muc_ctx *ctx, uint8_t v)
+{
+    static const char hex[] = "0123456789ABCDEF";
+
+    emit_char(ctx, '$');
+    emit_char(ctx, '0');
+    emit_char(ctx, hex[v >> 4]);
+    emit_char(ctx, hex[v & 0x0f]);
+
+    return 4;
+}
+
+/* command followed by a number, "v%u" */
+static int emit_cmd_uint(fal2muc_ctx *ctx, const char *cmd, uint32_t v)
+{
+    int ret = emit_str(ctx, cmd);
+
+    return ret + emit_uint(ctx, v);
+}
+
+static int emit_cmd_int(fal2muc_ctx *ctx, const char *cmd, int32_t v)
+{
+    int ret = emit_str(ctx, cmd);
+
+    return ret + emit_int(ctx, v);
+}
+
+/* command followed by comma separated bytes, "E%u,%u,%u,%u,%u,%u" */
+static int emit_cmd_bytes(fal2muc_ctx *ctx, const char *cmd, const uint8_t *p, uint32_t n)
+{
+    int ret = emit_str(ctx, cmd);
+    uint32_t i;
+
+    for (i = 0; i < n; i++)
+    {
+        if (i != 0)
+        {
+            ret += emit_char(ctx, ',');
+        }
+        ret += emit_uint(ctx, p[i]);
+    }
+
+    return ret;
+}
+
+static void emit_flush(fal2muc_ctx *ctx)
+{
+    double t = 0;
+
+    if (ctx->opt.stats)
+    {
+        t = stats_time();
+        ctx->stats.mml_bytes += ctx->out_len;
+    }
+    if (ctx->out_len > 0 && !ctx->write_error)
+    {
+        /* no sink before fal2muc_ctx_begin() */
+        if (ctx->sink.write == NULL
+            || ctx->sink.write(ctx->sink.opaque, ctx->out, ctx->out_len) != ctx->out_len)
+        {
+            ctx->write_error = true;
+        }
+    }
+    ctx->out_len = 0;
+    if (ctx->opt.stats)
+    {
+        ctx->stats.time_flush += stats_time() - t;
+    }
+}
+
+static uint32_t get_word(const uint8_t *p)
+{
+    return (uint32_t)p[0] + ((uint32_t)p[1] << 8);
+}
+
+void dump_inst(fal2muc_ctx *ctx, uint32_t num, const uint8_t *data, uint32_t offset)
+{
+    const unsigned char *d = data;
+    uint32_t o = offset;
+
+    uint32_t i;
+
+    emit_str(ctx, "  @%");
+    emit_uint3(ctx, num + 1);
+    emit_char(ctx, '\n');
+    /* DT/ML, TL, KS/AR, DR, SR, SL/RR */
+    for (i = 0; i < 6; i++)
+    {
+        emit_str(ctx, "  ");
+        emit_hex(ctx, d[o]);
+        emit_char(ctx, ',');
+        emit_hex(ctx, d[o + 1]);
+        emit_char(ctx, ',');
+        emit_hex(ctx, d[o + 2]);
+        emit_char(ctx, ',');
+        emit_hex(ctx, d[o + 3]);
+        emit_char(ctx, '\n');
+        o += 4;
+    }
+    /* FB/AL */
+    emit_str(ctx, "  ");
+    emit_hex(ctx, d[o]);
+    emit_str(ctx, "\n\n");
+}
+
+static int bank_find(const fal2muc_bank *bank, const uint8_t *voice)
+{
+    for (uint32_t i = 0; i < bank->count; i++)
+    {
+        if (memcmp(bank->voice[i], voice, 0x20) == 0)
+        {
+            return (int)i;
+        }
+    }
+
+    return -1;
+}
+
+/* voice i is defined elsewhere, in the bank or as an earlier voice */
+static bool inst_shared(fal2muc_ctx *ctx, const uint8_t *data, uint32_t offset, uint32_t i)
+{
+    const uint8_t *voice = &data[offset + i * 0x20];
+
+    if (ctx->opt.bank != NULL)
+    {
+        int j = bank_find(ctx->opt.bank, voice);
+
+        if (j >= 0)
+        {
+            ctx->inst_map[i] = (uint16_t)(j + 1);
+            return true;
+        }
+    }
+    for (uint32_t j = 0; j < i; j++)
+    {
+        if (memcmp(&data[offset + j * 0x20], voice, 0x20) == 0)
+        {
+            ctx->inst_map[i] = ctx->inst_map[j];
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void convert_inst(fal2muc_ctx *ctx, const uint8_t *data, uint32_t offset)
+{
+    uint32_t i;
+    uint32_t end = get_word(data);
+    uint32_t n;
+    bool share = ctx->opt.dedup_inst || ctx->opt.bank != NULL;
+
+    for (i = 0; i < 256; i++)
+    {
+        ctx->inst_map[i] = (uint16_t)(i + 1);
+    }
+    /* the voices are up to the first channel, within the song */
+    if (end > ctx->data_limit)
+    {
+        end = (uint32_t)ctx->data_limit;
+    }
+    n = (end > offset) ? (end - offset) / 0x0020 : 0;
+    for (i = 0; i < n; i++)
+    {
+        if (share && i < 256 && inst_shared(ctx, data, offset, i))
+        {
+            ctx->stats.shared_inst++;
+            continue;
+        }
+        dump_inst(ctx, i, data, offset + i * 0x20);
+    }
+}
+
+void detect_clock(fal2muc_ctx *ctx, const uint32_t len_count[256],
+                  uint32_t *clock, uint32_t *deflen)
+{
+    const struct {
+        uint32_t clock;
+        uint32_t count;
+    } count_table[] = {
+        { 192, len_count[192] + len_count[96] + len_count[48] + len_count[24] + len_count[12] + len_count[6] + len_count[3]},
+        { 144, len_count[144] + len_count[72] + len_count[36] + len_count[18] + len_count[ 9]},
+        { 128, len_count[128] + len_count[64] + len_count[32] + len_count[16] + len_count[ 8] + len_count[4] + len_count[2]},
+        { 112, len_count[112] + len_count[56] + len_count[28] + len_count[14] + len_count[7]},
+        { 0, 0},
+    };
+    uint32_t c;
+    uint32_t l;
+
+    {
+        DBG(ctx, "----------------\n");
+        for (uint32_t i = 0; count_table[i].clock != 0; i++)
+        {
+            DBG(ctx, "%3d: %4d\n", count_table[i].clock, count_table[i].count);
+        }
+        DBG(ctx, "--------\n");
+        for (uint32_t i = 0; i < 20; i++)
+        {
+            DBG(ctx, "%3d:", i*10);
+            for (uint32_t j = 0; j < 10; j++)
+            {
+                DBG(ctx, " %4d", len_count[i * 10 + j]);
+            }
+            DBG(ctx, "\n");
+        }
+        DBG(ctx, "----------------\n");
+    }
+
+    c = 0;
+    for (uint32_t i = 1; count_table[i].clock != 0; i++)
+    {
+        if (count_table[i].count > count_table[c].count)
+        {
+            c = i;
+        }
+    }
+
+    l = 1;
+    for (uint32_t i = 1; i < 7; i++)
+    {
+        if (len_count[count_table[c].clock / (1 << i)] > len_count[count_table[c].clock / l])
+        {
+            l = 1 << i;
+        }
+    }
+
+    *clock = count_table[c].clock;
+    *deflen = l;
+}
+
+typedef enum
+{
+    OP_NOTE,
+    OP_REST,
+    OP_INST,		/* f0 */
+    OP_VOLUME,		/* f1 */
+    OP_GATE,		/* f2 */
+    OP_DETUNE,		/* f3 */
+    OP_MIXER,		/* f4 */
+    OP_TEMPO,		/* f5 */
+    OP_LOOP_END,	/* f6 */
+    OP_LFO,			/* f7 */
+    OP_LFO_SW,		/* f8 */
+    OP_ENVELOPE,	/* f9 */
+    OP_REG,			/* fa */
+    OP_SLUR_ON,		/* fb */
+    OP_SLUR_OFF,	/* fc */
+    OP_LOOP_EXIT,	/* fd */
+    OP_PAN,			/* fe */
+    OP_END,			/* ff */
+} OP;
+
+typedef struct
+{
+    uint8_t size;		/* bytes including operands */
+    uint8_t op;
+    uint16_t apply;		/* SOUND_TYPE of channels the command is converted for */
+} OPCODE;
+
+#define APPLY_ALL	(SOUND_TYPE_FM | SOUND_TYPE_SSG | SOUND_TYPE_DUMMY)
+#define APPLY_TONE	(SOUND_TYPE_FM | SOUND_TYPE_SSG)
+
+#define OPCODE_X4(...)	__VA_ARGS__, __VA_ARGS__, __VA_ARGS__, __VA_ARGS__
+#define OPCODE_X16(...)	OPCODE_X4(OPCODE_X4(__VA_ARGS__))
+#define OPCODE_NOTE		OPCODE_X16({2, OP_NOTE, APPLY_ALL})
+#define OPCODE_REST		OPCODE_X16({1, OP_REST, APPLY_ALL})
+
+/* byte code of all driver types, indexed by the first byte */
+static const OPCODE g_opcode[256] = {
+    /* 0x00-0x7f: length, note */
+    OPCODE_NOTE, OPCODE_NOTE, OPCODE_NOTE, OPCODE_NOTE,
+    OPCODE_NOTE, OPCODE_NOTE, OPCODE_NOTE, OPCODE_NOTE,
+    /* 0x80-0xef: 0x80|length */
+    OPCODE_REST, OPCODE_REST, OPCODE_REST, OPCODE_REST,
+    OPCODE_REST, OPCODE_REST, OPCODE_REST,
+    /* 0xf0-0xff: command, operands */
+    {2, OP_INST,		APPLY_TONE			},
+    {2, OP_VOLUME,		APPLY_TONE			},
+    {2, OP_GATE,		APPLY_TONE			},
+    {2, OP_DETUNE,		APPLY_TONE			},
+    {2, OP_MIXER,		APPLY_TONE			},
+    {2, OP_TEMPO,		APPLY_ALL			},
+    {5, OP_LOOP_END,	APPLY_ALL			},
+    {6, OP_LFO,			APPLY_TONE			},
+    {3, OP_LFO_SW,		APPLY_TONE			},
+    {7, OP_ENVELOPE,	APPLY_TONE			},
+    {3, OP_REG,			APPLY_TONE			},
+    {1, OP_SLUR_ON,		APPLY_TONE			},
+    {1, OP_SLUR_OFF,	APPLY_TONE			},
+    {3, OP_LOOP_EXIT,	APPLY_ALL			},
+    {2, OP_PAN,			SOUND_TYPE_STEREO	},
+    {3, OP_END,			APPLY_ALL			},
+};
+
+uint32_t decode_music(
+    fal2muc_ctx *ctx, const uint8_t *data, uint32_t offset, uint8_t *loop_flag, uint8_t *loop_nest,
+    uint32_t *end)
+{
+    const uint8_t *d = data;
+    uint32_t o = offset;
+    uint32_t n = 0;
+    const OPCODE *op;
+    uint32_t c;
+    uint32_t w;
+    size_t limit = (ctx->data_limit < FAL2MUC_BUFF_SIZE) ? ctx->data_limit : FAL2MUC_BUFF_SIZE;
+
+    ctx->loop_error = UINT32_MAX;
+    while (o < limit)
+    {
+        op = &g_opcode[d[o]];
+        if (o + op->size > ctx->data_limit)
+        {
+            /* cut by the end of the song, check_channel() reports it */
+            break;
+        }
+
+        ctx->event[n].offset = (uint16_t)o;
+        ctx->event[n].cmd = d[o];
+        ctx->event[n].size = op->size;
+        n++;
+        o += op->size;
+
+        /* broken data may point out of the tables */
+        if (op->op == OP_LOOP_END)
+        {
+            w = get_word(&d[o - 2]);
+            if (loop_nest != NULL && w <= o && o - w < FAL2MUC_BUFF_SIZE)
+            {
+                loop_nest[o - w]++;
+            }
+            if ((w > o || o - w < offset) && ctx->loop_error == UINT32_MAX)
+            {
+                ctx->loop_error = o - op->size;
+            }
+        }
+        else if (op->op == OP_END)
+        {
+            w = get_word(&d[o - 2]);
+            if (loop_flag != NULL && w != 0 && w <= o && o - w < FAL2MUC_BUFF_SIZE)
+            {
+                loop_flag[o - w] = 1;
+            }
+            if (w != 0 && (w > o || o - w < offset) && ctx->loop_error == UINT32_MAX)
+            {
+                ctx->loop_error = o - op->size;
+            }
+            break;
+        }
+    }
+
+    ctx->event_count = n;
+    *end = o;
+
+    if (ctx->opt.stats)
+    {
+        ctx->stats.bytes_decoded += o - offset;
+        ctx->stats.events += n;
+        for (uint32_t i = 0; i < n; i++)
+        {
+            c = ctx->event[i].cmd;
+            if (c < 0x80)
+            {
+                ctx->stats.notes++;
+            }
+            else if (c < 0xf0)
+            {
+                ctx->stats.rests++;
+            }
+            else
+            {
+                ctx->stats.cmds[c - 0xf0]++;
+                if (c == 0xf6)
+                {
+                    ctx->stats.loops++;
+                }
+            }
+        }
+    }
+
+    return n;
+}
+
+void parse_music(
+    fal2muc_ctx *ctx, const uint8_t *data, uint32_t offset, uint8_t *loop_flag, uint8_t *loop_nest,
+    uint32_t *end, uint32_t *clock, uint32_t *deflen)
+{
+    const uint8_t *d = data;
+    const fal2muc_event *ev = ctx->event;
+    uint32_t n;
+    uint32_t i;
+    uint32_t op;
+    uint32_t len;
+    uint32_t len_count[256];
+
+    memset(len_count, 0, sizeof(len_count));
+
+    n = decode_music(ctx, data, offset, loop_flag, loop_nest, end);
+
+    for (i = 0; i < n; i++)
+    {
+        op = g_opcode[ev[i].cmd].op;
+        if (op == OP_REST)
+        {
+            len = ev[i].cmd & 0x7f;
+#ifdef COMBINE_LONG_REST
+            if ((len == 0x6f)							// length
+                && (i + 1 < n)
+                && (g_opcode[ev[i + 1].cmd].op == OP_REST)	// next command
+                )
+            {
+                len += ev[++i].cmd & 0x7f;
+            }
+#endif /* COMBINE_LONG_REST */
+            len_count[len]++;
+        }
+        else if (op == OP_NOTE)
+        {
+            len = ev[i].cmd;
+#ifdef COMBINE_LONG_TONE
+            if ((len == 0x6f)							// length
+                && (d[ev[i].offset + 1] & 0x80)			// &
+                && (i + 1 < n)
+                && (g_opcode[ev[i + 1].cmd].op == OP_NOTE)	// next command
+                && ((d[ev[i + 1].offset + 1] & 0x7f) == (d[ev[i].offset + 1] & 0x7f))	// next note
+                )
+            {
+                len += ev[++i].cmd;
+            }
+#endif /* COMBINE_LONG_TONE */
+            len_count[len]++;
+        }
+    }
+
+    detect_clock(ctx, len_count, clock, deflen);
+}
+
+/* record broken data, returns false if the conversion stops */
+static bool data_error(fal2muc_ctx *ctx, FAL2MUC_ERROR code, const char *chname, uint32_t offset)
+{
+    if (ctx->error.code == FAL2MUC_ERROR_NONE)
+    {
+        ctx->error.code = code;
+        ctx->error.chname = chname;
+        ctx->error.offset = offset;
+    }
+    ctx->stats.warnings++;
+    if (!ctx->opt.ignore_warning)
+    {
+        ctx->warning = true;
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * check a decoded channel against the size of the song once,
+ * the converters read the data of the events without checks.
+ * decode_music() stops at data_limit, a channel without the end
+ * or starting out of the song is reported here.
+ */
+static bool check_channel(fal2muc_ctx *ctx, uint32_t start, uint32_t end, const char *chname)
+{
+    uint32_t n = ctx->event_count;
+    size_t limit = ctx->data_limit;
+
+    if (start >= limit)
+    {
+        return data_error(ctx, FAL2MUC_ERROR_CHANNEL, chname, start);
+    }
+    if (end > limit || n == 0 || ctx->event[n - 1].cmd != 0xff)
+    {
+        return data_error(ctx, FAL2MUC_ERROR_TRUNCATED, chname,
+                          (end > limit) ? (uint32_t)limit : end);
+    }
+    if (ctx->loop_error != UINT32_MAX)
+    {
+        return data_error(ctx, FAL2MUC_ERROR_LOOP, chname, ctx->loop_error);
+    }
+
+    return true;
+}
+
+const char *fal2muc_error_string(FAL2MUC_ERROR code)
+{
+    static const char *str[] = {
+        "no error",
+        "broken header",
+        "channel out of data",
+        "truncated channel",
+        "loop out of channel",
+    };
+
+    return (code < sizeof(str) / sizeof(str[0])) ? str[code] : "unknown error";
+}
+
+static int print_length(fal2muc_ctx *ctx, uint32_t clock, uint32_t deflen, uint32_t len)
+{
+    int ret = 0;
+
+    if (len == 0)
+    {
+        /* broken data, converted with -w */
+        ret += emit_str(ctx, "%0");
+    }
+    else if (clock % len == 0)
+    {
+        if (clock / len == deflen)
+        {
+            /* nothing */
+        }
+        else
+        {
+            ret += emit_uint(ctx, clock / len);
+        }
+    }
+    else if ((len % 3 == 0) && (clock % (len / 3 * 2) == 0))
+    {
+        if (clock / (len / 3 * 2) == deflen)
+        {
+            ret += emit_char(ctx, '.');
+        }
+        else
+        {
+            ret += emit_uint(ctx, clock / (len / 3 * 2));
+            ret += emit_char(ctx, '.');
+        }
+    }
+    else
+    {
+        ret += emit_char(ctx, '%');
+        ret += emit_uint(ctx, len);
+    }
+    return ret;
+}
+
+/*
+ * MML size optimizer: repeated phrases are factored into "[...]n" loops.
+ *
+ * the text of each event is an atom, a run of atoms repeated k times in a
+ * row is replaced with a loop when it's shorter. the body must be a valid
+ * loop of MUCOM88: balanced '[' and ']', '/' only in inner loops, no " L "
+ * and no '&' at the end. the octave is a compile time state in MUCOM88,
+ * so the octave before each repetition and after the last one must be the
+ * same, then '<' and '>' in the body compile to the same tones.
+ */
+#define FACTOR_PERIOD_MAX	(64)	/* atoms in a loop body */
+#define FACTOR_NEST_MAX		(8)		/* depth of the loops including the new one */
+#define FACTOR_PASS_MAX		(4)
+#define FACTOR_COUNT_MAX	(255)
+
+typedef struct
+{
+    uint32_t off;				/* offset in FACTOR.text */
+    uint32_t len;
+    bool tie;					/* ends with '&' */
+} FACTOR_TOKEN;
+
+typedef struct
+{
+    uint32_t tok;				/* first token */
+    uint32_t ntok;
+    uint32_t size;				/* bytes of the text */
+    uint64_t hash;
+    uint8_t oct;				/* octave before */
+    uint8_t open;				/* '[' before the body */
+    uint8_t depth;				/* depth of loops made by the optimizer */
+    uint8_t flags;				/* FAL2MUC_ATOM_* */
+} FACTOR_ITEM;
+
+typedef struct
+{
+    char *text;
+    uint32_t text_len;
+    uint32_t text_size;
+    FACTOR_TOKEN *tok;
+    uint32_t tok_len;
+    uint32_t tok_size;
+    bool error;					/* out of memory */
+    uint32_t loops;
+    uint32_t saved;				/* bytes */
+} FACTOR;
+
+/* grow an array to hold n elements */
+static bool factor_grow(FACTOR *f, void **p, uint32_t *size, uint32_t n, size_t elem)
+{
+    uint32_t new_size;
+    void *q;
+
+    if (n <= *size)
+    {
+        return true;
+    }
+    new_size = (*size == 0) ? 256 : *size;
+    while (new_size < n)
+    {
+        new_size *= 2;
+    }
+    q = realloc(*p, (size_t)new_size * elem);
+    if (q == NULL)
+    {
+        f->error = true;
+        return false;
+    }
+    *p = q;
+    *size = new_size;
+
+    return true;
+}
+
+static uint32_t factor_token(FACTOR *f, uint32_t off, uint32_t len, bool tie)
+{
+    if (!factor_grow(f, (void **)&f->tok, &f->tok_size, f->tok_len + 1, sizeof(FACTOR_TOKEN)))
+    {
+        return 0;
+    }
+    f->tok[f->tok_len].off = off;
+    f->tok[f->tok_len].len = len;
+    f->tok[f->tok_len].tie = tie;
+
+    return f->tok_len++;
+}
+
+static uint32_t factor_text(FACTOR *f, const char *str, uint32_t len)
+{
+    uint32_t off = f->text_len;
+
+    if (!factor_grow(f, (void **)&f->text, &f->text_size, f->text_len + len, 1))
+    {
+        return 0;
+    }
+    memcpy(&f->text[off], str, len);
+    f->text_len += len;
+
+    return factor_token(f, off, len, false);
+}
+
+static bool factor_equal(const FACTOR *f, const FACTOR_ITEM *a, const FACTOR_ITEM *b)
+{
+    if (a->hash != b->hash || a->size != b->size || a->ntok != b->ntok
+        || a->open != b->open || a->flags != b->flags)
+    {
+        return false;
+    }
+    for (uint32_t i = 0; i < a->ntok; i++)
+    {
+        const FACTOR_TOKEN *ta = &f->tok[a->tok + i];
+        const FACTOR_TOKEN *tb = &f->tok[b->tok + i];
+
+        if (ta->len != tb->len || memcmp(&f->text[ta->off], &f->text[tb->off], ta->len) != 0)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* check a loop body, returns the depth of loops in it relative to the body */
+static int factor_body(const FACTOR_ITEM *item, uint32_t n)
+{
+    int depth = 0;
+    int max = 0;
+
+    for (uint32_t i = 0; i < n; i++)
+    {
+        if (item[i].flags & FAL2MUC_ATOM_LOOP_POINT)
+        {
+            return -1;
+        }
+        depth += item[i].open;
+        if ((item[i].flags & FAL2MUC_ATOM_EXIT) && depth < 1)
+        {
+            return -1;
+        }
+        if (depth + item[i].depth > max)
+        {
+            max = depth + item[i].depth;
+        }
+        if (item[i].flags & FAL2MUC_ATOM_CLOSE)
+        {
+            if (--depth < 0)
+            {
+                return -1;
+            }
+        }
+    }
+    if (depth != 0 || (item[n - 1].flags & FAL2MUC_ATOM_TIE))
+    {
+        return -1;
+    }
+
+    return max;
+}
+
+static uint32_t factor_digits(uint32_t v)
+{
+    return (v >= 100) ? 3 : (v >= 10) ? 2 : 1;
+}
+
+static uint64_t factor_hash(const FACTOR *f, const FACTOR_ITEM *item)
+{
+    uint64_t h = UINT64_C(0xcbf29ce484222325);
+
+    for (uint32_t i = 0; i < item->ntok; i++)
+    {
+        const FACTOR_TOKEN *t = &f->tok[item->tok + i];
+
+        for (uint32_t j = 0; j < t->len; j++)
+        {
+            h ^= (uint8_t)f->text[t->off + j];
+            h *= UINT64_C(0x100000001b3);
+        }
+    }
+
+    return h;
+}
+
+/* next item with the same hash for each item, UINT32_MAX: none */
+static uint32_t *factor_next(FACTOR *f, const FACTOR_ITEM *item, uint32_t n)
+{
+    uint32_t *next = malloc(sizeof(uint32_t) * (n + 1));
+    uint32_t *table;
+    uint32_t mask = 1;
+
+    while (mask < n * 2)
+    {
+        mask <<= 1;
+    }
+    table = malloc(sizeof(uint32_t) * mask);
+    if (next == NULL || table == NULL)
+    {
+        free(next);
+        free(table);
+        f->error = true;
+        return NULL;
+    }
+    mask--;
+    memset(table, 0xff, sizeof(uint32_t) * (mask + 1));
+
+    /* open addressing, the last item seen from the end */
+    for (uint32_t i = n; i-- > 0;)
+    {
+        uint32_t h = (uint32_t)(item[i].hash ^ (item[i].hash >> 32)) & mask;
+
+        while (table[h] != UINT32_MAX && item[table[h]].hash != item[i].hash)
+        {
+            h = (h + 1) & mask;
+        }
+        next[i] = table[h];
+        table[h] = i;
+    }
+    free(table);
+
+    return next;
+}
+
+/* octave before item i, or after the last one */
+static inline uint8_t factor_oct(const FACTOR_ITEM *item, uint32_t n, uint8_t oct_end, uint32_t i)
+{
+    return (i < n) ? item[i].oct : oct_end;
+}
+
+/*
+ * one pass over n items, the result is appended to out.
+ * depth is the depth of loops around the items.
+ * returns the number of loops made.
+ */
+static uint32_t factor_pass(FACTOR *f, const FACTOR_ITEM *item, uint32_t n, uint8_t oct_end,
+                            uint32_t depth, FACTOR_ITEM **out, uint32_t *out_len, uint32_t *out_size)
+{
+    uint32_t loops = 0;
+    uint32_t p = 0;
+    uint32_t d = depth;
+    uint32_t *next = factor_next(f, item, n);
+
+    while (p < n && !f->error)
+    {
+        uint32_t best_len = 0;
+        uint32_t best_k = 0;
+        uint32_t best_gain = 0;
+        int best_depth = 0;
+        FACTOR_ITEM *it;
+
+        /* the body starts again at the next item of the same text */
+        for (uint32_t q = next[p]; q != UINT32_MAX && q - p <= FACTOR_PERIOD_MAX
+                 && p + (q - p) * 2 <= n; q = next[q])
+        {
+            uint32_t len = q - p;
+            uint32_t k;
+            uint32_t body = 0;
+            uint32_t cost;
+            int inner;
+
+            /* repeated at least twice with the same octave */
+            for (k = 1; k < FACTOR_COUNT_MAX && p + (k + 1) * len <= n; k++)
+            {
+                uint32_t j;
+
+                for (j = 0; j < len; j++)
+                {
+                    if (!factor_equal(f, &item[p + j], &item[p + k * len + j]))
+                    {
+                        break;
+                    }
+                }
+                if (j < len || factor_oct(item, n, oct_end, p + k * len) != item[p].oct)
+                {
+                    break;
+                }
+            }
+            while (k >= 2 && factor_oct(item, n, oct_end, p + k * len) != item[p].oct)
+            {
+                k--;
+            }
+            if (k < 2)
+            {
+                continue;
+            }
+
+            inner = factor_body(&item[p], len);
+            if (inner < 0 || d + 1 + (uint32_t)inner > FACTOR_NEST_MAX)
+            {
+                continue;
+            }
+            for (uint32_t j = 0; j < len; j++)
+            {
+                body += item[p + j].size;
+            }
+            cost = 2 + factor_digits(k);
+            if ((k - 1) * body > cost && (k - 1) * body - cost > best_gain)
+            {
+                best_gain = (k - 1) * body - cost;
+                best_len = len;
+                best_k = k;
+                best_depth = inner;
+            }
+        }
+
+        if (!factor_grow(f, (void **)out, out_size, *out_len + 1, sizeof(FACTOR_ITEM)))
+        {
+            break;
+        }
+        it = &(*out)[*out_len];
+        if (best_k == 0)
+        {
+            /* copy the item */
+            *it = item[p];
+            it->tok = f->tok_len;
+            for (uint32_t i = 0; i < item[p].ntok; i++)
+            {
+                const FACTOR_TOKEN *t = &f->tok[item[p].tok + i];
+
+                factor_token(f, t->off, t->len, t->tie);
+            }
+            d += item[p].open;
+            if (item[p].flags & FAL2MUC_ATOM_CLOSE)
+            {
+                d--;
+            }
+            (*out_len)++;
+            p++;
+        }
+        else
+        {
+            /* "[" body "]k", the body is factored again inside the loop */
+            FACTOR_ITEM *sub = NULL;
+            uint32_t sub_len = 0;
+            uint32_t sub_size = 0;
+            char count[16];
+            uint32_t tok;
+            FACTOR_ITEM loop;
+
+            f->saved += best_gain;
+            tok = factor_text(f, "[", 1);
+            loops += 1 + factor_pass(f, &item[p], best_len, item[p].oct, d + 1,
+                                     &sub, &sub_len, &sub_size);
+            snprintf(count, sizeof(count), "]%u", best_k);
+            factor_text(f, count, (uint32_t)strlen(count));
+
+            loop.tok = tok;
+            loop.ntok = f->tok_len - tok;
+            loop.size = 0;
+            for (uint32_t i = 0; i < loop.ntok; i++)
+            {
+                loop.size += f->tok[tok + i].len;
+            }
+            loop.oct = item[p].oct;
+            loop.open = 0;
+            loop.depth = (uint8_t)(best_depth + 1);
+            loop.flags = 0;
+            loop.hash = factor_hash(f, &loop);
+            free(sub);
+
+            /* out may be moved by the recursion */
+            if (!factor_grow(f, (void **)out, out_size, *out_len + 1, sizeof(FACTOR_ITEM)))
+            {
+                break;
+            }
+            (*out)[(*out_len)++] = loop;
+            p += best_len * best_k;
+        }
+    }
+    free(next);
+
+    return loops;
+}
+
+/*
+ * length encoder for optimize.
+ * convert_channel() leaves LENGTH_MARK and the length in ticks in the text,
+ * they are written here with the clock and the default lengths giving the
+ * fewest bytes. 'C' and 'l' are states of MUCOM88 at compile time,
+ * so they are chosen in the order of the text, loops don't matter.
+ */
+#define LENGTH_MARK ('\x01')
+#define LENGTH_STATE_MAX (16)
+
+static const uint32_t g_length_clock[] = { 192, 144, 128, 112 };
+
+typedef struct
+{
+    uint8_t len;
+    uint8_t head;				/* 'l' can be put before the token of the length */
+    uint8_t from;				/* best state before the length */
+    uint8_t deflen;				/* 'l' put before the length, 0: none */
+    uint16_t change;			/* states reached by putting 'l' */
+} LENGTH_ITEM;
+
+static int emit_length(fal2muc_ctx *ctx, bool optimize, uint32_t clock, uint32_t deflen, uint32_t len)
+{
+    if (optimize)
+    {
+        emit_char(ctx, LENGTH_MARK);
+        emit_char(ctx, (char)len);
+        return 0;
+    }
+
+    return print_length(ctx, clock, deflen, len);
+}
+
+/* bytes written by print_length() */
+static uint32_t length_cost(uint32_t clock, uint32_t deflen, uint32_t len)
+{
+    if (len != 0 && clock % len == 0)
+    {
+        return (clock / len == deflen) ? 0 : factor_digits(clock / len);
+    }
+    if (len != 0 && len % 3 == 0 && clock % (len / 3 * 2) == 0)
+    {
+        return (clock / (len / 3 * 2) == deflen) ? 1 : factor_digits(clock / (len / 3 * 2)) + 1;
+    }
+
+    return 1 + factor_digits(len);
+}
+
+/*
+ * bytes of the lengths and the header with a clock.
+ * if plan is true, the 'l' put before each length is set to item[].deflen
+ * and the one in the header is returned in *first.
+ */
+static uint32_t length_plan(uint32_t clock, LENGTH_ITEM *item, uint32_t k, bool plan, uint32_t *first)
+{
+    uint32_t deflen[LENGTH_STATE_MAX];
+    uint32_t cost[LENGTH_STATE_MAX];
+    uint32_t cmd[LENGTH_STATE_MAX];
+    uint8_t table[256][LENGTH_STATE_MAX];	/* length_cost() of each length */
+    bool known[256];
+    uint32_t ns = 1;
+    uint32_t best = 0;
+    uint32_t s;
+
+    deflen[0] = 1;
+    for (uint32_t l = 2; l <= clock && ns < LENGTH_STATE_MAX; l++)
+    {
+        if (clock % l == 0)
+        {
+            deflen[ns++] = l;
+        }
+    }
+    for (s = 0; s < ns; s++)
+    {
+        cmd[s] = 1 + factor_digits(deflen[s]);
+        cost[s] = cmd[s];
+    }
+    /* best: the state of the lowest cost so far */
+    memset(known, 0, sizeof(known));
+
+    for (uint32_t i = 0; i < k; i++)
+    {
+        LENGTH_ITEM *it = &item[i];
+        const uint8_t *c = table[it->len];
+
+        if (!known[it->len])
+        {
+            for (s = 0; s < ns; s++)
+            {
+                table[it->len][s] = (uint8_t)length_cost(clock, deflen[s], it->len);
+            }
+            known[it->len] = true;
+        }
+        it->change = 0;
+        if (it->head)
+        {
+            uint32_t from = cost[best];
+
+            it->from = (uint8_t)best;
+            for (s = 0; s < ns; s++)
+            {
+                if (from + cmd[s] < cost[s])
+                {
+                    cost[s] = from + cmd[s];
+                    it->change |= 1 << s;
+                }
+            }
+        }
+        best = 0;
+        for (s = 0; s < ns; s++)
+        {
+            cost[s] += c[s];
+            if (cost[s] < cost[best])
+            {
+                best = s;
+            }
+        }
+    }
+
+    if (plan)
+    {
+        s = best;
+        for (uint32_t i = k; i-- > 0;)
+        {
+            item[i].deflen = 0;
+            if (item[i].change & (1 << s))
+            {
+                item[i].deflen = (uint8_t)deflen[s];
+                s = item[i].from;
+            }
+        }
+        *first = deflen[s];
+    }
+
+    return 1 + factor_digits(clock) + cost[best];
+}
+
+/* write a token, lengths are taken from item */
+static int length_token(fal2muc_ctx *ctx, const char *p, uint32_t size, uint32_t clock,
+                        uint32_t *deflen, const LENGTH_ITEM **item)
+{
+    int ret = 0;
+    uint32_t i = 0;
+
+    if (memchr(p, LENGTH_MARK, size) != NULL && (*item)->deflen != 0)
+    {
+        *deflen = (*item)->deflen;
+        ret += emit_cmd_uint(ctx, "l", *deflen);
+    }
+    while (i < size)
+    {
+        uint32_t j = i;
+
+        while (j < size && p[j] != LENGTH_MARK)
+        {
+            j++;
+        }
+        ret += emit_mem(ctx, &p[i], j - i);
+        if (j + 1 < size)
+        {
+            uint32_t len = (uint8_t)p[j + 1];
+
+            ret += print_length(ctx, clock, *deflen, len);
+            (*item)++;
+        }
+        i = j + 2;
+    }
+
+    return ret;
+}
+
+/* bytes of a text with the lengths written by print_length() */
+static uint32_t length_size(const char *p, uint32_t size, uint32_t clock, uint32_t deflen)
+{
+    uint32_t ret = 0;
+
+    for (uint32_t i = 0; i < size; i++)
+    {
+        if (p[i] == LENGTH_MARK && i + 1 < size)
+        {
+            ret += length_cost(clock, deflen, (uint8_t)p[++i]);
+        }
+        else
+        {
+            ret++;
+        }
+    }
+
+    return ret;
+}
+
+/*
+ * optimize the MML of a channel in out[base...], loops are factored and
+ * the lengths are encoded, and write it again with line breaks.
+ * ll is the room left in the first line, clock and deflen are the detected ones.
+ */
+static void optimize_channel(fal2muc_ctx *ctx, size_t base, uint32_t m, uint8_t oct_end,
+                             const char *chname, int ll, uint32_t clock, uint32_t deflen)
+{
+    FACTOR f;
+    FACTOR_ITEM *item = NULL;
+    FACTOR_ITEM *next = NULL;
+    LENGTH_ITEM *len = NULL;
+    const LENGTH_ITEM *lp;
+    uint32_t n = 0;
+    uint32_t k = 0;
+    uint32_t item_size = 0;
+    uint32_t next_size = 0;
+    uint32_t best;
+    bool tie = false;
+    size_t size = ctx->out_len - base;
+
+    memset(&f, 0, sizeof(f));
+    f.text = malloc(size + 1);
+    if (f.text == NULL)
+    {
+        ctx->write_error = true;
+        return;
+    }
+    memcpy(f.text, &ctx->out[base], size);
+    f.text_len = (uint32_t)size;
+    f.text_size = (uint32_t)size + 1;
+
+    /* atoms without text are dropped */
+    for (uint32_t i = 0; i < m && !f.error; i++)
+    {
+        const fal2muc_atom *a = &ctx->atom[i];
+        uint32_t end = ((i + 1 < m) ? ctx->atom[i + 1].start : (uint32_t)ctx->out_len) - base;
+        uint32_t start = a->start - (uint32_t)base;
+        FACTOR_ITEM *it;
+
+        if (end == start)
+        {
+            continue;
+        }
+        if (!factor_grow(&f, (void **)&item, &item_size, n + 1, sizeof(FACTOR_ITEM)))
+        {
+            break;
+        }
+        it = &item[n++];
+        it->tok = factor_token(&f, start, end - start, (a->flags & FAL2MUC_ATOM_TIE) != 0);
+        it->ntok = 1;
+        it->size = length_size(&f.text[start], end - start, clock, deflen);
+        it->oct = a->oct;
+        it->open = a->open;
+        it->depth = 0;
+        it->flags = a->flags;
+        it->hash = factor_hash(&f, it);
+    }
+
+    for (uint32_t pass = 0; pass < FACTOR_PASS_MAX && !f.error; pass++)
+    {
+        uint32_t next_len = 0;
+        uint32_t loops = factor_pass(&f, item, n, oct_end, 0, &next, &next_len, &next_size);
+        FACTOR_ITEM *t = item;
+        uint32_t s = item_size;
+
+        /* the result is the input of the next pass */
+        item = next;
+        item_size = next_size;
+        next = t;
+        next_size = s;
+        n = next_len;
+        f.loops += loops;
+        if (loops == 0)
+        {
+            break;
+        }
+    }
+
+    /* lengths in the order of the text, 'l' is not put after a tie */
+    len = malloc(sizeof(LENGTH_ITEM) * (size / 2 + 1));
+    if (len == NULL)
+    {
+        f.error = true;
+    }
+    for (uint32_t i = 0; i < n && !f.error; i++)
+    {
+        for (uint32_t j = 0; j < item[i].ntok; j++)
+        {
+            const FACTOR_TOKEN *t = &f.tok[item[i].tok + j];
+            bool head = !tie;
+
+            for (uint32_t x = 0; x + 1 < t->len; x++)
+            {
+                if (f.text[t->off + x] == LENGTH_MARK)
+                {
+                    len[k].len = (uint8_t)f.text[t->off + ++x];
+                    len[k++].head = head;
+                    head = false;
+                }
+            }
+            if (t->len > 0)
+            {
+                tie = t->tie;
+            }
+        }
+    }
+
+    if (!f.error)
+    {
+        /* the detected clock is kept if it's as short as others */
+        best = length_plan(clock, len, k, false, NULL);
+        for (uint32_t i = 0; i < sizeof(g_length_clock) / sizeof(g_length_clock[0]); i++)
+        {
+            uint32_t b = (g_length_clock[i] != clock)
+                ? length_plan(g_length_clock[i], len, k, false, NULL) : best;
+
+            if (b < best)
+            {
+                best = b;
+                clock = g_length_clock[i];
+            }
+        }
+        length_plan(clock, len, k, true, &deflen);
+
+        ctx->out_len = base;
+        ll -= emit_cmd_uint(ctx, "C", clock);
+        ll -= emit_cmd_uint(ctx, "l", deflen);
+        lp = len;
+        for (uint32_t i = 0; i < n; i++)
+        {
+            for (uint32_t j = 0; j < item[i].ntok; j++)
+            {
+                const FACTOR_TOKEN *t = &f.tok[item[i].tok + j];
+
+                if (ll <= 0)
+                {
+                    emit_char(ctx, '\n');
+                    ll = 70;
+                    ll -= emit_str(ctx, chname);
+                    ll -= emit_char(ctx, ' ');
+                }
+                ll -= length_token(ctx, &f.text[t->off], t->len, clock, &deflen, &lp);
+            }
+        }
+        ctx->stats.factored_loops += f.loops;
+        ctx->stats.factored_bytes += f.saved;
+    }
+    else
+    {
+        /* out of memory, the text is left with the marks */
+        ctx->write_error = true;
+    }
+
+    free(len);
+    free(item);
+    free(next);
+    free(f.tok);
+    free(f.text);
+}
+
+/* X1 OPM tones over 0x5f, played as these tones by the driver */
+static const uint8_t g_x1_illegal_note[] = {
+    0x4e, 0x0b, 0x0e, 0x0b, 0x36, 0x0b, 0x08, 0x09,
+    0x41, 0x09, 0x21, 0x09, 0x08, 0x08, 0x57, 0x08,
+    0x4b, 0x08, 0x47, 0x06, 0x47, 0x06, 0x4d, 0x06,
+    0x20, 0x1e, 0x1d, 0x1a, 0x18, 0x17, 0x14, 0x12,
+};
+
+/* octave * 12 + note of a note as the driver plays it */
+static uint32_t note_pitch(SOUND_TYPE type, uint32_t d)
+{
+    uint32_t n;
+
+    if (!(type & SOUND_TYPE_OPM))
+    {
+        return (((d >> 4) & 0x07) + 1) * 12 + (d & 0x0f) % 12;
+    }
+    n = d & 0x7f;
+    if (n >= 0x60)
+    {
+        n = g_x1_illegal_note[n - 0x60];
+    }
+
+    return n + 15;
+}
+
+/*
+ * body of the converters.
+ * instantiated for each channel class with a constant sound_type,
+ * so that the checks not needed for the class are removed.
+ */
+static FORCE_INLINE void convert_channel(
+    fal2muc_ctx *ctx, uint32_t ch, SOUND_TYPE sound_type, const char *chname,
+    const uint8_t *data, uint8_t *loop_flag, uint8_t *loop_nest)
+{
+    static const char *notestr[16] = {
+        "c", "c+", "d", "d+", "e", "f", "f+", "g", "g+", "a", "a+", "b",
+        "?", "?", "?", "?"
+    };
+    uint8_t rhy_vol[6] = {
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+    };
+    const uint8_t *d = data;
+    const fal2muc_event *ev = ctx->event;
+    const OPCODE *op;
+    uint32_t o = get_word(&data[ch * 2]);
+    uint32_t end;
+    uint32_t n;
+    uint32_t i;
+    uint32_t c;
+    uint32_t rhy_comb = 0;
+    uint32_t prev_oct, oct, note, len;
+    uint32_t ssg_mixer;
+    uint32_t ssg_noise;
+    uint32_t nest;
+    uint32_t clock, deflen;
+    uint32_t timerb_on_ssg = UINT32_MAX;
+    bool init = false;
+    int ll;
+    double t = 0;
+    uint32_t call = 0;
+    bool optimize = ctx->opt.optimize && !ctx->opt.verbose;
+    uint32_t m = 0;
+    size_t base = 0;
+    int ll_base = 0;
+
+    if (ctx->opt.stats)
+    {
+        t = stats_time();
+    }
+    parse_music(ctx, data, o, loop_flag, loop_nest, &end, &clock, &deflen);
+    n = ctx->event_count;
+    if (!check_channel(ctx, o, end, chname))
+    {
+        return;
+    }
+    if (ctx->opt.stats)
+    {
+        call = ctx->stats.calls++ % FAL2MUC_STATS_CALL_MAX;
+        ctx->stats.call[call].chname = chname;
+        ctx->stats.call[call].time_parse = stats_time() - t;
+        ctx->stats.time_parse += ctx->stats.call[call].time_parse;
+        t = stats_time();
+    }
+
+    if (optimize && ctx->atom == NULL)
+    {
+        ctx->atom = malloc(sizeof(fal2muc_atom) * FAL2MUC_BUFF_SIZE);
+        optimize = (ctx->atom != NULL);
+    }
+
+    ll = 0;
+    prev_oct = 0xff;
+    ssg_mixer = 0x02;
+    ssg_noise = 0xff;
+
+    for (i = 0; i < n; i++)
+    {
+        /* optimize: the first line only, broken again by optimize_channel() */
+        if (ll <= 0 && !(optimize && init))
+        {
+            emit_char(ctx, '\n');
+            ll = 70;
+            ll -= emit_str(ctx, chname);
+            ll -= emit_char(ctx, ' ');
+            if (optimize)
+            {
+                /* the header is written again by optimize_channel() */
+                base = ctx->out_len;
+                ll_base = ll;
+            }
+            if (!init)
+            {
+                ll -= emit_cmd_uint(ctx, "C", clock);
+                ll -= emit_cmd_uint(ctx, "l", deflen);
+                init = true;
+            }
+        }
+
+        o = ev[i].offset;
+        if (optimize)
+        {
+            fal2muc_atom *a = &ctx->atom[m++];
+
+            a->start = (uint32_t)ctx->out_len;
+            a->oct = (uint8_t)prev_oct;
+            a->open = loop_nest[o];
+            a->flags = loop_flag[o] ? FAL2MUC_ATOM_LOOP_POINT : 0;
+            if (g_opcode[ev[i].cmd].op == OP_LOOP_END)
+            {
+                a->flags |= FAL2MUC_ATOM_CLOSE;
+            }
+            else if (g_opcode[ev[i].cmd].op == OP_LOOP_EXIT)
+            {
+                a->flags |= FAL2MUC_ATOM_EXIT;
+            }
+        }
+        if (loop_flag[o] || loop_nest[o])
+        {
+            ssg_mixer = 0xff;
+            ssg_noise = 0xff;
+        }
+        if (loop_flag[o])
+        {
+            ll -= emit_str(ctx, " L ");
+        }
+        for (nest = 0; nest < loop_nest[o]; nest++)
+        {
+            ll -= emit_char(ctx, '[');
+        }
+        if (loop_nest[o])
+        {
+            DBG(ctx, "{%04x}", o);
+        }
+
+        c = ev[i].cmd;
+        op = &g_opcode[c];
+        o++;
+        if (!(sound_type & op->apply))
+        {
+            continue;
+        }
+
+        switch (op->op)
+        {
+        case OP_INST:
+            if ((sound_type & SOUND_TYPE_RHYTHM) && ch == 9)
+            {
+                rhy_comb = (uint32_t)d[o] + 1;
+                ll -= emit_cmd_uint(ctx, "@", rhy_comb);
+            }
+            else if (sound_type & SOUND_TYPE_FM)
+            {
+                ll -= emit_cmd_uint(ctx, "@", ctx->inst_map[d[o]]);
+            }
+            else
+            {
+#ifdef USE_SSG_ENV_MACRO
+                ll -= emit_cmd_uint(ctx, "*", (uint32_t)d[o]);
+#else /* USE_SSG_ENV_MACRO */
+                c = d[o];
+                ll -= emit_cmd_bytes(ctx, "E", g_ssg_env[c], 6);
+#endif /* USE_SSG_ENV_MACRO */
+            }
+            break;
+        case OP_VOLUME:
+            if ((sound_type & DRIVER_TYPE_OPNA_RHYTHM) && ch == 9)
+            {
+                int j;
+                c = d[o];
+                for (j = 0; j < 6; j++)
+                {
+                    if (rhy_comb & (1 << j))
+                    {
+                        rhy_vol[j] |= (c << 1) + 1;
+                    }
+                }
+                ll -= emit_cmd_bytes(ctx, "v63,", rhy_vol, 6);
+            }
+            else
+            {
+                ll -= emit_cmd_uint(ctx, "v", d[o]);
+            }
+            break;
+        case OP_GATE:
+            ll -= emit_cmd_uint(ctx, "q", d[o]);
+            break;
+        case OP_DETUNE:
+            ll -= emit_cmd_int(ctx, "D", (char)d[o]);
+            break;
+        case OP_MIXER:
+            if (sound_type & SOUND_TYPE_FM)
+            {
+                /* not supported in MUCOM88 */
+                ll -= emit_cmd_int(ctx, "??@v", d[o]);
+            }
+            else
+            {
+                c = d[o];
+                if ((c>>6) != ssg_mixer)
+                {
+                    ssg_mixer = c >> 6;
+                    ll -= emit_cmd_uint(ctx, "P", ssg_mixer ^ 3);
+                }
+                if ((c&0x1f) != ssg_noise)
+                {
+                    ssg_noise = c & 0x1f;
+                    ll -= emit_cmd_uint(ctx, "w", ssg_noise);
+                }
+            }
+            break;
+        case OP_TEMPO:
+            ll -= emit_cmd_uint(ctx, "t", (uint32_t)d[o]);
+            if (sound_type & SOUND_TYPE_SSG)
+            {
+                if (ctx->ssg_tempo_prev == UINT32_MAX)
+                {
+                    ctx->ssg_tempo_first = (uint32_t)d[o];
+                    ctx->ssg_tempo_prev = (uint32_t)d[o];
+                }
+                else if (ctx->ssg_tempo_prev != (uint32_t)d[o])
+                {
+                    ctx->ssg_tempo_prev = (uint32_t)d[o];
+                    ctx->ssg_tempo_count++;
+                }
+                DBG(ctx, "{%04x}", o - 2);
+            }
+            break;
+        case OP_LOOP_END:
+            DBG(ctx, "{%04x:%04x}", o - 1, o + 4 - get_word(&d[o + 2]));
+            ll -= emit_cmd_uint(ctx, "]", d[o]);
+            ssg_mixer = 0xff;
+            ssg_noise = 0xff;
+            break;
+        case OP_LFO:
+            ll -= emit_cmd_bytes(ctx, "M", &d[o], 2);
+            ll -= emit_cmd_int(ctx, ",", (int16_t)get_word(&d[o + 2]));
+            ll -= emit_cmd_uint(ctx, ",", (uint32_t)d[o + 4]);
+            break;
+        case OP_LFO_SW:
+            if (d[o] == 0x10)
+            {
+                ll -= emit_cmd_uint(ctx, "MF", (d[o + 1] == 0) ? 0 : 1);
+            }
+            else
+            {
+                /* not supported in MUCOM88 */
+                ll -= emit_str(ctx, "??work");
+            }
+            break;
+        case OP_ENVELOPE:
+            ll -= emit_cmd_bytes(ctx, "E", &d[o], 6);
+            if (sound_type & SOUND_TYPE_FM)
+            {
+                DBG(ctx, "{%04x}", o - 1);
+            }
+            break;
+        case OP_REG:
+            ll -= emit_cmd_bytes(ctx, "y", &d[o], 2);
+            if (sound_type & SOUND_TYPE_SSG)
+            {
+                DBG(ctx, "{%04x}", o - 1);
+            }
+            break;
+        case OP_SLUR_ON:
+            /* not compatible with MUCOM88 */
+            ll -= emit_char(ctx, '(');
+            break;
+        case OP_SLUR_OFF:
+            /* not compatible with MUCOM88 */
+            ll -= emit_char(ctx, ')');
+            break;
+        case OP_LOOP_EXIT:
+            if (o + 2 + (int)get_word(&d[o]) >= end)
+            {
+                /* workaround */
+                /*  [PC-8801] Eiyu Densetsu II / MUS002 */
+                /*  [PC-8801] DINOSAUR / 049 */
+                WARN(ctx, "\nDetect wrong '/' command @ %04x\n", o - 1);
+                if (ctx->warning)
+                {
+                    return;
+                }
+            }
+            else
+            {
+                ll -= emit_char(ctx, '/');
+                DBG(ctx, "{%04x:%04x}", o - 1, o + 2 + get_word(&d[o]));
+            }
+            break;
+        case OP_PAN:
+            ll -= emit_cmd_uint(ctx, "p", (uint32_t)(d[o] >> 6));
+            break;
+        case OP_END:
+            break;
+        case OP_REST:
+            len = c & 0x7f;
+#ifdef COMBINE_LONG_REST
+            if ((len == 0x6f)							// length
+                && (i + 1 < n)
+                && (g_opcode[ev[i + 1].cmd].op == OP_REST)	// next command
+                && (!loop_flag[ev[i + 1].offset] && !loop_nest[ev[i + 1].offset])
+                )
+            {
+                len += ev[++i].cmd & 0x7f;
+            }
+#endif /* COMBINE_LONG_REST */
+            ll -= emit_char(ctx, 'r');
+            ll -= emit_length(ctx, optimize, clock, deflen, len);
+            break;
+        case OP_NOTE:
+            len = c;
+#ifdef COMBINE_LONG_TONE
+            if ((len == 0x6f)							// length
+                && (d[o] & 0x80)						// &
+                && !(sound_type & SOUND_TYPE_DUMMY)
+                && (i + 1 < n)
+                && (g_opcode[ev[i + 1].cmd].op == OP_NOTE)	// next command
+                && ((d[ev[i + 1].offset + 1] & 0x7f) == (d[o] & 0x7f))	// next note
+                && (!loop_flag[ev[i + 1].offset] && !loop_nest[ev[i + 1].offset])
+                )
+            {
+                len += ev[++i].cmd;
+                o = ev[i].offset + 1;
+            }
+#endif /* COMBINE_LONG_TONE */
+            if (sound_type & SOUND_TYPE_DUMMY)
+            {
+                ll -= emit_str(ctx, "|r"); /* '|' is workaround for MUCOM88 bug */
+                ll -= emit_length(ctx, optimize, clock, deflen, len);
+                break;
+            }
+            if (!(sound_type & SOUND_TYPE_OPM))
+            {
+                oct = ((d[o] >> 4) & 0x07) + 1;
+                note = d[o] & 0x0f;
+            }
+            else
+            {
+                c = d[o] & 0x7f;
+#if 0
+                if (d[o] == 0xfc)
+                {
+                    /* workaround for [X1] SORCERIAN / SS086 */
+                    c = 0xdc;
+                }
+#endif
+                if (c >= 0x60)
+                {
+                    WARN(ctx, "\nDetect too high tone %02x @ %04x\n", c, o - 1);
+                    if (ctx->warning)
+                    {
+                        return;
+                    }
+                    c = g_x1_illegal_note[(c & 0x7f) - 0x60];
+                }
+                oct = (c + 15) / 12;
+                note = (c + 15) % 12;
+            }
+            if (oct != prev_oct)
+            {
+                if (oct == prev_oct + 1)
+                {
+                    ll -= emit_char(ctx, '>');
+                }
+                else if (oct == prev_oct - 1)
+                {
+                    ll -= emit_char(ctx, '<');
+                }
+                else
+                {
+                    ll -= emit_cmd_uint(ctx, "o", oct);
+                }
+                prev_oct = oct;
+            }
+            ll -= emit_str(ctx, notestr[note]);
+            ll -= emit_length(ctx, optimize, clock, deflen, len);
+            if (d[o] & 0x80)
+            {
+                ll -= emit_char(ctx, '&');
+                if (optimize)
+                {
+                    ctx->atom[m - 1].flags |= FAL2MUC_ATOM_TIE;
+                }
+            }
+            break;
+        }
+    }
+
+    if (optimize && m > 0 && !ctx->write_error)
+    {
+        optimize_channel(ctx, base, m, (uint8_t)prev_oct, chname, ll_base, clock, deflen);
+    }
+
+    emit_char(ctx, '\n');
+
+    if (timerb_on_ssg != UINT32_MAX)
+    {
+        DBG(ctx, "set Timer-B on ch.A\n");
+        emit_cmd_uint(ctx, "A C192t", timerb_on_ssg);
+        emit_char(ctx, '\n');
+    }
+
+    if (ctx->opt.stats)
+    {
+        ctx->stats.call[call].time_convert = stats_time() - t;
+        ctx->stats.time_convert += ctx->stats.call[call].time_convert;
+    }
+
+    emit_flush(ctx);
+
+}
+
+typedef void (*CONVERTER)(fal2muc_ctx *ctx, uint32_t ch, const char *chname,
+                          const uint8_t *data, uint8_t *loop_flag, uint8_t *loop_nest);
+
+#define DEFINE_CONVERTER(name, type) \
+static void name(fal2muc_ctx *ctx, uint32_t ch, const char *chname, \
+                 const uint8_t *data, uint8_t *loop_flag, uint8_t *loop_nest) \
+{ \
+    convert_channel(ctx, ch, (SOUND_TYPE)(type), chname, data, loop_flag, loop_nest); \
+}
+
+DEFINE_CONVERTER(convert_fm,		SOUND_TYPE_FM)
+DEFINE_CONVERTER(convert_fm_stereo,	SOUND_TYPE_FM | SOUND_TYPE_STEREO)
+DEFINE_CONVERTER(convert_rhythm,	SOUND_TYPE_FM | SOUND_TYPE_STEREO | SOUND_TYPE_RHYTHM)
+DEFINE_CONVERTER(convert_opm,		SOUND_TYPE_FM | SOUND_TYPE_STEREO | SOUND_TYPE_OPM)
+DEFINE_CONVERTER(convert_ssg,		SOUND_TYPE_SSG)
+DEFINE_CONVERTER(convert_dummy,		SOUND_TYPE_DUMMY)
+
+void convert_music(fal2muc_ctx *ctx, uint32_t ch, SOUND_TYPE sound_type, const char *chname,
+                   const uint8_t *data, uint8_t *loop_flag, uint8_t *loop_nest)
+{
+    switch ((uint32_t)sound_type)
+    {
+    case SOUND_TYPE_FM:
+        convert_fm(ctx, ch, chname, data, loop_flag, loop_nest);
+        break;
+    case SOUND_TYPE_FM | SOUND_TYPE_STEREO:
+        convert_fm_stereo(ctx, ch, chname, data, loop_flag, loop_nest);
+        break;
+    case SOUND_TYPE_FM | SOUND_TYPE_STEREO | SOUND_TYPE_RHYTHM:
+        convert_rhythm(ctx, ch, chname, data, loop_flag, loop_nest);
+        break;
+    case SOUND_TYPE_FM | SOUND_TYPE_STEREO | SOUND_TYPE_OPM:
+        convert_opm(ctx, ch, chname, data, loop_flag, loop_nest);
+        break;
+    case SOUND_TYPE_SSG:
+        convert_ssg(ctx, ch, chname, data, loop_flag, loop_nest);
+        break;
+    case SOUND_TYPE_DUMMY:
+        convert_dummy(ctx, ch, chname, data, loop_flag, loop_nest);
+        break;
+    default:
+        convert_channel(ctx, ch, sound_type, chname, data, loop_flag, loop_nest);
+        break;
+    }
+}
+
+static DRIVER_TYPE detect_type(const uint8_t *data, bool quiet)
+{
+    DRIVER_TYPE ret = DRIVER_TYPE_OPN;
+    uint32_t ch9;
+
+    if ((get_word(data) / 16) % 2 == 0)
+    {
+        ch9 = get_word(&data[0x0012]);
+        if (ch9 == 0)
+        {
+            if (get_word(&data[0x001a]) == 0)
+            {
+                ret = DRIVER_TYPE_OPNA_VA;
+            }
+            else
+            {
+                ret = DRIVER_TYPE_X1_OPM;
+            }
+        }
+        else
+        {
+            if (data[ch9] == 0xff)
+            {
+                ret = DRIVER_TYPE_OPNA;
+            }
+            else if (data[ch9] == 0xf0)
+            {
+                ret = DRIVER_TYPE_OPNA_RHYTHM;
+            }
+            else
+            {
+                if (!quiet)
+                {
+                    fprintf(stderr, "Unknown driver type: ch9:%04x [%02x %02x %02x %02x]\n",
+                            ch9, data[ch9 + 0], data[ch9 + 1], data[ch9 + 2], data[ch9 + 3]);
+                }
+                ret = DRIVER_TYPE_UNKNOWN;
+            }
+        }
+    }
+
+    return ret;
+}
+
+DRIVER_TYPE detect_driver_type(const uint8_t *data)
+{
+    return detect_type(data, false);
+}
+
+DRIVER_TYPE detect_driver_type_quiet(const uint8_t *data)
+{
+    return detect_type(data, true);
+}
+
+fal2muc_ctx *fal2muc_ctx_new(const fal2muc_option *opt)
+{
+    fal2muc_ctx *ctx = calloc(1, sizeof(fal2muc_ctx));
+
+    if (ctx != NULL)
+    {
+        ctx->opt = *opt;
+        ctx->ssg_tempo_prev = UINT32_MAX;
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            ctx->inst_map[i] = (uint16_t)(i + 1);
+        }
+    }
+
+    return ctx;
+}
+
+void fal2muc_ctx_free(fal2muc_ctx *ctx)
+{
+    if (ctx != NULL)
+    {
+        workers_free(ctx->workers);
+        free(ctx->out);
+        free(ctx->atom);
+        free(ctx);
+    }
+}
+
+static size_t file_sink_write(void *opaque, const void *buf, size_t size)
+{
+    if (size == 0)
+    {
+        return 0;
+    }
+
+    return fwrite(buf, 1, size, (FILE *)opaque);
+}
+
+fal2muc_sink fal2muc_file_sink(FILE *fp)
+{
+    fal2muc_sink sink;
+
+    sink.write = file_sink_write;
+    sink.opaque = fp;
+
+    return sink;
+}
+
+typedef enum
+{
+    CH_ASSIGN_FM0 = 0,
+    CH_ASSIGN_SSG = 3,
+    CH_ASSIGN_FM3 = 6,
+} CH_ASSIGN;
+
+typedef struct
+{
+    SOUND_TYPE type;
+    CH_ASSIGN assign;
+    CONVERTER convert;		/* specialized for type */
+} CH_INFO;
+
+typedef struct
+{
+    uint32_t inst_offset;
+    CH_INFO ch_info[3];
+} DRIVER_INFO;
+
+/* channel layout of each driver type, channels are grouped by 3 */
+static const DRIVER_INFO g_driver_info[] = {
+    [DRIVER_TYPE_OPN] = {
+        0x0010,
+        {
+            {SOUND_TYPE_FM, CH_ASSIGN_FM0, convert_fm},
+            {SOUND_TYPE_SSG, CH_ASSIGN_SSG, convert_ssg},
+            {SOUND_TYPE_NONE, CH_ASSIGN_FM3, NULL},
+        },
+    },
+    [DRIVER_TYPE_OPNA] = {
+        0x0020,
+        {
+            {SOUND_TYPE_FM | SOUND_TYPE_STEREO, CH_ASSIGN_FM3, convert_fm_stereo},
+            {SOUND_TYPE_FM | SOUND_TYPE_STEREO, CH_ASSIGN_FM0, convert_fm_stereo},
+            {SOUND_TYPE_SSG, CH_ASSIGN_SSG, convert_ssg},
+        },
+    },
+    [DRIVER_TYPE_OPNA_RHYTHM] = {
+        0x0020,
+        {
+            {SOUND_TYPE_FM | SOUND_TYPE_STEREO | SOUND_TYPE_RHYTHM, CH_ASSIGN_FM3, convert_rhythm},
+            {SOUND_TYPE_FM | SOUND_TYPE_STEREO, CH_ASSIGN_FM0, convert_fm_stereo},
+            {SOUND_TYPE_SSG, CH_ASSIGN_SSG, convert_ssg},
+        },
+    },
+    [DRIVER_TYPE_OPNA_VA] = {
+        0x0020,
+        {
+            {SOUND_TYPE_FM | SOUND_TYPE_STEREO, CH_ASSIGN_FM0, convert_fm_stereo},
+            {SOUND_TYPE_SSG, CH_ASSIGN_SSG, convert_ssg},
+            {SOUND_TYPE_FM | SOUND_TYPE_STEREO, CH_ASSIGN_FM3, convert_fm_stereo},
+        },
+    },
+    [DRIVER_TYPE_OPNA_MONO] = {
+        0x0020,
+        {
+            {SOUND_TYPE_NONE, CH_ASSIGN_FM3, NULL},
+            {SOUND_TYPE_FM, CH_ASSIGN_FM0, convert_fm},
+            {SOUND_TYPE_SSG, CH_ASSIGN_SSG, convert_ssg},
+        },
+    },
+    [DRIVER_TYPE_X1_OPM] = {
+        0x0020,
+        {
+            {SOUND_TYPE_FM | SOUND_TYPE_STEREO | SOUND_TYPE_OPM, CH_ASSIGN_FM0, convert_opm},
+            {SOUND_TYPE_SSG, CH_ASSIGN_SSG, convert_ssg},
+            {SOUND_TYPE_FM | SOUND_TYPE_STEREO | SOUND_TYPE_OPM, CH_ASSIGN_FM3, convert_opm},
+        },
+    },
+    [DRIVER_TYPE_X1_PSG] = {
+        0x0010,
+        {
+            {SOUND_TYPE_NONE, CH_ASSIGN_FM0, NULL},
+            {SOUND_TYPE_SSG, CH_ASSIGN_SSG, convert_ssg},
+            {SOUND_TYPE_NONE, CH_ASSIGN_FM3, NULL},
+        },
+    },
+};
+
+static const char *g_chname[] = {"A", "B", "C", "D", "E", "F", "H", "I", "J", "G"};
+
+/*
+ * data of the channels, the bytes from it are set to data_limit.
+ * only FAL2MUC_VIEW_SIZE bytes of the image are readable,
+ * the PSG song of X1 data at an offset has less of them.
+ */
+static const uint8_t *song_data(fal2muc_ctx *ctx, const uint8_t *in, size_t in_len,
+                                DRIVER_TYPE driver_type)
+{
+    const uint8_t *data = in;
+    size_t view = (in_len < FAL2MUC_VIEW_SIZE) ? in_len : FAL2MUC_VIEW_SIZE;
+
+    if (driver_type == DRIVER_TYPE_X1_PSG)
+    {
+        data = &in[get_word(&in[0x001a])];
+    }
+    ctx->data_limit = (view > (size_t)(data - in)) ? view - (size_t)(data - in) : 0;
+    ctx->error.code = FAL2MUC_ERROR_NONE;
+    ctx->error.chname = NULL;
+    ctx->error.offset = 0;
+    ctx->warning = false;
+
+    return data;
+}
+
+const uint8_t *fal2muc_ctx_begin(fal2muc_ctx *ctx, const uint8_t *in, size_t in_len,
+                                DRIVER_TYPE driver_type, const fal2muc_sink *out_sink)
+{
+    ctx->data = in;
+    ctx->data_size = in_len;
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+    ctx->sink = *out_sink;
+    ctx->write_error = false;
+    ctx->out_len = 0;
+    memset(ctx->loop_flag, 0, sizeof(ctx->loop_flag));
+    memset(ctx->loop_nest, 0, sizeof(ctx->loop_nest));
+    ctx->ssg_tempo_prev = UINT32_MAX;
+    ctx->ssg_tempo_count = 0;
+
+    return song_data(ctx, in, in_len, driver_type);
+}
+
+/*
+ * channel table and voices.
+ * nothing can be read from a broken header, it stops the conversion even with -w.
+ */
+static bool check_header(fal2muc_ctx *ctx, const uint8_t *data, uint32_t inst_offset)
+{
+    if (ctx->data_limit < inst_offset || get_word(data) > ctx->data_limit
+        || get_word(data) < inst_offset)
+    {
+        data_error(ctx, FAL2MUC_ERROR_HEADER, NULL, (uint32_t)ctx->data_limit);
+        ctx->warning = true;
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * channels of a song converted by opt.threads.
+ * each thread converts into its own context, the MML and the messages of
+ * the channels are recorded and written in the order of the channels,
+ * so the output is the same as converting them one by one.
+ * channels sharing bytes or looping out of themselves are converted one by one,
+ * the loop marks of a channel are seen by the following channels then.
+ */
+#define RECORD_MML (0)
+#define RECORD_MESSAGE (1)
+#define RECORD_HEADER (5)		/* type, size (little endian) */
+
+typedef struct
+{
+    uint32_t ch;
+    const char *chname;
+    CONVERTER convert;
+    uint32_t start;
+    uint32_t end;
+    /* results */
+    uint8_t *record;
+    size_t record_len;
+    size_t record_size;
+    bool record_error;
+    bool warning;
+    fal2muc_error error;
+    fal2muc_stats stats;
+    uint32_t ssg_tempo_first;	/* UINT32_MAX: no tempo */
+    uint32_t ssg_tempo_last;
+    uint32_t ssg_tempo_count;
+} CH_JOB;
+
+typedef struct
+{
+    struct fal2muc_workers *workers;
+    fal2muc_ctx *ctx;
+    pthread_t thread;
+} CH_WORKER;
+
+struct fal2muc_workers
+{
+    CH_WORKER worker[FAL2MUC_CHANNEL_MAX];
+    uint32_t nworker;
+    CH_JOB job[FAL2MUC_CHANNEL_MAX];
+    uint32_t njob;
+    uint32_t next;
+    pthread_mutex_t lock;
+    const fal2muc_ctx *parent;
+    const uint8_t *data;
+};
+
+static void workers_free(struct fal2muc_workers *w)
+{
+    if (w != NULL)
+    {
+        for (uint32_t i = 0; i < w->nworker; i++)
+        {
+            fal2muc_ctx_free(w->worker[i].ctx);
+        }
+        for (uint32_t i = 0; i < FAL2MUC_CHANNEL_MAX; i++)
+        {
+            free(w->job[i].record);
+        }
+        pthread_mutex_destroy(&w->lock);
+        free(w);
+    }
+}
+
+/* contexts for the threads, kept for the next songs */
+static struct fal2muc_workers *workers_get(fal2muc_ctx *ctx, uint32_t threads)
+{
+    struct fal2muc_workers *w = ctx->workers;
+
+    if (w == NULL)
+    {
+        w = calloc(1, sizeof(struct fal2muc_workers));
+        if (w == NULL)
+        {
+            return NULL;
+        }
+        pthread_mutex_init(&w->lock, NULL);
+        ctx->workers = w;
+    }
+    while (w->nworker < threads)
+    {
+        fal2muc_ctx *c = fal2muc_ctx_new(&ctx->opt);
+
+        if (c == NULL)
+        {
+            break;
+        }
+        w->worker[w->nworker].workers = w;
+        w->worker[w->nworker].ctx = c;
+        w->nworker++;
+    }
+
+    return (w->nworker > 0) ? w : NULL;
+}
+
+static void record(CH_JOB *job, uint32_t type, const void *buf, size_t size)
+{
+    if (job->record_len + RECORD_HEADER + size > job->record_size)
+    {
+        size_t n = job->record_size * 2 + RECORD_HEADER + size + 0x1000;
+        uint8_t *p = realloc(job->record, n);
+
+        if (p == NULL)
+        {
+            job->record_error = true;
+            return;
+        }
+        job->record = p;
+        job->record_size = n;
+    }
+    job->record[job->record_len] = (uint8_t)type;
+    for (uint32_t i = 0; i < 4; i++)
+    {
+        job->record[job->record_len + 1 + i] = (uint8_t)((uint32_t)size >> (i * 8));
+    }
+    memcpy(&job->record[job->record_len + RECORD_HEADER], buf, size);
+    job->record_len += RECORD_HEADER + size;
+}
+
+static size_t record_mml(void *opaque, const void *buf, size_t size)
+{
+    record(opaque, RECORD_MML, buf, size);
+
+    return size;
+}
+
+static size_t record_message(void *opaque, const void *buf, size_t size)
+{
+    record(opaque, RECORD_MESSAGE, buf, size);
+
+    return size;
+}
+
+static void convert_job(fal2muc_ctx *c, const fal2muc_ctx *parent, const uint8_t *data,
+                        CH_JOB *job)
+{
+    c->opt = parent->opt;
+    c->data = parent->data;
+    c->data_size = parent->data_size;
+    c->data_limit = parent->data_limit;
+    memcpy(c->inst_map, parent->inst_map, sizeof(c->inst_map));
+    c->error.code = FAL2MUC_ERROR_NONE;
+    c->error.chname = NULL;
+    c->error.offset = 0;
+    c->warning = false;
+    c->write_error = false;
+    c->out_len = 0;
+    c->ssg_tempo_first = UINT32_MAX;
+    c->ssg_tempo_prev = UINT32_MAX;
+    c->ssg_tempo_count = 0;
+    memset(&c->stats, 0, sizeof(c->stats));
+
+    job->record_len = 0;
+    job->record_error = false;
+    c->sink.write = record_mml;
+    c->sink.opaque = job;
+    c->message.write = record_message;
+    c->message.opaque = job;
+
+    /* the loops of the channel are only in its own bytes */
+    memset(&c->loop_flag[job->start], 0, job->end - job->start);
+    memset(&c->loop_nest[job->start], 0, job->end - job->start);
+    job->convert(c, job->ch, job->chname, data, c->loop_flag, c->loop_nest);
+    emit_flush(c);
+
+    job->warning = c->warning;
+    job->error = c->error;
+    job->stats = c->stats;
+    job->ssg_tempo_first = c->ssg_tempo_first;
+    job->ssg_tempo_last = c->ssg_tempo_prev;
+    job->ssg_tempo_count = c->ssg_tempo_count;
+}
+
+static void *channel_worker(void *arg)
+{
+    CH_WORKER *worker = arg;
+    struct fal2muc_workers *w = worker->workers;
+    uint32_t i;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&w->lock);
+        i = w->next++;
+        pthread_mutex_unlock(&w->lock);
+        if (i >= w->njob)
+        {
+            break;
+        }
+        convert_job(worker->ctx, w->parent, w->data, &w->job[i]);
+    }
+
+    return NULL;
+}
+
+static void replay_job(fal2muc_ctx *ctx, const CH_JOB *job)
+{
+    const uint8_t *p = job->record;
+    const uint8_t *tail = &job->record[job->record_len];
+    fal2muc_stats *st = &ctx->stats;
+    uint32_t call;
+    size_t size;
+
+    while (p < tail)
+    {
+        size = (size_t)p[1] | ((size_t)p[2] << 8) | ((size_t)p[3] << 16) | ((size_t)p[4] << 24);
+        if (p[0] == RECORD_MESSAGE)
+        {
+            if (ctx->message.write != NULL)
+            {
+                ctx->message.write(ctx->message.opaque, &p[RECORD_HEADER], size);
+            }
+            else
+            {
+                fwrite(&p[RECORD_HEADER], 1, size, stdout);
+            }
+        }
+        else if (!ctx->write_error
+                 && ctx->sink.write(ctx->sink.opaque, &p[RECORD_HEADER], size) != size)
+        {
+            ctx->write_error = true;
+        }
+        p += RECORD_HEADER + size;
+    }
+
+    if (job->error.code != FAL2MUC_ERROR_NONE && ctx->error.code == FAL2MUC_ERROR_NONE)
+    {
+        ctx->error = job->error;
+    }
+    if (job->warning)
+    {
+        ctx->warning = true;
+    }
+
+    /* tempo changes across the channels */
+    if (job->ssg_tempo_first != UINT32_MAX)
+    {
+        if (ctx->ssg_tempo_prev != UINT32_MAX && ctx->ssg_tempo_prev != job->ssg_tempo_first)
+        {
+            ctx->ssg_tempo_count++;
+        }
+        ctx->ssg_tempo_count += job->ssg_tempo_count;
+        ctx->ssg_tempo_prev = job->ssg_tempo_last;
+    }
+
+    if (ctx->opt.stats)
+    {
+        for (uint32_t i = 0; i < job->stats.calls && i < FAL2MUC_STATS_CALL_MAX; i++)
+        {
+            call = st->calls++ % FAL2MUC_STATS_CALL_MAX;
+            st->call[call] = job->stats.call[i];
+        }
+        st->time_parse += job->stats.time_parse;
+        st->time_convert += job->stats.time_convert;
+        st->time_flush += job->stats.time_flush;
+        st->bytes_decoded += job->stats.bytes_decoded;
+        st->events += job->stats.events;
+        st->notes += job->stats.notes;
+        st->rests += job->stats.rests;
+        for (uint32_t i = 0; i < 16; i++)
+        {
+            st->cmds[i] += job->stats.cmds[i];
+        }
+        st->loops += job->stats.loops;
+        st->warnings += job->stats.warnings;
+        st->mml_bytes += job->stats.mml_bytes;
+        st->factored_loops += job->stats.factored_loops;
+        st->factored_bytes += job->stats.factored_bytes;
+    }
+}
+
+/*
+ * convert the channels with the threads,
+ * returns false without any output if they are to be converted one by one.
+ */
+static bool convert_channels_parallel(fal2muc_ctx *ctx, const uint8_t *data,
+                                      const CH_INFO *ch_info, const char **chname)
+{
+    struct fal2muc_workers *w;
+    fal2muc_ctx *c;
+    CH_JOB *job;
+    uint32_t threads = ctx->opt.threads;
+    uint32_t n = 0;
+    uint32_t i, j;
+
+    if (threads < 2)
+    {
+        return false;
+    }
+    if (threads > FAL2MUC_CHANNEL_MAX)
+    {
+        threads = FAL2MUC_CHANNEL_MAX;
+    }
+    w = workers_get(ctx, threads);
+    if (w == NULL)
+    {
+        return false;
+    }
+
+    for (i = 0; i < 10; i++)
+    {
+        const CH_INFO *info = &ch_info[(i < 9) ? i / 3 : 0];
+
+        if ((i < 9) ? (info->type != SOUND_TYPE_NONE) : ((info->type & SOUND_TYPE_RHYTHM) != 0))
+        {
+            job = &w->job[n++];
+            job->ch = i;
+            job->chname = (i < 9) ? chname[info->assign + (i % 3)] : chname[9];
+            job->convert = info->convert;
+        }
+    }
+    if (n < 2)
+    {
+        return false;
+    }
+
+    /* bytes of each channel, they must be in the view and not shared */
+    c = w->worker[0].ctx;
+    c->opt.stats = false;
+    c->data_limit = ctx->data_limit;
+    for (i = 0; i < n; i++)
+    {
+        job = &w->job[i];
+        job->start = get_word(&data[job->ch * 2]);
+        decode_music(c, data, job->start, NULL, NULL, &job->end);
+        if (c->loop_error != UINT32_MAX
+            || (size_t)(data - ctx->data) + job->end > FAL2MUC_VIEW_SIZE)
+        {
+            return false;
+        }
+        for (j = 0; j < i; j++)
+        {
+            if (job->start < w->job[j].end && w->job[j].start < job->end)
+            {
+                return false;
+            }
+        }
+    }
+
+    w->njob = n;
+    w->next = 0;
+    w->parent = ctx;
+    w->data = data;
+    if (threads > n)
+    {
+        threads = n;
+    }
+    if (threads > w->nworker)
+    {
+        threads = w->nworker;
+    }
+    for (i = 1; i < threads; i++)
+    {
+        if (pthread_create(&w->worker[i].thread, NULL, channel_worker, &w->worker[i]) != 0)
+        {
+            break;
+        }
+    }
+    threads = i;
+    channel_worker(&w->worker[0]);
+    for (i = 1; i < threads; i++)
+    {
+        pthread_join(w->worker[i].thread, NULL);
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        if (w->job[i].record_error)
+        {
+            return false;
+        }
+    }
+    for (i = 0; i < n && !ctx->warning; i++)
+    {
+        replay_job(ctx, &w->job[i]);
+    }
+
+    return true;
+}
+
+static FAL2MUC_STATUS convert_data(fal2muc_ctx *ctx, const uint8_t *in, size_t in_len,
+                                   const fal2muc_sink *out_sink)
+{
+    const uint8_t *data = in;
+    uint32_t ch;
+    const char **chname = g_chname;
+    const fal2muc_option *opt = &ctx->opt;
+    DRIVER_TYPE driver_type = opt->driver_type;
+    const CH_INFO *ch_info;
+    uint32_t inst_offset;
+    double t = 0;
+    double time_detect = 0;
+
+    /* driver type */
+    if (driver_type == DRIVER_TYPE_UNKNOWN)
+    {
+        if (opt->stats)
+        {
+            t = stats_time();
+        }
+        driver_type = detect_driver_type(data);
+        if (opt->stats)
+        {
+            time_detect = stats_time() - t;
+        }
+    }
+
+    if (driver_type == DRIVER_TYPE_UNKNOWN
+        || driver_type >= sizeof(g_driver_info) / sizeof(g_driver_info[0]))
+    {
+        return FAL2MUC_UNKNOWN_DRIVER;
+    }
+    ch_info = g_driver_info[driver_type].ch_info;
+    inst_offset = g_driver_info[driver_type].inst_offset;
+    data = fal2muc_ctx_begin(ctx, in, in_len, driver_type, out_sink);
+    ctx->stats.time_detect = time_detect;
+
+    /* insert tag */
+    if (opt->mucom88ver != NULL)
+    {
+        emit_str(ctx, "#mucom88 ");
+        emit_str(ctx, opt->mucom88ver);
+        emit_char(ctx, '\n');
+    }
+    if (opt->title != NULL)
+    {
+        emit_str(ctx, "#title ");
+        emit_str(ctx, opt->title);
+        emit_char(ctx, '\n');
+    }
+    if (opt->author != NULL)
+    {
+        emit_str(ctx, "#author ");
+        emit_str(ctx, opt->author);
+        emit_char(ctx, '\n');
+    }
+    if (opt->composer != NULL)
+    {
+        emit_str(ctx, "#composer ");
+        emit_str(ctx, opt->composer);
+        emit_char(ctx, '\n');
+    }
+    if (opt->date != NULL)
+    {
+        emit_str(ctx, "#date ");
+        emit_str(ctx, opt->date);
+        emit_char(ctx, '\n');
+    }
+    if (opt->comment != NULL)
+    {
+        emit_str(ctx, "#comment ");
+        emit_str(ctx, opt->comment);
+        emit_char(ctx, '\n');
+    }
+    emit_char(ctx, '\n');
+
+    /* convert */
+    check_header(ctx, data, inst_offset);
+
+    if (opt->stats)
+    {
+        t = stats_time();
+    }
+    if (!ctx->warning)
+    {
+        convert_inst(ctx, data, inst_offset);
+    }
+    if (opt->stats)
+    {
+        ctx->stats.time_inst = stats_time() - t;
+    }
+
+#ifdef USE_SSG_ENV_MACRO
+    emit_mem(ctx, g_ssg_inst, sizeof(g_ssg_inst) - 1);
+#endif /* USE_SSG_ENV_MACRO */
+    emit_flush(ctx);
+
+    /* one by one unless the threads have done */
+    if (ctx->warning || !convert_channels_parallel(ctx, data, ch_info, chname))
+    {
+        for (ch = 0; ch < 9 && !ctx->warning; ch++)
+        {
+            if (ch_info[ch / 3].type != SOUND_TYPE_NONE)
+            {
+                ch_info[ch / 3].convert(
+                    ctx,
+                    ch,
+                    chname[ch_info[ch / 3].assign + (ch % 3)],
+                    data, ctx->loop_flag, ctx->loop_nest);
+            }
+        }
+        if ((ch_info[0].type & SOUND_TYPE_RHYTHM) && !ctx->warning)
+        {
+            ch_info[0].convert(
+                ctx,
+                9,
+                chname[9],
+                data, ctx->loop_flag, ctx->loop_nest);
+        }
+    }
+
+    /* Control tempo in X1 PSG data */
+    if (ctx->ssg_tempo_count > 1 && driver_type == DRIVER_TYPE_X1_PSG && !ctx->warning)
+    {
+        DBG(ctx, "Use FM channel for changing tempo\n");
+        memset(ctx->loop_flag, 0, sizeof(ctx->loop_flag));
+        memset(ctx->loop_nest, 0, sizeof(ctx->loop_nest));
+
+        for (ch = 0; ch < 3; ch++)
+        {
+            convert_dummy(
+                ctx,
+                3 + ch,
+                chname[CH_ASSIGN_FM0 + ch],
+                data, ctx->loop_flag, ctx->loop_nest);
+        }
+    }
+
+    emit_flush(ctx);
+
+    if (ctx->warning)
+    {
+        return (ctx->error.code != FAL2MUC_ERROR_NONE) ? FAL2MUC_BAD_DATA : FAL2MUC_WARNING;
+    }
+    if (ctx->write_error)
+    {
+        return FAL2MUC_WRITE_ERROR;
+    }
+
+    return FAL2MUC_OK;
+}
+
+FAL2MUC_STATUS fal2muc_convert(fal2muc_ctx *ctx, const uint8_t *in, size_t in_len,
+                               const fal2muc_sink *out_sink)
+{
+    if (in_len >= FAL2MUC_VIEW_SIZE)
+    {
+        return convert_data(ctx, in, in_len, out_sink);
+    }
+
+    /* short buffer, copy it to read past the end as zero */
+    memmove(ctx->buff, in, in_len);
+    memset(&ctx->buff[in_len], 0, sizeof(ctx->buff) - in_len);
+
+    return convert_data(ctx, ctx->buff, in_len, out_sink);
+}
+
+FAL2MUC_STATUS fal2muc_convert_input(fal2muc_ctx *ctx, const fal2muc_input *input,
+                                     const fal2muc_sink *out_sink)
+{
+    return convert_data(ctx, input->data, input->size, out_sink);
+}
+
+bool fal2muc_bank_add(fal2muc_ctx *ctx, fal2muc_bank *bank, const fal2muc_input *input)
+{
+    const uint8_t *data = input->data;
+    DRIVER_TYPE type = ctx->opt.driver_type;
+    uint32_t offset;
+    uint32_t sub = 0;
+    uint32_t end;
+
+    if (type == DRIVER_TYPE_UNKNOWN)
+    {
+        type = detect_driver_type(data);
+    }
+    if (type == DRIVER_TYPE_UNKNOWN || type >= sizeof(g_driver_info) / sizeof(g_driver_info[0]))
+    {
+        return true;
+    }
+    offset = g_driver_info[type].inst_offset;
+    if (type == DRIVER_TYPE_X1_PSG)
+    {
+        sub = get_word(&data[0x001a]);
+    }
+
+    /* same table as convert_inst(), only inside the readable view */
+    end = get_word(&data[sub]);
+    if (end < offset || sub + end > FAL2MUC_VIEW_SIZE)
+    {
+        return true;
+    }
+    for (uint32_t i = 0; i < (end - offset) / 0x20 && i < 256; i++)
+    {
+        const uint8_t *voice = &data[sub + offset + i * 0x20];
+
+        if (bank_find(bank, voice) >= 0)
+        {
+            continue;
+        }
+        if (bank->count == FAL2MUC_BANK_MAX)
+        {
+            return false;
+        }
+        memcpy(bank->voice[bank->count++], voice, 0x20);
+    }
+
+    return true;
+}
+
+FAL2MUC_STATUS fal2muc_convert_bank(fal2muc_ctx *ctx, const fal2muc_bank *bank,
+                                    const fal2muc_sink *out_sink)
+{
+    ctx->sink = *out_sink;
+    ctx->write_error = false;
+    ctx->out_len = 0;
+
+    for (uint32_t i = 0; i < bank->count; i++)
+    {
+        dump_inst(ctx, i, bank->voice[i], 0);
+    }
+    emit_flush(ctx);
+
+    return ctx->write_error ? FAL2MUC_WRITE_ERROR : FAL2MUC_OK;
+}
+
+/*
+ * simulator for the length of songs.
+ * the byte code is executed as the driver does, loops are repeated,
+ * '/' leaves a loop at the last time, and tempo commands are recorded.
+ */
+#define SIM_STEP_MAX (0x400000)		/* commands executed in a channel */
+#define SIM_NEST_MAX (16)
+#define SIM_TEMPO_MAX (0x10000)
+#define SIM_TEMPO_DEFAULT (200)
+#define SIM_OPN_CLOCK (3993600.0)
+
+typedef struct
+{
+    uint64_t tick;
+    uint32_t seq;				/* order of the same tick */
+    uint8_t tempo;
+} SIM_TEMPO;
+
+typedef struct
+{
+    SIM_TEMPO *tempo;
+    uint32_t count;
+    uint32_t size;
+} SIM;
+
+static void sim_tempo(SIM *sim, uint64_t tick, uint8_t tempo)
+{
+    if (sim->count == sim->size)
+    {
+        uint32_t size = (sim->size == 0) ? 64 : sim->size * 2;
+        SIM_TEMPO *p;
+
+        if (size > SIM_TEMPO_MAX || (p = realloc(sim->tempo, sizeof(SIM_TEMPO) * size)) == NULL)
+        {
+            return;
+        }
+        sim->tempo = p;
+        sim->size = size;
+    }
+    sim->tempo[sim->count].tick = tick;
+    sim->tempo[sim->count].seq = sim->count;
+    sim->tempo[sim->count].tempo = tempo;
+    sim->count++;
+}
+
+/* loops being played by a channel */
+typedef struct
+{
+    struct
+    {
+        uint32_t pos;			/* f6 */
+        uint32_t left;			/* times to play including the current one */
+    } frame[SIM_NEST_MAX];
+    uint32_t sp;
+} LOOP_STACK;
+
+/* f6 at o, returns the next command, UINT32_MAX if nested too deep */
+static uint32_t loop_end(LOOP_STACK *ls, const uint8_t *data, uint32_t o)
+{
+    uint32_t i;
+
+    for (i = ls->sp; i > 0 && ls->frame[i - 1].pos != o; i--)
+    {
+    }
+    if (i == 0)
+    {
+        if (ls->sp == SIM_NEST_MAX)
+        {
+            return UINT32_MAX;
+        }
+        ls->frame[ls->sp].pos = o;
+        ls->frame[ls->sp].left = (data[o + 1] != 0) ? data[o + 1] : 256;
+        i = ++ls->sp;
+    }
+    if (--ls->frame[i - 1].left > 0)
+    {
+        return o + 5 - get_word(&data[o + 3]);
+    }
+    ls->sp = i - 1;
+
+    return o + 5;
+}
+
+/* fd at o, to the next of f6 at the last time. the wrong ones are ignored like -w */
+static uint32_t loop_exit(LOOP_STACK *ls, const uint8_t *data, uint32_t o,
+                          uint32_t start, uint32_t end)
+{
+    uint32_t w = o + 3 + get_word(&data[o + 1]);
+    uint32_t left;
+    uint32_t i;
+
+    if (w >= end || w < start + 5 || data[w - 5] != 0xf6)
+    {
+        return o + 3;
+    }
+    for (i = ls->sp; i > 0 && ls->frame[i - 1].pos != w - 5; i--)
+    {
+    }
+    left = (i > 0) ? ls->frame[i - 1].left : (data[w - 4] != 0) ? data[w - 4] : 256;
+    if (left > 1)
+    {
+        return o + 3;
+    }
+    if (i > 0)
+    {
+        ls->sp = i - 1;
+    }
+
+    return w;
+}
+
+/* loop point of a channel decoded by decode_music(), UINT32_MAX: not looped */
+static uint32_t loop_point(fal2muc_ctx *ctx, const uint8_t *data)
+{
+    uint32_t o = ctx->event[ctx->event_count - 1].offset;
+    uint32_t w = get_word(&data[o + 1]);
+
+    return (w != 0) ? o + 3 - w : UINT32_MAX;
+}
+
+/* a channel up to the end, returns false if it's broken or endless */
+static bool simulate_channel(fal2muc_ctx *ctx, const uint8_t *data, uint32_t ch, const char *chname,
+                             fal2muc_channel_time *t, SIM *sim)
+{
+    LOOP_STACK ls;
+    uint32_t start = get_word(&data[ch * 2]);
+    uint32_t o = start;
+    uint32_t end;
+    uint32_t n;
+    uint32_t loop;
+    uint64_t intro = UINT64_MAX;
+    uint64_t tick = 0;
+
+    t->chname = chname;
+    t->ticks = 0;
+    t->intro = 0;
+    t->loop = 0;
+
+    n = decode_music(ctx, data, start, NULL, NULL, &end);
+    if (!check_channel(ctx, start, end, chname) || n == 0)
+    {
+        return false;
+    }
+    loop = loop_point(ctx, data);
+    ls.sp = 0;
+
+    for (uint32_t step = 0; step < SIM_STEP_MAX && o >= start && o < end; step++)
+    {
+        uint8_t c = data[o];
+
+        if (o == loop && intro == UINT64_MAX)
+        {
+            intro = tick;
+        }
+        switch (g_opcode[c].op)
+        {
+        case OP_NOTE:
+            tick += c;
+            break;
+        case OP_REST:
+            tick += c & 0x7f;
+            break;
+        case OP_TEMPO:
+            sim_tempo(sim, tick, data[o + 1]);
+            break;
+        case OP_LOOP_END:
+            o = loop_end(&ls, data, o);
+            continue;
+        case OP_LOOP_EXIT:
+            o = loop_exit(&ls, data, o, start, end);
+            continue;
+        case OP_END:
+            if (tick > UINT32_MAX)
+            {
+                return false;
+            }
+            t->ticks = (uint32_t)tick;
+            if (intro != UINT64_MAX && tick > intro)
+            {
+                t->intro = (uint32_t)intro;
+                t->loop = (uint32_t)(tick - intro);
+            }
+            else
+            {
+                t->intro = (uint32_t)tick;
+            }
+            return true;
+        default:
+            break;
+        }
+        o += g_opcode[c].size;
+    }
+
+    return false;
+}
+
+static int compare_tempo(const void *a, const void *b)
+{
+    const SIM_TEMPO *ta = a;
+    const SIM_TEMPO *tb = b;
+
+    if (ta->tick != tb->tick)
+    {
+        return (ta->tick < tb->tick) ? -1 : 1;
+    }
+
+    return (ta->seq < tb->seq) ? -1 : (ta->seq > tb->seq);
+}
+
+/* seconds from the start to tick, tempo is sorted */
+static double sim_seconds(const SIM *sim, uint64_t tick)
+{
+    uint32_t tempo = SIM_TEMPO_DEFAULT;
+    uint64_t last = 0;
+    double sec = 0;
+
+    for (uint32_t i = 0; i < sim->count && sim->tempo[i].tick < tick; i++)
+    {
+        sec += (double)(sim->tempo[i].tick - last) * 1152.0 * (256 - tempo) / SIM_OPN_CLOCK;
+        tempo = sim->tempo[i].tempo;
+        last = sim->tempo[i].tick;
+    }
+
+    return sec + (double)(tick - last) * 1152.0 * (256 - tempo) / SIM_OPN_CLOCK;
+}
+
+static uint64_t gcd(uint64_t a, uint64_t b)
+{
+    while (b != 0)
+    {
+        uint64_t r = a % b;
+
+        a = b;
+        b = r;
+    }
+
+    return a;
+}
+
+static FAL2MUC_STATUS simulate_data(fal2muc_ctx *ctx, const uint8_t *in, size_t in_len,
+                                    fal2muc_timing *timing)
+{
+    DRIVER_TYPE driver_type = ctx->opt.driver_type;
+    const CH_INFO *ch_info;
+    const uint8_t *data;
+    SIM sim = {NULL, 0, 0};
+    uint32_t first[FAL2MUC_CHANNEL_MAX + 1];
+    uint64_t loop = 0;
+    uint64_t loop_max = 0;
+    uint64_t intro = 0;
+    uint32_t ch;
+    uint32_t i;
+
+    memset(timing, 0, sizeof(*timing));
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+    if (driver_type == DRIVER_TYPE_UNKNOWN)
+    {
+        driver_type = detect_driver_type(in);
+    }
+    if (driver_type == DRIVER_TYPE_UNKNOWN
+        || driver_type >= sizeof(g_driver_info) / sizeof(g_driver_info[0]))
+    {
+        return FAL2MUC_UNKNOWN_DRIVER;
+    }
+    ch_info = g_driver_info[driver_type].ch_info;
+    data = song_data(ctx, in, in_len, driver_type);
+    check_header(ctx, data, g_driver_info[driver_type].inst_offset);
+
+    /* channels in the order of the MML */
+    for (ch = 0; ch < 10 && !ctx->warning; ch++)
+    {
+        const CH_INFO *info = &ch_info[(ch < 9) ? ch / 3 : 0];
+        fal2muc_channel_time *t = &timing->ch[timing->channels];
+
+        if ((ch < 9) ? (info->type == SOUND_TYPE_NONE) : !(info->type & SOUND_TYPE_RHYTHM))
+        {
+            continue;
+        }
+        first[timing->channels] = sim.count;
+        if (!simulate_channel(ctx, data, ch,
+                              g_chname[(ch < 9) ? info->assign + (ch % 3) : 9], t, &sim))
+        {
+            if (!ctx->warning)
+            {
+                /* endless or too deep, not in the song anyway */
+                data_error(ctx, FAL2MUC_ERROR_LOOP, t->chname, 0);
+            }
+            continue;
+        }
+        timing->channels++;
+    }
+    first[timing->channels] = sim.count;
+
+    /* the loop of the song is the common multiple of the loops of channels */
+    for (i = 0; i < timing->channels; i++)
+    {
+        const fal2muc_channel_time *t = &timing->ch[i];
+
+        if (t->loop == 0)
+        {
+            intro = (t->ticks > intro) ? t->ticks : intro;
+            continue;
+        }
+        intro = (t->intro > intro) ? t->intro : intro;
+        if (loop != 0 && loop != t->loop)
+        {
+            timing->desync = true;
+        }
+        loop = (loop == 0) ? t->loop : loop / gcd(loop, t->loop) * t->loop;
+        loop_max = (t->loop > loop_max) ? t->loop : loop_max;
+        if (loop > UINT32_MAX)
+        {
+            /* never meets in practice, the longest one is the loop */
+            loop = UINT32_MAX + (uint64_t)1;
+        }
+    }
+    if (loop > UINT32_MAX)
+    {
+        loop = loop_max;
+    }
+    timing->intro = (uint32_t)intro;
+    timing->loop = (uint32_t)loop;
+
+    /* tempo commands in the loops are played again */
+    for (i = 0; i < timing->channels; i++)
+    {
+        const fal2muc_channel_time *t = &timing->ch[i];
+
+        for (uint32_t j = first[i]; j < first[i + 1] && t->loop != 0; j++)
+        {
+            for (uint64_t tick = sim.tempo[j].tick + t->loop;
+                 sim.tempo[j].tick >= t->intro && tick < intro + loop && sim.count < SIM_TEMPO_MAX;
+                 tick += t->loop)
+            {
+                sim_tempo(&sim, tick, sim.tempo[j].tempo);
+            }
+        }
+    }
+    if (sim.count > 0)
+    {
+        qsort(sim.tempo, sim.count, sizeof(SIM_TEMPO), compare_tempo);
+    }
+    timing->intro_sec = sim_seconds(&sim, intro);
+    timing->loop_sec = sim_seconds(&sim, intro + loop) - timing->intro_sec;
+    free(sim.tempo);
+
+    if (ctx->warning)
+    {
+        return (ctx->error.code != FAL2MUC_ERROR_NONE) ? FAL2MUC_BAD_DATA : FAL2MUC_WARNING;
+    }
+
+    return FAL2MUC_OK;
+}
+
+FAL2MUC_STATUS fal2muc_simulate(fal2muc_ctx *ctx, const uint8_t *in, size_t in_len,
+                                fal2muc_timing *timing)
+{
+    if (in_len >= FAL2MUC_VIEW_SIZE)
+    {
+        return simulate_data(ctx, in, in_len, timing);
+    }
+
+    /* short buffer, copy it to read past the end as zero */
+    memmove(ctx->buff, in, in_len);
+    memset(&ctx->buff[in_len], 0, sizeof(ctx->buff) - in_len);
+
+    return simulate_data(ctx, ctx->buff, in_len, timing);
+}
+
+FAL2MUC_STATUS fal2muc_simulate_input(fal2muc_ctx *ctx, const fal2muc_input *input,
+                                      fal2muc_timing *timing)
+{
+    return simulate_data(ctx, input->data, input->size, timing);
+}
+
+/*
+ * fingerprint of songs for near-duplicate detection.
+ * the notes of a channel are taken in the played order as the interval from
+ * the last note in semitones modulo an octave and the ratio of the length to
+ * the last one, so the transposition, octave shifts, the clock and the tempo
+ * don't change them, and the voices and the volume are ignored.
+ * runs of FP_SHINGLE notes of all channels are hashed, the song is the MinHash of them
+ * with one hash split into FAL2MUC_SIGNATURE_SIZE bins.
+ */
+#define FP_SHINGLE (5)
+#define FP_ROWS (2)					/* hashes in a band of the index */
+#define FP_BUCKET_CMP (16)			/* songs compared in a bucket of the index */
+#define FP_SEEN_SIZE (4096)
+
+typedef struct
+{
+    fal2muc_signature *sig;
+    uint32_t token[FP_SHINGLE];
+    uint32_t count;
+    bool last;					/* pitch and len of the last note are valid */
+    uint32_t last_pitch;
+    uint32_t last_len;
+    uint32_t seen[FP_SEEN_SIZE];	/* runs hashed, the repeats by loops are skipped */
+} FP;
+
+static uint32_t fp_mix(uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+
+    return h;
+}
+
+/* ratio of len to the last one, -3 - 3 */
+static int32_t fp_ratio(uint32_t len, uint32_t last)
+{
+    static const uint32_t limit[] = {5, 9, 13, 21, 28, 48};	/* 1/16 of the last */
+    uint64_t l = (uint64_t)len * 16;
+    int32_t i;
+
+    for (i = 0; i < 6 && l >= (uint64_t)last * limit[i]; i++)
+    {
+    }
+
+    return i - 3;
+}
+
+/* a note ends, pitch and len (to the next note) */
+static void fp_note(FP *fp, uint32_t pitch, uint32_t len)
+{
+    fal2muc_signature *sig = fp->sig;
+    uint32_t h = 2166136261u;
+
+    if (!fp->last)
+    {
+        fp->last = true;
+        fp->last_pitch = pitch;
+        fp->last_len = len;
+        return;
+    }
+    memmove(&fp->token[0], &fp->token[1], sizeof(fp->token[0]) * (FP_SHINGLE - 1));
+    fp->token[FP_SHINGLE - 1] = ((pitch + 12 * 16 - fp->last_pitch) % 12) * 8
+        + (uint32_t)(fp_ratio(len, fp->last_len) + 3);
+    fp->last_pitch = pitch;
+    fp->last_len = len;
+    if (++fp->count < FP_SHINGLE)
+    {
+        return;
+    }
+
+    for (uint32_t i = 0; i < FP_SHINGLE; i++)
+    {
+        h = (h ^ fp->token[i]) * 16777619u;
+    }
+    sig->shingles++;
+    if (fp->seen[h % FP_SEEN_SIZE] == h)
+    {
+        return;
+    }
+    fp->seen[h % FP_SEEN_SIZE] = h;
+
+    /* one permutation: the minimum of each bin of the hash */
+    h = fp_mix(h);
+    if (h / FAL2MUC_SIGNATURE_SIZE < sig->hash[h % FAL2MUC_SIGNATURE_SIZE])
+    {
+        sig->hash[h % FAL2MUC_SIGNATURE_SIZE] = h / FAL2MUC_SIGNATURE_SIZE;
+    }
+}
+
+/* notes of a channel up to the end, returns false if it's broken or endless */
+static bool fingerprint_channel(fal2muc_ctx *ctx, const uint8_t *data, uint32_t ch, SOUND_TYPE type,
+                                const char *chname, FP *fp)
+{
+    LOOP_STACK ls;
+    uint32_t start = get_word(&data[ch * 2]);
+    uint32_t o = start;
+    uint32_t end;
+    uint32_t pitch = UINT32_MAX;	/* the note being played */
+    uint32_t len = 0;
+    bool tie = false;
+
+    if (decode_music(ctx, data, start, NULL, NULL, &end) == 0 || !check_channel(ctx, start, end, chname))
+    {
+        return false;
+    }
+    fp->count = 0;
+    fp->last = false;
+    ls.sp = 0;
+
+    for (uint32_t step = 0; step < SIM_STEP_MAX && o >= start && o < end; step++)
+    {
+        uint8_t c = data[o];
+
+        switch (g_opcode[c].op)
+        {
+        case OP_NOTE:
+            if (!tie || note_pitch(type, data[o + 1]) != pitch)
+            {
+                if (pitch != UINT32_MAX)
+                {
+                    fp_note(fp, pitch, len);
+                }
+                pitch = note_pitch(type, data[o + 1]);
+                len = 0;
+            }
+            len += c;
+            tie = (data[o + 1] & 0x80) != 0;
+            break;
+        case OP_REST:
+            /* a part of the last note */
+            len += c & 0x7f;
+            tie = false;
+            break;
+        case OP_LOOP_END:
+            o = loop_end(&ls, data, o);
+            continue;
+        case OP_LOOP_EXIT:
+            o = loop_exit(&ls, data, o, start, end);
+            continue;
+        case OP_END:
+            if (pitch != UINT32_MAX)
+            {
+                fp_note(fp, pitch, len);
+            }
+            return true;
+        default:
+            break;
+        }
+        o += g_opcode[c].size;
+    }
+
+    return false;
+}
+
+static FAL2MUC_STATUS fingerprint_data(fal2muc_ctx *ctx, const uint8_t *in, size_t in_len,
+                                       fal2muc_signature *sig)
+{
+    DRIVER_TYPE driver_type = ctx->opt.driver_type;
+    const CH_INFO *ch_info;
+    const uint8_t *data;
+    FP fp;
+
+    memset(sig->hash, 0xff, sizeof(sig->hash));
+    sig->shingles = 0;
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+    if (driver_type == DRIVER_TYPE_UNKNOWN)
+    {
+        driver_type = detect_driver_type(in);
+    }
+    if (driver_type == DRIVER_TYPE_UNKNOWN
+        || driver_type >= sizeof(g_driver_info) / sizeof(g_driver_info[0]))
+    {
+        return FAL2MUC_UNKNOWN_DRIVER;
+    }
+    ch_info = g_driver_info[driver_type].ch_info;
+    data = song_data(ctx, in, in_len, driver_type);
+    check_header(ctx, data, g_driver_info[driver_type].inst_offset);
+    memset(&fp, 0, sizeof(fp));
+    fp.sig = sig;
+
+    /* the rhythm has no melody */
+    for (uint32_t ch = 0; ch < 9 && !ctx->warning; ch++)
+    {
+        const CH_INFO *info = &ch_info[ch / 3];
+        const char *chname = g_chname[info->assign + (ch % 3)];
+
+        if (info->type == SOUND_TYPE_NONE)
+        {
+            continue;
+        }
+        if (!fingerprint_channel(ctx, data, ch, info->type, chname, &fp) && !ctx->warning)
+        {
+            data_error(ctx, FAL2MUC_ERROR_LOOP, chname, 0);
+        }
+    }
+
+    if (ctx->warning)
+    {
+        return (ctx->error.code != FAL2MUC_ERROR_NONE) ? FAL2MUC_BAD_DATA : FAL2MUC_WARNING;
+    }
+
+    return FAL2MUC_OK;
+}
+
+FAL2MUC_STATUS fal2muc_fingerprint(fal2muc_ctx *ctx, const uint8_t *in, size_t in_len,
+                                   fal2muc_signature *sig)
+{
+    if (in_len >= FAL2MUC_VIEW_SIZE)
+    {
+        return fingerprint_data(ctx, in, in_len, sig);
+    }
+
+    /* short buffer, copy it to read past the end as zero */
+    memmove(ctx->buff, in, in_len);
+    memset(&ctx->buff[in_len], 0, sizeof(ctx->buff) - in_len);
+
+    return fingerprint_data(ctx, ctx->buff, in_len, sig);
+}
+
+FAL2MUC_STATUS fal2muc_fingerprint_input(fal2muc_ctx *ctx, const fal2muc_input *input,
+                                         fal2muc_signature *sig)
+{
+    return fingerprint_data(ctx, input->data, input->size, sig);
+}
+
+double fal2muc_signature_similarity(const fal2muc_signature *a, const fal2muc_signature *b)
+{
+    uint32_t same = 0;
+    uint32_t used = 0;
+
+    if (a->shingles == 0 || b->shingles == 0)
+    {
+        return 0.0;
+    }
+    /* the bins empty in both songs don't count */
+    for (uint32_t k = 0; k < FAL2MUC_SIGNATURE_SIZE; k++)
+    {
+        if (a->hash[k] != UINT32_MAX || b->hash[k] != UINT32_MAX)
+        {
+            used++;
+            same += (a->hash[k] == b->hash[k]);
+        }
+    }
+
+    return (double)same / used;
+}
+
+typedef struct
+{
+    uint32_t key;
+    uint32_t index;
+} FP_BUCKET;
+
+static int compare_bucket(const void *a, const void *b)
+{
+    const FP_BUCKET *ba = a;
+    const FP_BUCKET *bb = b;
+
+    if (ba->key != bb->key)
+    {
+        return (ba->key < bb->key) ? -1 : 1;
+    }
+
+    return (ba->index < bb->index) ? -1 : (ba->index > bb->index);
+}
+
+static uint32_t group_root(uint32_t *group, uint32_t i)
+{
+    while (group[i] != i)
+    {
+        group[i] = group[group[i]];
+        i = group[i];
+    }
+
+    return i;
+}
+
+/*
+ * the songs which share the hashes of a band are compared (LSH),
+ * the similar ones are joined into a group.
+ */
+bool fal2muc_signature_group(const fal2muc_signature *sig, uint32_t count, double threshold,
+                             uint32_t *group)
+{
+    FP_BUCKET *bucket = malloc(sizeof(FP_BUCKET) * ((count > 0) ? count : 1));
+
+    if (bucket == NULL)
+    {
+        return false;
+    }
+    for (uint32_t i = 0; i < count; i++)
+    {
+        group[i] = i;
+    }
+
+    for (uint32_t band = 0; band < FAL2MUC_SIGNATURE_SIZE / FP_ROWS; band++)
+    {
+        uint32_t n = 0;
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+            uint32_t key = band;
+
+            if (sig[i].shingles == 0)
+            {
+                continue;
+            }
+            for (uint32_t k = 0; k < FP_ROWS; k++)
+            {
+                key = fp_mix(key ^ sig[i].hash[band * FP_ROWS + k]);
+            }
+            bucket[n].key = key;
+            bucket[n].index = i;
+            n++;
+        }
+        if (n > 0)
+        {
+            qsort(bucket, n, sizeof(FP_BUCKET), compare_bucket);
+        }
+
+        for (uint32_t i = 0, first = 0; i < n; i++)
+        {
+            if (bucket[i].key != bucket[first].key)
+            {
+                first = i;
+            }
+            /* the recent ones in a crowded bucket */
+            for (uint32_t j = (i - first > FP_BUCKET_CMP) ? i - FP_BUCKET_CMP : first; j < i; j++)
+            {
+                uint32_t a = group_root(group, bucket[j].index);
+                uint32_t b = group_root(group, bucket[i].index);
+
+                if (a != b && fal2muc_signature_similarity(&sig[bucket[j].index],
+                                                           &sig[bucket[i].index]) >= threshold)
+                {
+                    /* the first song is the root */
+                    if (a < b)
+                    {
+                        group[b] = a;
+                    }
+                    else
+                    {
+                        group[a] = b;
+                    }
+                }
+            }
+        }
+    }
+    free(bucket);
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        group[i] = group_root(group, i);
+    }
+
+    return true;
+}
+
+/*
+ * renderer to register writes of the sound chip.
+ * the channels are played tick by tick like the driver, the chip is the one
+ * of playback in the MML (YM2203 or YM2608) and the log is VGM or S98.
+ */
+#define RENDER_RATE (44100)
+#define RENDER_OPN_CLOCK (3993600)
+#define RENDER_OPNA_CLOCK (7987200)
+#define RENDER_SEC_MAX (3600)			/* longer songs are cut, without the loop */
+#define RENDER_STEP_MAX (0x10000)		/* commands executed in a tick */
+#define RENDER_VGM_HEADER (0x100)
+#define RENDER_S98_HEADER (0x30)
+#define RENDER_WAV_HEADER (44)
+
+/* F-Number of o4 (block 5) and SSG tone period of o1 */
+static const uint16_t g_fnum[12] = {
+    618, 655, 694, 735, 779, 825, 874, 926, 981, 1040, 1102, 1167,
+};
+static const uint16_t g_ssg_tp[12] = {
+    1908, 1801, 1700, 1604, 1514, 1429, 1349, 1273, 1202, 1135, 1071, 1011,
+};
+
+/* TL added to the carriers by volume */
+static const uint8_t g_fm_volume[16] = {
+    0x2a, 0x28, 0x25, 0x22, 0x20, 0x1d, 0x1a, 0x18,
+    0x15, 0x12, 0x10, 0x0d, 0x0a, 0x08, 0x05, 0x02,
+};
+
+/* carriers of each algorithm in the register order (S1, S3, S2, S4) */
+static const uint8_t g_fm_carrier[8] = {
+    0x08, 0x08, 0x08, 0x08, 0x0c, 0x0e, 0x0e, 0x0f,
+};
+
+typedef enum
+{
+    ENV_ATTACK,
+    ENV_DECAY,
+    ENV_SUSTAIN,
+    ENV_RELEASE,
+    ENV_OFF,
+} ENV_PHASE;
+
+typedef struct
+{
+    SOUND_TYPE type;
+    uint32_t ch;
+    uint32_t port;
+    uint32_t hw;				/* channel in the port */
+    uint32_t start;
+    uint32_t end;
+    uint32_t loop;				/* loop point, UINT32_MAX: not looped */
+    uint32_t pc;
+    LOOP_STACK ls;
+    bool done;
+    uint32_t wait;				/* ticks to the next command */
+    uint32_t gate_left;			/* ticks to key off, 0: kept on */
+    bool key;
+    bool tie;					/* the last note is tied to the next */
+    bool slur;
+    uint32_t note;				/* 0x80 + octave * 12 + note, 0: none */
+    const uint8_t *voice;
+    uint32_t volume;
+    uint32_t gate;
+    int32_t detune;
+    uint8_t mixer;				/* f4 */
+    /* pitch LFO */
+    bool lfo_on;
+    uint8_t lfo_delay;
+    uint8_t lfo_speed;
+    int16_t lfo_depth;
+    uint8_t lfo_count;
+    uint32_t lfo_wait;
+    uint32_t lfo_step;
+    int32_t lfo_offset;
+    int32_t lfo_dir;
+    /* SSG envelope: AL, AR, DR, SL, SR, RR */
+    uint8_t env[6];
+    ENV_PHASE env_phase;
+    uint32_t env_level;
+    /* rhythm */
+    uint32_t rhy_comb;
+    uint8_t rhy_vol[6];
+} RENDER_CH;
+
+typedef struct
+{
+    FAL2MUC_RENDER format;
+    bool opna;
+    const uint8_t *data;
+    size_t limit;
+    uint32_t inst_offset;
+    uint32_t tempo;
+    uint64_t frac;				/* samples * RENDER_OPN_CLOCK not written yet */
+    RENDER_CH ch[FAL2MUC_CHANNEL_MAX];
+    uint32_t channels;
+    uint16_t shadow[2][256];	/* 0x100 | value written */
+    uint8_t ssg_mixer;
+    OPN_SYNTH *synth;			/* FAL2MUC_RENDER_WAV */
+    /* log */
+    uint8_t *buf;
+    size_t len;
+    size_t size;
+    bool error;
+    uint32_t pending;			/* samples to wait before the next write */
+    uint64_t samples;
+    size_t loop_pos;			/* SIZE_MAX: not looped */
+    uint64_t loop_samples;
+} RENDER;
+
+/* n bytes at the end of the log, NULL if no memory */
+static uint8_t *log_reserve(RENDER *r, size_t n)
+{
+    if (r->len + n > r->size)
+    {
+        size_t size = (r->size == 0) ? 0x10000 : r->size * 2;
+        uint8_t *buf;
+
+        while (size < r->len + n)
+        {
+            size *= 2;
+        }
+        buf = realloc(r->buf, size);
+        if (buf == NULL)
+        {
+            r->error = true;
+            return NULL;
+        }
+        r->buf = buf;
+        r->size = size;
+    }
+    r->len += n;
+
+    return &r->buf[r->len - n];
+}
+
+static void log_bytes(RENDER *r, const uint8_t *p, size_t n)
+{
+    uint8_t *dst = log_reserve(r, n);
+
+    if (dst != NULL)
+    {
+        memcpy(dst, p, n);
+    }
+}
+
+static void log_flush_wait(RENDER *r)
+{
+    uint32_t n = r->pending;
+    uint8_t b[4];
+
+    r->pending = 0;
+    if (r->format == FAL2MUC_RENDER_WAV)
+    {
+        uint8_t *dst = log_reserve(r, (size_t)n * 4);
+
+        if (dst != NULL)
+        {
+            opn_synth_run(r->synth, dst, n);
+        }
+        return;
+    }
+    if (r->format == FAL2MUC_RENDER_S98)
+    {
+        /* 0xff: 1 sync, 0xfe: n - 2 in 7 bits from the bottom */
+        if (n == 1)
+        {
+            b[0] = 0xff;
+            log_bytes(r, b, 1);
+        }
+        else if (n > 1)
+        {
+            b[0] = 0xfe;
+            log_bytes(r, b, 1);
+            for (n -= 2; n >= 0x80; n >>= 7)
+            {
+                b[0] = (uint8_t)(0x80 | (n & 0x7f));
+                log_bytes(r, b, 1);
+            }
+            b[0] = (uint8_t)n;
+            log_bytes(r, b, 1);
+        }
+        return;
+    }
+    while (n > 0)
+    {
+        uint32_t m = (n > 0xffff) ? 0xffff : n;
+
+        if (m <= 16)
+        {
+            b[0] = (uint8_t)(0x70 + m - 1);
+            log_bytes(r, b, 1);
+        }
+        else if (m == 735 || m == 882)
+        {
+            b[0] = (m == 735) ? 0x62 : 0x63;
+            log_bytes(r, b, 1);
+        }
+        else
+        {
+            b[0] = 0x61;
+            b[1] = (uint8_t)m;
+            b[2] = (uint8_t)(m >> 8);
+            log_bytes(r, b, 3);
+        }
+        n -= m;
+    }
+}
+
+static void render_reg(RENDER *r, uint32_t port, uint32_t reg, uint32_t val)
+{
+    uint8_t b[3];
+
+    val &= 0xff;
+    /* key on and rhythm are triggers */
+    if (reg != 0x28 && reg != 0x10 && r->shadow[port][reg] == (0x100 | val))
+    {
+        return;
+    }
+    r->shadow[port][reg] = (uint16_t)(0x100 | val);
+    log_flush_wait(r);
+    if (r->format == FAL2MUC_RENDER_WAV)
+    {
+        opn_synth_write(r->synth, port, reg, val);
+        return;
+    }
+    if (r->format == FAL2MUC_RENDER_S98)
+    {
+        b[0] = (uint8_t)port;
+    }
+    else
+    {
+        b[0] = !r->opna ? 0x55 : (port == 0) ? 0x56 : 0x57;
+    }
+    b[1] = (uint8_t)reg;
+    b[2] = (uint8_t)val;
+    log_bytes(r, b, 3);
+}
+
+/* a tick at the current tempo (Timer-B of OPN) */
+static void render_tick_wait(RENDER *r)
+{
+    uint32_t n;
+
+    r->frac += (uint64_t)RENDER_RATE * 1152 * (256 - r->tempo);
+    n = (uint32_t)(r->frac / RENDER_OPN_CLOCK);
+    r->frac %= RENDER_OPN_CLOCK;
+    r->pending += n;
+    r->samples += n;
+}
+
+static void render_fm_volume(RENDER *r, RENDER_CH *c)
+{
+    uint32_t al;
+    uint32_t add = g_fm_volume[(c->volume < 16) ? c->volume : 15];
+
+    if (c->voice == NULL)
+    {
+        return;
+    }
+    al = c->voice[24] & 0x07;
+    for (uint32_t i = 0; i < 4; i++)
+    {
+        uint32_t tl = c->voice[4 + i] & 0x7f;
+
+        if (g_fm_carrier[al] & (1 << i))
+        {
+            tl = (tl + add > 0x7f) ? 0x7f : tl + add;
+        }
+        render_reg(r, c->port, 0x40 + i * 4 + c->hw, tl);
+    }
+}
+
+static void render_fm_voice(RENDER *r, RENDER_CH *c, uint32_t num)
+{
+    uint32_t o = r->inst_offset + num * 0x20;
+
+    if (o + 0x20 > r->limit)
+    {
+        return;
+    }
+    c->voice = &r->data[o];
+    /* DT/ML, TL, KS/AR, DR, SR, SL/RR */
+    for (uint32_t g = 0; g < 6; g++)
+    {
+        if (g == 1)
+        {
+            continue;
+        }
+        for (uint32_t i = 0; i < 4; i++)
+        {
+            render_reg(r, c->port, 0x30 + g * 0x10 + i * 4 + c->hw, c->voice[g * 4 + i]);
+        }
+    }
+    render_reg(r, c->port, 0xb0 + c->hw, c->voice[24]);
+    render_fm_volume(r, c);
+}
+
+static void render_pitch(RENDER *r, RENDER_CH *c)
+{
+    uint32_t oct;
+    uint32_t note;
+    int32_t v;
+
+    if (c->note == 0)
+    {
+        return;
+    }
+    oct = (c->note - 0x80) / 12;
+    note = (c->note - 0x80) % 12;
+    if (c->type & SOUND_TYPE_FM)
+    {
+        uint32_t block = oct + 1;
+
+        v = g_fnum[note] + c->detune + c->lfo_offset;
+        while (block > 7)
+        {
+            v *= 2;
+            block--;
+        }
+        v = (v < 0) ? 0 : (v > 0x7ff) ? 0x7ff : v;
+        render_reg(r, c->port, 0xa4 + c->hw, (block << 3) | ((uint32_t)v >> 8));
+        render_reg(r, c->port, 0xa0 + c->hw, (uint32_t)v);
+    }
+    else
+    {
+        v = (((g_ssg_tp[note] << 1) >> (oct - 1)) + 1) / 2 - c->detune - c->lfo_offset;
+        v = (v < 1) ? 1 : (v > 0xfff) ? 0xfff : v;
+        render_reg(r, 0, c->hw * 2, (uint32_t)v);
+        render_reg(r, 0, c->hw * 2 + 1, (uint32_t)v >> 8);
+    }
+}
+
+static void render_ssg_volume(RENDER *r, RENDER_CH *c)
+{
+    uint32_t v = (c->volume > 15) ? 15 : c->volume;
+
+    if (c->env_phase == ENV_OFF)
+    {
+        v = 0;
+    }
+    else
+    {
+        v = (v * c->env_level + 127) / 255;
+    }
+    render_reg(r, 0, 0x08 + c->hw, v);
+}
+
+static void render_key(RENDER *r, RENDER_CH *c, bool on)
+{
+    if (c->type & SOUND_TYPE_FM)
+    {
+        render_reg(r, 0, 0x28, (on ? 0xf0 : 0x00) | (c->port << 2) | c->hw);
+    }
+    else if (on)
+    {
+        c->env_phase = ENV_ATTACK;
+        c->env_level = c->env[0];
+    }
+    else if (c->env_phase != ENV_OFF)
+    {
+        c->env_phase = ENV_RELEASE;
+    }
+    c->key = on;
+}
+
+/* envelope and LFO of a tick */
+static void render_update(RENDER *r, RENDER_CH *c)
+{
+    if (c->lfo_on && c->key)
+    {
+        if (c->lfo_wait > 0)
+        {
+            c->lfo_wait--;
+        }
+        else
+        {
+            c->lfo_wait = (c->lfo_speed > 0) ? c->lfo_speed - 1 : 0;
+            c->lfo_offset += c->lfo_depth * c->lfo_dir;
+            if (--c->lfo_step == 0)
+            {
+                c->lfo_step = (c->lfo_count != 0) ? c->lfo_count : 256;
+                c->lfo_dir = -c->lfo_dir;
+            }
+            render_pitch(r, c);
+        }
+    }
+
+    if (!(c->type & SOUND_TYPE_SSG))
+    {
+        return;
+    }
+    switch (c->env_phase)
+    {
+    case ENV_ATTACK:
+        c->env_level += c->env[1];
+        if (c->env_level >= 0xff)
+        {
+            c->env_level = 0xff;
+            c->env_phase = ENV_DECAY;
+        }
+        break;
+    case ENV_DECAY:
+        c->env_level = (c->env_level > c->env[3] + c->env[2]) ? c->env_level - c->env[2] : c->env[3];
+        if (c->env_level == c->env[3])
+        {
+            c->env_phase = ENV_SUSTAIN;
+        }
+        break;
+    case ENV_SUSTAIN:
+        c->env_level = (c->env_level > c->env[4]) ? c->env_level - c->env[4] : 0;
+        break;
+    case ENV_RELEASE:
+        c->env_level = (c->env_level > c->env[5]) ? c->env_level - c->env[5] : 0;
+        if (c->env_level == 0)
+        {
+            c->env_phase = ENV_OFF;
+        }
+        break;
+    default:
+        break;
+    }
+    render_ssg_volume(r, c);
+}
+
+static void render_note(RENDER *r, RENDER_CH *c, uint32_t len, uint32_t d)
+{
+    bool legato = (c->tie || c->slur) && c->key;
+
+    if (c->ch == 9)
+    {
+        /* rhythm: the instruments selected by '@' */
+        render_reg(r, 0, 0x10, c->rhy_comb & 0x3f);
+        c->tie = false;
+        c->gate_left = 0;
+        return;
+    }
+    c->note = 0x80 + note_pitch(c->type, d);
+    if (!legato)
+    {
+        if (c->key)
+        {
+            render_key(r, c, false);
+        }
+        c->lfo_wait = c->lfo_delay;
+        c->lfo_step = (c->lfo_count != 0) ? c->lfo_count : 256;
+        c->lfo_offset = 0;
+        c->lfo_dir = 1;
+    }
+    render_pitch(r, c);
+    if (!legato)
+    {
+        render_key(r, c, true);
+    }
+    c->tie = (d & 0x80) != 0;
+    c->gate_left = (c->tie || c->slur) ? 0 : (c->gate < len) ? len - c->gate : len;
+}
+
+/* commands up to the next note or rest */
+static void render_command(RENDER *r, RENDER_CH *c)
+{
+    const uint8_t *d = r->data;
+
+    for (uint32_t step = 0; step < RENDER_STEP_MAX; step++)
+    {
+        uint32_t o = c->pc;
+        uint32_t cmd;
+        uint32_t len;
+
+        if (o < c->start || o >= c->end)
+        {
+            break;
+        }
+        cmd = d[o];
+        c->pc = o + g_opcode[cmd].size;
+        /* the commands not for the channel are skipped like the converter */
+        if (!(c->type & g_opcode[cmd].apply) && g_opcode[cmd].op != OP_LOOP_END
+            && g_opcode[cmd].op != OP_LOOP_EXIT && g_opcode[cmd].op != OP_END)
+        {
+            continue;
+        }
+        switch (g_opcode[cmd].op)
+        {
+        case OP_NOTE:
+            render_note(r, c, cmd, d[o + 1]);
+            if (cmd > 0)
+            {
+                c->wait = cmd;
+                return;
+            }
+            break;
+        case OP_REST:
+            len = cmd & 0x7f;
+            if (c->key)
+            {
+                render_key(r, c, false);
+            }
+            c->tie = false;
+            c->gate_left = 0;
+            if (len > 0)
+            {
+                c->wait = len;
+                return;
+            }
+            break;
+        case OP_INST:
+            if (c->ch == 9)
+            {
+                c->rhy_comb = (uint32_t)d[o + 1] + 1;
+            }
+            else if (c->type & SOUND_TYPE_FM)
+            {
+                render_fm_voice(r, c, d[o + 1]);
+            }
+            else if (d[o + 1] < 12)
+            {
+                memcpy(c->env, g_ssg_env[d[o + 1]], 6);
+            }
+            break;
+        case OP_VOLUME:
+            if (c->ch == 9)
+            {
+                for (uint32_t j = 0; j < 6; j++)
+                {
+                    if (c->rhy_comb & (1 << j))
+                    {
+                        c->rhy_vol[j] |= (uint8_t)((d[o + 1] << 1) + 1);
+                        render_reg(r, 0, 0x18 + j, 0xc0 | (c->rhy_vol[j] & 0x1f));
+                    }
+                }
+                break;
+            }
+            c->volume = d[o + 1];
+            if (c->type & SOUND_TYPE_FM)
+            {
+                render_fm_volume(r, c);
+            }
+            break;
+        case OP_GATE:
+            c->gate = d[o + 1];
+            break;
+        case OP_DETUNE:
+            c->detune = (int8_t)d[o + 1];
+            break;
+        case OP_MIXER:
+            if (c->type & SOUND_TYPE_SSG)
+            {
+                /* bit 6: tone off, bit 7: noise off */
+                uint32_t m = d[o + 1] >> 6;
+
+                r->ssg_mixer &= (uint8_t)~(0x09 << c->hw);
+                r->ssg_mixer |= (uint8_t)((((m & 1) ? 0x01 : 0) | ((m & 2) ? 0x08 : 0)) << c->hw);
+                render_reg(r, 0, 0x07, r->ssg_mixer);
+                render_reg(r, 0, 0x06, d[o + 1] & 0x1f);
+            }
+            break;
+        case OP_TEMPO:
+            r->tempo = d[o + 1];
+            break;
+        case OP_LOOP_END:
+            c->pc = loop_end(&c->ls, d, o);
+            break;
+        case OP_LFO:
+            c->lfo_delay = d[o + 1];
+            c->lfo_speed = d[o + 2];
+            c->lfo_depth = (int16_t)get_word(&d[o + 3]);
+            c->lfo_count = d[o + 5];
+            c->lfo_on = true;
+            break;
+        case OP_LFO_SW:
+            if (d[o + 1] == 0x10)
+            {
+                c->lfo_on = (d[o + 2] != 0);
+                c->lfo_offset = 0;
+            }
+            break;
+        case OP_ENVELOPE:
+            if (c->type & SOUND_TYPE_SSG)
+            {
+                memcpy(c->env, &d[o + 1], 6);
+            }
+            break;
+        case OP_REG:
+            render_reg(r, c->port, d[o + 1], d[o + 2]);
+            break;
+        case OP_SLUR_ON:
+            c->slur = true;
+            break;
+        case OP_SLUR_OFF:
+            c->slur = false;
+            break;
+        case OP_LOOP_EXIT:
+            c->pc = loop_exit(&c->ls, d, o, c->start, c->end);
+            break;
+        case OP_PAN:
+            if (c->type & SOUND_TYPE_FM)
+            {
+                render_reg(r, c->port, 0xb4 + c->hw, d[o + 1] & 0xc0);
+            }
+            break;
+        case OP_END:
+            if (c->loop == UINT32_MAX)
+            {
+                c->pc = c->end;
+            }
+            else
+            {
+                c->pc = c->loop;
+            }
+            break;
+        }
+    }
+
+    /* the end of the song, or broken */
+    if (c->key)
+    {
+        render_key(r, c, false);
+    }
+    c->done = true;
+}
+
+static void render_channel_tick(RENDER *r, RENDER_CH *c)
+{
+    if (c->done)
+    {
+        render_update(r, c);
+        return;
+    }
+    if (c->wait == 0)
+    {
+        render_command(r, c);
+    }
+    render_update(r, c);
+    if (c->gate_left > 0 && --c->gate_left == 0 && c->key)
+    {
+        render_key(r, c, false);
+    }
+    if (c->wait > 0)
+    {
+        c->wait--;
+    }
+}
+
+/* YM2608 is used for the drivers with 6 FM channels */
+static bool render_opna(DRIVER_TYPE driver_type)
+{
+    return (driver_type == DRIVER_TYPE_OPNA || driver_type == DRIVER_TYPE_OPNA_RHYTHM
+            || driver_type == DRIVER_TYPE_OPNA_VA || driver_type == DRIVER_TYPE_X1_OPM);
+}
+
+static bool render_init(fal2muc_ctx *ctx, RENDER *r, DRIVER_TYPE driver_type, const uint8_t *data)
+{
+    const CH_INFO *ch_info = g_driver_info[driver_type].ch_info;
+
+    r->opna = render_opna(driver_type);
+    r->data = data;
+    r->limit = ctx->data_limit;
+    r->inst_offset = g_driver_info[driver_type].inst_offset;
+    r->tempo = SIM_TEMPO_DEFAULT;
+    r->loop_pos = SIZE_MAX;
+    memset(r->shadow, 0, sizeof(r->shadow));
+
+    for (uint32_t ch = 0; ch < 10; ch++)
+    {
+        const CH_INFO *info = &ch_info[(ch < 9) ? ch / 3 : 0];
+        RENDER_CH *c = &r->ch[r->channels];
+        uint32_t end;
+
+        if ((ch < 9) ? (info->type == SOUND_TYPE_NONE) : !(info->type & SOUND_TYPE_RHYTHM))
+        {
+            continue;
+        }
+        memset(c, 0, sizeof(*c));
+        c->type = info->type;
+        c->ch = ch;
+        c->start = get_word(&data[ch * 2]);
+        if (decode_music(ctx, data, c->start, NULL, NULL, &end) == 0
+            || !check_channel(ctx, c->start, end, g_chname[(ch < 9) ? info->assign + (ch % 3) : 9]))
+        {
+            if (ctx->warning)
+            {
+                return false;
+            }
+            continue;
+        }
+        c->end = end;
+        c->loop = loop_point(ctx, data);
+        c->pc = c->start;
+        c->hw = (info->assign == CH_ASSIGN_FM3) ? 3 + ch % 3 : ch % 3;
+        c->port = c->hw / 3;
+        c->hw %= 3;
+        c->volume = 15;
+        memcpy(c->env, g_ssg_env[0], 6);
+        c->env_phase = ENV_OFF;
+        r->channels++;
+    }
+
+    if (r->opna)
+    {
+        /* 6 channels of FM, and the rhythm at full level */
+        render_reg(r, 0, 0x29, 0x80);
+        render_reg(r, 0, 0x11, 0x3f);
+    }
+    for (uint32_t port = 0; port < (r->opna ? 2u : 1u); port++)
+    {
+        for (uint32_t hw = 0; hw < 3; hw++)
+        {
+            render_reg(r, 0, 0x28, (port << 2) | hw);
+            if (r->opna)
+            {
+                render_reg(r, port, 0xb4 + hw, 0xc0);
+            }
+        }
+    }
+    r->ssg_mixer = 0x38;
+    render_reg(r, 0, 0x07, r->ssg_mixer);
+    for (uint32_t hw = 0; hw < 3; hw++)
+    {
+        render_reg(r, 0, 0x08 + hw, 0);
+    }
+
+    return true;
+}
+
+static void put_dword(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+/* header of the log, returns the size */
+static size_t render_header(const RENDER *r, uint8_t *h)
+{
+    uint32_t clock = r->opna ? RENDER_OPNA_CLOCK : RENDER_OPN_CLOCK;
+
+    if (r->format == FAL2MUC_RENDER_WAV)
+    {
+        /* PCM, 2 channels, 16 bits */
+        memcpy(h, "RIFF", 4);
+        put_dword(&h[0x04], (uint32_t)(RENDER_WAV_HEADER - 8 + r->len));
+        memcpy(&h[0x08], "WAVEfmt ", 8);
+        put_dword(&h[0x10], 16);
+        put_dword(&h[0x14], 0x00020001);
+        put_dword(&h[0x18], RENDER_RATE);
+        put_dword(&h[0x1c], RENDER_RATE * 4);
+        put_dword(&h[0x20], 0x00100004);
+        memcpy(&h[0x24], "data", 4);
+        put_dword(&h[0x28], (uint32_t)r->len);
+        return RENDER_WAV_HEADER;
+    }
+    if (r->format == FAL2MUC_RENDER_S98)
+    {
+        memset(h, 0, RENDER_S98_HEADER);
+        memcpy(h, "S983", 4);
+        put_dword(&h[0x04], 1);				/* a sync is 1 / RENDER_RATE second */
+        put_dword(&h[0x08], RENDER_RATE);
+        put_dword(&h[0x14], RENDER_S98_HEADER);
+        if (r->loop_pos != SIZE_MAX)
+        {
+            put_dword(&h[0x18], (uint32_t)(RENDER_S98_HEADER + r->loop_pos));
+        }
+        put_dword(&h[0x1c], 1);
+        put_dword(&h[0x20], r->opna ? 4 : 2);	/* YM2608, YM2203 */
+        put_dword(&h[0x24], clock);
+        return RENDER_S98_HEADER;
+    }
+
+    memset(h, 0, RENDER_VGM_HEADER);
+    memcpy(h, "Vgm ", 4);
+    put_dword(&h[0x04], (uint32_t)(RENDER_VGM_HEADER + r->len - 4));
+    put_dword(&h[0x08], 0x151);
+    put_dword(&h[0x18], (uint32_t)r->samples);
+    if (r->loop_pos != SIZE_MAX)
+    {
+        put_dword(&h[0x1c], (uint32_t)(RENDER_VGM_HEADER + r->loop_pos - 0x1c));
+        put_dword(&h[0x20], (uint32_t)(r->samples - r->loop_samples));
+    }
+    put_dword(&h[0x34], RENDER_VGM_HEADER - 0x34);
+    put_dword(&h[r->opna ? 0x48 : 0x44], clock);
+
+    return RENDER_VGM_HEADER;
+}
+
+static FAL2MUC_STATUS render_data(fal2muc_ctx *ctx, const uint8_t *in, size_t in_len,
+                                  FAL2MUC_RENDER format, const fal2muc_sink *out_sink)
+{
+    DRIVER_TYPE driver_type = ctx->opt.driver_type;
+    fal2muc_timing timing;
+    FAL2MUC_STATUS status;
+    RENDER *r;
+    const uint8_t *data;
+    uint64_t ticks;
+    uint8_t header[RENDER_VGM_HEADER];
+    size_t n;
+    uint8_t b = (format == FAL2MUC_RENDER_S98) ? 0xfd : 0x66;
+
+    /* the length and the check of the data */
+    status = simulate_data(ctx, in, in_len, &timing);
+    if (status == FAL2MUC_UNKNOWN_DRIVER || ctx->warning)
+    {
+        return status;
+    }
+    if (driver_type == DRIVER_TYPE_UNKNOWN)
+    {
+        driver_type = detect_type(in, true);
+    }
+    data = song_data(ctx, in, in_len, driver_type);
+    ctx->warning = false;
+
+    r = calloc(1, sizeof(RENDER));
+    if (r == NULL)
+    {
+        return FAL2MUC_WRITE_ERROR;
+    }
+    r->format = format;
+    if (format == FAL2MUC_RENDER_WAV)
+    {
+        r->synth = malloc(sizeof(OPN_SYNTH));
+        if (r->synth == NULL)
+        {
+            free(r);
+            return FAL2MUC_WRITE_ERROR;
+        }
+        opn_synth_init(r->synth, render_opna(driver_type), RENDER_RATE);
+    }
+    if (!render_init(ctx, r, driver_type, data))
+    {
+        free(r->synth);
+        free(r);
+        return FAL2MUC_BAD_DATA;
+    }
+
+    if (timing.intro_sec + timing.loop_sec > RENDER_SEC_MAX)
+    {
+        timing.loop = 0;
+    }
+    ticks = (uint64_t)timing.intro + timing.loop;
+    for (uint64_t tick = 0; tick < ticks && !r->error; tick++)
+    {
+        if (tick == timing.intro && timing.loop != 0)
+        {
+            log_flush_wait(r);
+            r->loop_pos = r->len;
+            r->loop_samples = r->samples;
+        }
+        for (uint32_t i = 0; i < r->channels; i++)
+        {
+            render_channel_tick(r, &r->ch[i]);
+        }
+        render_tick_wait(r);
+        if (r->samples >= (uint64_t)RENDER_SEC_MAX * RENDER_RATE)
+        {
+            break;
+        }
+    }
+    log_flush_wait(r);
+    if (format != FAL2MUC_RENDER_WAV)
+    {
+        log_bytes(r, &b, 1);
+    }
+
+    status = FAL2MUC_OK;
+    if (r->error)
+    {
+        status = FAL2MUC_WRITE_ERROR;
+    }
+    else
+    {
+        n = render_header(r, header);
+        if (out_sink->write(out_sink->opaque, header, n) != n
+            || out_sink->write(out_sink->opaque, r->buf, r->len) != r->len)
+        {
+            status = FAL2MUC_WRITE_ERROR;
+        }
+    }
+    free(r->buf);
+    free(r->synth);
+    free(r);
+
+    return status;
+}
+
+FAL2MUC_STATUS fal2muc_render(fal2muc_ctx *ctx, const uint8_t *in, size_t in_len,
+                              FAL2MUC_RENDER format, const fal2muc_sink *out_sink)
+{
+    if (in_len >= FAL2MUC_VIEW_SIZE)
+    {
+        return render_data(ctx, in, in_len, format, out_sink);
+    }
+
+    /* short buffer, copy it to read past the end as zero */
+    memmove(ctx->buff, in, in_len);
+    memset(&ctx->buff[in_len], 0, sizeof(ctx->buff) - in_len);
+
+    return render_data(ctx, ctx->buff, in_len, format, out_sink);
+}
+
+FAL2MUC_STATUS fal2muc_render_input(fal2muc_ctx *ctx, const fal2muc_input *input,
+                                    FAL2MUC_RENDER format, const fal2muc_sink *out_sink)
+{
+    return render_data(ctx, input->data, input->size, format, out_sink);
+}
+
+/* decode a channel and check that it ends and loops inside itself */
+static bool probe_channel(fal2muc_ctx *ctx, const uint8_t *data, size_t size,
+                          uint32_t header, uint32_t ch, uint32_t *used)
+{
+    uint32_t start = get_word(&data[ch * 2]);
+    uint32_t end;
+    uint32_t n;
+    uint32_t i;
+    uint32_t o;
+    uint32_t w;
+
+    if (start < header || start >= size)
+    {
+        return false;
+    }
+    n = decode_music(ctx, data, start, NULL, NULL, &end);
+    if (n == 0 || end > size || data[ctx->event[n - 1].offset] != 0xff)
+    {
+        return false;
+    }
+    for (i = 0; i < n; i++)
+    {
+        o = ctx->event[i].offset + ctx->event[i].size;
+        switch (ctx->event[i].cmd)
+        {
+        case 0xf6:
+            w = get_word(&data[o - 2]);
+            if (w > o || o - w < start)
+            {
+                return false;
+            }
+            break;
+        case 0xff:
+            w = get_word(&data[o - 2]);
+            if (w != 0 && (w > o || o - w < start))
+            {
+                return false;
+            }
+            break;
+        }
+    }
+    if (end > *used)
+    {
+        *used = end;
+    }
+
+    return true;
+}
+
+DRIVER_TYPE fal2muc_probe(fal2muc_ctx *ctx, const uint8_t *data, size_t size, size_t *used)
+{
+    DRIVER_TYPE type;
+    const DRIVER_INFO *info;
+    uint32_t inst_end;
+    uint32_t end = 0;
+    uint32_t sub;
+    uint32_t sub_end = 0;
+    uint32_t ch;
+    bool stats = ctx->opt.stats;
+
+    if (size < 0x20)
+    {
+        return DRIVER_TYPE_UNKNOWN;
+    }
+    if (size > FAL2MUC_BUFF_SIZE)
+    {
+        size = FAL2MUC_BUFF_SIZE;
+    }
+
+    type = detect_type(data, true);
+    if (type == DRIVER_TYPE_UNKNOWN)
+    {
+        return DRIVER_TYPE_UNKNOWN;
+    }
+    info = &g_driver_info[type];
+
+    /* instruments from inst_offset up to the first channel */
+    inst_end = get_word(data);
+    if (inst_end < info->inst_offset || inst_end >= size
+        || (inst_end - info->inst_offset) % 0x20 != 0)
+    {
+        return DRIVER_TYPE_UNKNOWN;
+    }
+
+    ctx->opt.stats = false;
+    ctx->data_limit = size;
+    for (ch = 0; ch < 9; ch++)
+    {
+        if (info->ch_info[ch / 3].type != SOUND_TYPE_NONE
+            && !probe_channel(ctx, data, size, inst_end, ch, &end))
+        {
+            type = DRIVER_TYPE_UNKNOWN;
+            break;
+        }
+    }
+    if (type == DRIVER_TYPE_OPNA_RHYTHM && !probe_channel(ctx, data, size, inst_end, 9, &end))
+    {
+        type = DRIVER_TYPE_UNKNOWN;
+    }
+
+    /* PSG only song of X1 data, counted only if it's valid */
+    if (type == DRIVER_TYPE_X1_OPM)
+    {
+        sub = get_word(&data[0x001a]);
+        if (sub < size - 0x10)
+        {
+            ctx->data_limit = size - sub;
+            for (ch = 3; ch < 6; ch++)
+            {
+                if (!probe_channel(ctx, &data[sub], size - sub, 0x10, ch, &sub_end))
+                {
+                    sub_end = 0;
+                    break;
+                }
+            }
+            if (sub_end != 0 && sub + sub_end > end)
+            {
+                end = sub + sub_end;
+            }
+        }
+    }
+    ctx->opt.stats = stats;
+
+    if (type != DRIVER_TYPE_UNKNOWN && used != NULL)
+    {
+        *used = end;
+    }
+
+    return type;
+}
+
+#ifndef _WIN32
+static bool map_file(fal2muc_input *input, FILE *fp, size_t file_size, size_t offset)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t base = offset & ~(page - 1);
+    size_t skip = offset - base;
+    size_t map_size = (skip + FAL2MUC_VIEW_SIZE + page - 1) & ~(page - 1);
+    size_t file_pages = (file_size - base + page - 1) & ~(page - 1);
+    uint8_t *p;
+
+    /* zero filled area, then the file over it, so the tail reads as zero */
+    p = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+    {
+        return false;
+    }
+    if (file_pages > map_size)
+    {
+        file_pages = map_size;
+    }
+    if (file_pages > 0
+        && mmap(p, file_pages, PROT_READ, MAP_PRIVATE | MAP_FIXED,
+                fileno(fp), (off_t)base) == MAP_FAILED)
+    {
+        munmap(p, map_size);
+        return false;
+    }
+
+    input->data = p + skip;
+    input->map = p;
+    input->map_size = map_size;
+
+    return true;
+}
+#endif /* _WIN32 */
+
+static bool read_file(fal2muc_input *input, FILE *fp, size_t offset, size_t size)
+{
+    uint8_t *p = calloc(1, FAL2MUC_VIEW_SIZE);
+
+    if (p == NULL)
+    {
+        return false;
+    }
+    if (fseek(fp, (long)offset, SEEK_SET) != 0 || fread(p, 1, size, fp) != size)
+    {
+        free(p);
+        return false;
+    }
+
+    input->data = p;
+    input->map = NULL;
+    input->map_size = 0;
+
+    return true;
+}
+
+/* pipes can't be mapped nor seeked, skip to offset by reading */
+static bool read_stream(fal2muc_input *input, FILE *fp, size_t offset, size_t size)
+{
+    uint8_t *p = calloc(1, FAL2MUC_VIEW_SIZE);
+    size_t n;
+
+    if (p == NULL)
+    {
+        return false;
+    }
+    while (offset > 0)
+    {
+        n = fread(p, 1, (offset < FAL2MUC_BUFF_SIZE) ? offset : FAL2MUC_BUFF_SIZE, fp);
+        if (n == 0)
+        {
+            free(p);
+            return false;
+        }
+        offset -= n;
+    }
+    if (size == 0 || size > FAL2MUC_BUFF_SIZE)
+    {
+        size = FAL2MUC_BUFF_SIZE;
+    }
+    memset(p, 0, FAL2MUC_VIEW_SIZE);
+
+    input->data = p;
+    input->size = fread(p, 1, size, fp);
+    input->map = NULL;
+    input->map_size = 0;
+
+    return true;
+}
+
+bool fal2muc_input_open(fal2muc_input *input, const char *path, size_t offset, size_t size)
+{
+    FILE *fp;
+    long file_size;
+    bool ret = false;
+
+    fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        return false;
+    }
+    if (fseek(fp, 0, SEEK_END) != 0 || (file_size = ftell(fp)) < 0)
+    {
+        ret = read_stream(input, fp, offset, size);
+        fclose(fp);
+        return ret;
+    }
+    if ((size_t)file_size < offset)
+    {
+        fclose(fp);
+        return false;
+    }
+
+    /* only 64KiB is addressable from the song data */
+    if (size == 0 || size > (size_t)file_size - offset)
+    {
+        size = (size_t)file_size - offset;
+    }
+    if (size > FAL2MUC_BUFF_SIZE)
+    {
+        size = FAL2MUC_BUFF_SIZE;
+    }
+    input->size = size;
+
+#ifndef _WIN32
+    /* a part of the file is copied so that the rest reads as zero */
+    if (size == (size_t)file_size - offset || size == FAL2MUC_BUFF_SIZE)
+    {
+        ret = map_file(input, fp, (size_t)file_size, offset);
+    }
+#endif /* _WIN32 */
+    if (!ret)
+    {
+        ret = read_file(input, fp, offset, size);
+    }
+    fclose(fp);
+
+    return ret;
+}
+
+void fal2muc_input_close(fal2muc_input *input)
+{
+#ifndef _WIN32
+    if (input->map != NULL)
+    {
+        munmap(input->map, input->map_size);
+        input->map = NULL;
+        return;
+    }
+#endif /* _WIN32 */
+    free((void *)input->data);
+    input->data = NULL;
+}
@@ -0,0 +1,142 @@
+/*
+ * n88bas: N88-BASIC program of REM lines
+ *
+ * Copyright (c) 2019 Hirokuni Yano
+ *
+ * Released under the MIT license.
+ * see https://opensource.org/licenses/MIT
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "n88bas.h"
+
+void n88bas_init(N88BAS *bas, size_t (*write)(void *opaque, const void *buf, size_t size),
+                 void *opaque)
+{
+    memset(bas, 0, sizeof(*bas));
+    bas->write = write;
+    bas->opaque = opaque;
+    bas->lineno = N88BAS_LINENO_START;
+}
+
+static void put(N88BAS *bas, const void *buf, size_t size)
+{
+    if (size > 0 && !bas->error && bas->write(bas->opaque, buf, size) != size)
+    {
+        bas->error = true;
+    }
+}
+
+bool n88bas_line(N88BAS *bas, const char *text, size_t len)
+{
+    uint8_t header[8];
+    uint32_t next;
+    size_t n = 0;
+    size_t i;
+
+    if (bas->error)
+    {
+        return false;
+    }
+    for (i = 0; i < len && text[i] != '\r' && text[i] != '\0'; i++)
+    {
+    }
+    len = i;
+
+    next = bas->ptr + (uint32_t)len + 9;
+    if (len > N88BAS_LINK_MAX || next > N88BAS_LINK_MAX || bas->lineno > N88BAS_LINENO_MAX)
+    {
+        bas->overflow = true;
+        bas->error = true;
+        return false;
+    }
+
+    /* the terminator of the previous line, the last one is not written */
+    if (bas->ptr > 0)
+    {
+        header[n++] = 0x00;
+    }
+
+    header[n++] = next;
+    header[n++] = next >> 8;
+    header[n++] = bas->lineno;
+    header[n++] = bas->lineno >> 8;
+    /* "'" is stored as ":REM'" */
+    header[n++] = 0x3a;
+    header[n++] = 0x8f;
+    header[n++] = 0xe9;
+    put(bas, header, n);
+    put(bas, text, len);
+    bas->ptr = next - 1;
+    bas->lineno += N88BAS_LINENO_STEP;
+
+    return !bas->error;
+}
+
+bool n88bas_write(N88BAS *bas, const void *buf, size_t size)
+{
+    const char *p = buf;
+    const char *end = p + size;
+
+    while (p < end && !bas->error)
+    {
+        const char *lf = memchr(p, '\n', end - p);
+        size_t n = ((lf != NULL) ? lf : end) - p;
+
+        if (bas->text_len + n > bas->text_size)
+        {
+            size_t text_size = (bas->text_size == 0) ? 0x100 : bas->text_size;
+            char *text;
+
+            while (text_size < bas->text_len + n)
+            {
+                text_size *= 2;
+            }
+            text = realloc(bas->text, text_size);
+            if (text == NULL)
+            {
+                bas->error = true;
+                break;
+            }
+            bas->text = text;
+            bas->text_size = text_size;
+        }
+        if (n > 0)
+        {
+            memcpy(&bas->text[bas->text_len], p, n);
+            bas->text_len += n;
+        }
+        if (lf == NULL)
+        {
+            break;
+        }
+        n88bas_line(bas, bas->text, bas->text_len);
+        bas->text_len = 0;
+        p = lf + 1;
+    }
+
+    return !bas->error;
+}
+
+uint32_t n88bas_end(N88BAS *bas)
+{
+    if (bas->text_len > 0)
+    {
+        n88bas_line(bas, bas->text, bas->text_len);
+        bas->text_len = 0;
+    }
+    free(bas->text);
+    bas->text = NULL;
+    bas->text_size = 0;
+
+    if (bas->error || bas->ptr < 1)
+    {
+        return 0;
+    }
+
+    return bas->ptr - 1;
+}
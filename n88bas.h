@@ -0,0 +1,53 @@
+/*
+ * n88bas: N88-BASIC program of REM lines
+ *
+ * Copyright (c) 2019 Hirokuni Yano
+ *
+ * Released under the MIT license.
+ * see https://opensource.org/licenses/MIT
+ */
+
+#ifndef N88BAS_H
+#define N88BAS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define N88BAS_LINENO_START (1000)
+#define N88BAS_LINENO_STEP (10)
+#define N88BAS_LINENO_MAX (65529)
+/* links are 16 bit addresses from the start of the program + 1 */
+#define N88BAS_LINK_MAX (0xffff)
+
+/*
+ * each line of text is linked as "<lineno> :REM<text>" and written
+ * as soon as it's complete, the program is never staged in memory.
+ */
+typedef struct
+{
+    size_t (*write)(void *opaque, const void *buf, size_t size);
+    void *opaque;
+    uint32_t lineno;
+    uint32_t ptr;				/* offset of the next line */
+    bool error;					/* write error, out of memory or overflow */
+    bool overflow;				/* over N88BAS_LINK_MAX or N88BAS_LINENO_MAX */
+    /* partial line for n88bas_write() */
+    char *text;
+    size_t text_len;
+    size_t text_size;
+} N88BAS;
+
+void n88bas_init(N88BAS *bas, size_t (*write)(void *opaque, const void *buf, size_t size),
+                 void *opaque);
+
+/* append a line, text is cut at '\r' or '\0', fails if the link overflows */
+bool n88bas_line(N88BAS *bas, const char *text, size_t len);
+
+/* append text of any size, split into lines at '\n' */
+bool n88bas_write(N88BAS *bas, const void *buf, size_t size);
+
+/* write the last partial line, returns the size of the program (0: error or empty) */
+uint32_t n88bas_end(N88BAS *bas);
+
+#endif /* N88BAS_H */
@@ -0,0 +1,748 @@
+/*
+ * opnsynth: software synthesizer of YM2203/YM2608 for previews
+ *
+ * Copyright (c) 2019 Hirokuni Yano
+ *
+ * Released under the MIT license.
+ * see https://opensource.org/licenses/MIT
+ *
+ * not an emulator: the FM operators are sine waves with the envelope
+ * generator, the algorithms and the feedback of the chip, and the SSG
+ * has the tone, noise and envelope. the rhythm and the LFO are not played.
+ * the 6 FM channels are computed in 4 lanes vectors (SSE2 if available).
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif /* __SSE2__ */
+
+#include "opnsynth.h"
+
+#define FM_CLOCK (3993600.0f)		/* OPN, OPNA is divided by 2 */
+#define EG_CLOCK (FM_CLOCK / 72 / 3)
+#define SSG_CLOCK (FM_CLOCK / 64)	/* tone frequency * period */
+#define BLOCK (16)					/* samples of an envelope update */
+#define FM_LEVEL (0.18f)
+#define SSG_LEVEL (0.12f)
+
+enum
+{
+    EG_ATTACK,
+    EG_DECAY,
+    EG_SUSTAIN,
+    EG_RELEASE,
+};
+
+/* register slot of op1-op4 */
+static const uint32_t g_op_slot[4] = {0, 2, 1, 3};
+
+/* modulation (op1>op2, op1>op3, op2>op3, op1>op4, op2>op4, op3>op4) and carriers of algorithms */
+static const uint8_t g_alg_mod[8][6] = {
+    {1, 0, 1, 0, 0, 1},
+    {0, 1, 1, 0, 0, 1},
+    {0, 0, 1, 1, 0, 1},
+    {1, 0, 0, 0, 1, 1},
+    {1, 0, 0, 0, 0, 1},
+    {1, 1, 0, 1, 0, 0},
+    {1, 0, 0, 0, 0, 0},
+    {0, 0, 0, 0, 0, 0},
+};
+static const uint8_t g_alg_carrier[8][4] = {
+    {0, 0, 0, 1},
+    {0, 0, 0, 1},
+    {0, 0, 0, 1},
+    {0, 0, 0, 1},
+    {0, 1, 0, 1},
+    {0, 1, 1, 1},
+    {0, 1, 1, 1},
+    {1, 1, 1, 1},
+};
+
+/* 2^x for -127 < x <= 0 */
+static float exp2_neg(float x)
+{
+    union
+    {
+        float f;
+        uint32_t u;
+    } e;
+    int32_t i = (int32_t)x;
+    float f;
+
+    if (x <= -126.0f)
+    {
+        return 0.0f;
+    }
+    if ((float)i > x)
+    {
+        i--;
+    }
+    f = x - (float)i;
+    e.u = (uint32_t)(i + 127) << 23;
+
+    return e.f * (1.0f + f * (0.6960656f + f * (0.2244635f + f * 0.0792209f)));
+}
+
+static uint32_t reg_of(uint32_t lane, uint32_t op, uint32_t base)
+{
+    return base + g_op_slot[op] * 4 + lane % 3;
+}
+
+static uint32_t keycode(const OPN_SYNTH *s, uint32_t lane)
+{
+    const uint8_t *r = s->reg[lane / 3];
+    uint32_t ch = lane % 3;
+    uint32_t fnum = ((uint32_t)(r[0xa4 + ch] & 0x07) << 8) | r[0xa0 + ch];
+    uint32_t f11 = (fnum >> 10) & 1;
+    uint32_t f10 = (fnum >> 9) & 1;
+    uint32_t f9 = (fnum >> 8) & 1;
+    uint32_t f8 = (fnum >> 7) & 1;
+    uint32_t n3 = (f11 & (f10 | f9 | f8)) | ((f11 ^ 1) & f10 & f9 & f8);
+
+    return ((uint32_t)((r[0xa4 + ch] >> 3) & 0x07) << 2) | (f11 << 1) | n3;
+}
+
+/* rate of 0 - 63 with key scale */
+static uint32_t eg_rate(const OPN_SYNTH *s, uint32_t lane, uint32_t op, uint32_t rate)
+{
+    uint32_t ks = s->reg[lane / 3][reg_of(lane, op, 0x50)] >> 6;
+    uint32_t r;
+
+    if (rate == 0)
+    {
+        return 0;
+    }
+    r = rate * 2 + (s->kc[lane] >> (3 - ks));
+
+    return (r > 63) ? 63 : r;
+}
+
+/* attenuation per EG cycle */
+static float eg_inc(uint32_t r)
+{
+    if (r < 4)
+    {
+        return 0.0f;
+    }
+    if (r >= 60)
+    {
+        return 8.0f;
+    }
+
+    return (1.0f + (float)(r & 3) / 4.0f) * exp2_neg((float)(r / 4) - 11.0f);
+}
+
+static void update_freq(OPN_SYNTH *s, uint32_t lane)
+{
+    const uint8_t *r = s->reg[lane / 3];
+    uint32_t ch = lane % 3;
+    uint32_t fnum = ((uint32_t)(r[0xa4 + ch] & 0x07) << 8) | r[0xa0 + ch];
+    uint32_t block = (r[0xa4 + ch] >> 3) & 0x07;
+    uint32_t kc = keycode(s, lane);
+    float freq = (float)(fnum << block) * (FM_CLOCK / 144.0f / 2097152.0f);
+
+    s->kc[lane] = (uint8_t)kc;
+    for (uint32_t op = 0; op < 4; op++)
+    {
+        uint32_t v = r[reg_of(lane, op, 0x30)];
+        uint32_t dt = (v >> 4) & 0x07;
+        float ml = ((v & 0x0f) == 0) ? 0.5f : (float)(v & 0x0f);
+        float f = freq;
+        float inc;
+
+        /* detune is a few hundredths Hz per step, larger for higher keys */
+        if (dt & 0x03)
+        {
+            float d = (float)(dt & 0x03) * (1.0f + (float)kc / 8.0f) * (FM_CLOCK / 144.0f / 1048576.0f);
+
+            f += (dt & 0x04) ? -d : d;
+        }
+        inc = f * ml / (float)s->rate;
+        s->inc[op][lane] = (inc >= 0.5f) ? 0 : (int32_t)(uint32_t)(inc * 4294967296.0f);
+    }
+}
+
+static void update_alg(OPN_SYNTH *s, uint32_t lane)
+{
+    uint32_t v = s->reg[lane / 3][0xb0 + lane % 3];
+    uint32_t fb = (v >> 3) & 0x07;
+    uint32_t al = v & 0x07;
+
+    for (uint32_t i = 0; i < 6; i++)
+    {
+        /* an output of 1.0 moves the phase by 4 cycles */
+        s->mod[i][lane] = g_alg_mod[al][i] ? 4.0f : 0.0f;
+    }
+    for (uint32_t op = 0; op < 4; op++)
+    {
+        s->carrier[op][lane] = g_alg_carrier[al][op] ? FM_LEVEL : 0.0f;
+    }
+    s->fb[lane] = (fb == 0) ? 0.0f : exp2_neg((float)fb - 7.0f);
+}
+
+static void update_ssg(OPN_SYNTH *s)
+{
+    const uint8_t *r = s->reg[0];
+    uint32_t n;
+
+    for (uint32_t i = 0; i < 3; i++)
+    {
+        float f;
+
+        n = r[i * 2] | ((uint32_t)(r[i * 2 + 1] & 0x0f) << 8);
+        f = SSG_CLOCK / (float)((n == 0) ? 1 : n) / (float)s->rate;
+        /* too high to hear, kept high */
+        s->ssg_inc[i] = (f >= 0.5f) ? 0 : (int32_t)(uint32_t)(f * 4294967296.0f);
+        if (s->ssg_inc[i] == 0)
+        {
+            s->ssg_phase[i] = 0;
+        }
+    }
+    n = r[0x06] & 0x1f;
+    s->noise_inc = (uint32_t)(SSG_CLOCK / (float)((n == 0) ? 1 : n) / (float)s->rate * 65536.0f);
+    n = r[0x0b] | ((uint32_t)r[0x0c] << 8);
+    s->env_inc = (uint32_t)(SSG_CLOCK * 2.0f / (float)((n == 0) ? 1 : n) / (float)s->rate * 65536.0f);
+}
+
+static void key(OPN_SYNTH *s, uint32_t lane, uint32_t op, bool on)
+{
+    if (on && s->eg[op][lane] == EG_RELEASE)
+    {
+        s->phase[op][lane] = 0;
+        s->eg[op][lane] = EG_ATTACK;
+        if (eg_rate(s, lane, op, s->reg[lane / 3][reg_of(lane, op, 0x50)] & 0x1f) >= 62)
+        {
+            s->att[op][lane] = 0.0f;
+            s->eg[op][lane] = EG_DECAY;
+        }
+    }
+    else if (!on)
+    {
+        s->eg[op][lane] = EG_RELEASE;
+    }
+}
+
+void opn_synth_init(OPN_SYNTH *s, bool opna, uint32_t rate)
+{
+    memset(s, 0, sizeof(*s));
+    s->opna = opna;
+    s->rate = rate;
+    s->eg_rate = EG_CLOCK / (float)rate;
+    s->noise_lfsr = 1;
+    for (uint32_t r = 0; r < 64; r++)
+    {
+        s->eg_inc[r] = eg_inc(r);
+    }
+    for (uint32_t l = 1; l < 32; l++)
+    {
+        /* 1.5dB steps */
+        s->ssg_amp[l] = exp2_neg(((float)l - 31.0f) / 4.0f);
+    }
+    for (uint32_t op = 0; op < 4; op++)
+    {
+        for (uint32_t lane = 0; lane < OPN_SYNTH_LANES; lane++)
+        {
+            s->att[op][lane] = 1023.0f;
+            s->eg[op][lane] = EG_RELEASE;
+        }
+    }
+    for (uint32_t lane = 0; lane < 6; lane++)
+    {
+        s->pan[0][lane] = 1.0f;
+        s->pan[1][lane] = 1.0f;
+        s->reg[lane / 3][0xb4 + lane % 3] = 0xc0;
+        update_alg(s, lane);
+    }
+    s->reg[0][0x07] = 0x3f;
+    update_ssg(s);
+}
+
+void opn_synth_write(OPN_SYNTH *s, uint32_t port, uint32_t reg, uint32_t val)
+{
+    uint32_t lane;
+
+    port &= 1;
+    reg &= 0xff;
+    val &= 0xff;
+    if (!s->opna && port != 0)
+    {
+        return;
+    }
+    s->reg[port][reg] = (uint8_t)val;
+
+    if (port == 0 && reg < 0x10)
+    {
+        if (reg == 0x0d)
+        {
+            s->env_phase = 0;
+            s->env_step = 0;
+        }
+        update_ssg(s);
+        return;
+    }
+    if (reg == 0x28 && port == 0)
+    {
+        if ((val & 0x03) == 0x03 || (!s->opna && (val & 0x04)))
+        {
+            return;
+        }
+        lane = ((val >> 2) & 1) * 3 + (val & 0x03);
+        for (uint32_t op = 0; op < 4; op++)
+        {
+            key(s, lane, op, (val & (0x10 << op)) != 0);
+        }
+        return;
+    }
+    if (reg < 0x30 || (reg & 0x03) == 0x03)
+    {
+        return;
+    }
+    lane = port * 3 + (reg & 0x03);
+    if (reg >= 0xa4 && reg < 0xa8)
+    {
+        /* F-Number is written by the low byte */
+        return;
+    }
+    if (reg < 0x40 || (reg >= 0xa0 && reg < 0xa4))
+    {
+        update_freq(s, lane);
+    }
+    else if (reg >= 0xb0 && reg < 0xb4)
+    {
+        update_alg(s, lane);
+    }
+    else if (reg >= 0xb4 && reg < 0xb8 && s->opna)
+    {
+        s->pan[0][lane] = (val & 0x80) ? 1.0f : 0.0f;
+        s->pan[1][lane] = (val & 0x40) ? 1.0f : 0.0f;
+    }
+}
+
+/* cycles of the envelope generator, at once for a block */
+static void eg_run(OPN_SYNTH *s, float cycles)
+{
+    for (uint32_t lane = 0; lane < 6; lane++)
+    {
+        const uint8_t *r = s->reg[lane / 3];
+
+        for (uint32_t op = 0; op < 4; op++)
+        {
+            float *att = &s->att[op][lane];
+            uint32_t sl = r[reg_of(lane, op, 0x80)] >> 4;
+            float sl_att = (sl == 15) ? 1023.0f : (float)(sl * 32);
+            float k;
+
+            if (s->eg[op][lane] == EG_RELEASE && *att >= 1023.0f)
+            {
+                continue;
+            }
+            switch (s->eg[op][lane])
+            {
+            case EG_ATTACK:
+                /* exponential, (1 - inc / 16) ^ cycles */
+                k = s->eg_inc[eg_rate(s, lane, op, r[reg_of(lane, op, 0x50)] & 0x1f)] / 16.0f * cycles;
+                *att = (*att + 1.0f) * ((k >= 1.0f) ? 0.0f : 1.0f - k) - 1.0f;
+                if (*att <= 0.0f)
+                {
+                    *att = 0.0f;
+                    s->eg[op][lane] = EG_DECAY;
+                }
+                break;
+            case EG_DECAY:
+                *att += s->eg_inc[eg_rate(s, lane, op, r[reg_of(lane, op, 0x60)] & 0x1f)] * cycles;
+                if (*att >= sl_att)
+                {
+                    *att = sl_att;
+                    s->eg[op][lane] = EG_SUSTAIN;
+                }
+                break;
+            case EG_SUSTAIN:
+                *att += s->eg_inc[eg_rate(s, lane, op, r[reg_of(lane, op, 0x70)] & 0x1f)] * cycles;
+                break;
+            default:
+                *att += s->eg_inc[eg_rate(s, lane, op, (r[reg_of(lane, op, 0x80)] & 0x0f) * 2 + 1)] * cycles;
+                break;
+            }
+            if (*att > 1023.0f)
+            {
+                *att = 1023.0f;
+            }
+        }
+    }
+}
+
+/* returns the bits of the channels heard */
+static uint32_t update_gain(OPN_SYNTH *s)
+{
+    uint32_t heard = 0;
+
+    for (uint32_t lane = 0; lane < 6; lane++)
+    {
+        const uint8_t *r = s->reg[lane / 3];
+
+        for (uint32_t op = 0; op < 4; op++)
+        {
+            float a = s->att[op][lane] + (float)((r[reg_of(lane, op, 0x40)] & 0x7f) * 8);
+
+            /* 0.09375dB per step */
+            s->gain[op][lane] = (a >= 1023.0f) ? 0.0f : exp2_neg(a * -0.015571f);
+            if (s->gain[op][lane] > 0.0f && s->carrier[op][lane] > 0.0f)
+            {
+                heard |= 1u << lane;
+            }
+        }
+    }
+
+    return heard;
+}
+
+#ifdef __SSE2__
+typedef __m128 V4;
+typedef __m128i V4I;
+#define V4_LOAD(p)			_mm_loadu_ps(p)
+#define V4_STORE(p, a)		_mm_storeu_ps(p, a)
+#define V4_ADD(a, b)		_mm_add_ps(a, b)
+#define V4_SUB(a, b)		_mm_sub_ps(a, b)
+#define V4_MUL(a, b)		_mm_mul_ps(a, b)
+#define V4_SET1(x)			_mm_set1_ps(x)
+#define V4I_LOAD(p)			_mm_loadu_si128((const __m128i *)(p))
+#define V4I_STORE(p, a)		_mm_storeu_si128((__m128i *)(p), a)
+#define V4I_ADD(a, b)		_mm_add_epi32(a, b)
+#define V4I_TO_F(a)			_mm_cvtepi32_ps(a)
+
+/* sin(2 pi x), x in cycles */
+static inline V4 v4_sin(V4 x)
+{
+    const V4 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    V4 t;
+    V4 y;
+
+    x = _mm_sub_ps(x, _mm_cvtepi32_ps(_mm_cvtps_epi32(x)));
+    t = _mm_add_ps(x, x);
+    y = _mm_mul_ps(_mm_mul_ps(t, _mm_sub_ps(_mm_set1_ps(1.0f), _mm_and_ps(t, abs_mask))),
+                   _mm_set1_ps(4.0f));
+    y = _mm_add_ps(y, _mm_mul_ps(_mm_set1_ps(0.225f),
+                                 _mm_sub_ps(_mm_mul_ps(y, _mm_and_ps(y, abs_mask)), y)));
+
+    return y;
+}
+
+static inline float v4_sum(V4 a)
+{
+    a = _mm_add_ps(a, _mm_shuffle_ps(a, a, _MM_SHUFFLE(1, 0, 3, 2)));
+    a = _mm_add_ps(a, _mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1)));
+
+    return _mm_cvtss_f32(a);
+}
+#else /* __SSE2__ */
+typedef struct
+{
+    float f[4];
+} V4;
+typedef struct
+{
+    int32_t i[4];
+} V4I;
+
+#define V4_OP(name, expr) \
+static inline V4 name(V4 a, V4 b) \
+{ \
+    V4 r; \
+    for (int i = 0; i < 4; i++) \
+    { \
+        r.f[i] = expr; \
+    } \
+    return r; \
+}
+V4_OP(v4_add, a.f[i] + b.f[i])
+V4_OP(v4_sub, a.f[i] - b.f[i])
+V4_OP(v4_mul, a.f[i] * b.f[i])
+
+static inline V4 v4_load(const float *p)
+{
+    V4 r;
+
+    memcpy(r.f, p, sizeof(r.f));
+    return r;
+}
+
+static inline V4 v4_set1(float x)
+{
+    V4 r = {{x, x, x, x}};
+
+    return r;
+}
+
+static inline V4I v4i_add(V4I a, V4I b)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        a.i[i] = (int32_t)((uint32_t)a.i[i] + (uint32_t)b.i[i]);
+    }
+    return a;
+}
+
+static inline V4 v4i_to_f(V4I a)
+{
+    V4 r;
+
+    for (int i = 0; i < 4; i++)
+    {
+        r.f[i] = (float)a.i[i];
+    }
+    return r;
+}
+
+static inline V4 v4_sin(V4 x)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        float t = x.f[i] - (float)(int32_t)(x.f[i] + ((x.f[i] < 0) ? -0.5f : 0.5f));
+        float y;
+
+        t += t;
+        y = 4.0f * t * (1.0f - ((t < 0) ? -t : t));
+        x.f[i] = y + 0.225f * (y * ((y < 0) ? -y : y) - y);
+    }
+    return x;
+}
+
+static inline float v4_sum(V4 a)
+{
+    return a.f[0] + a.f[1] + a.f[2] + a.f[3];
+}
+
+#define V4_LOAD(p)			v4_load(p)
+#define V4_STORE(p, a)		memcpy(p, (a).f, sizeof((a).f))
+#define V4_ADD(a, b)		v4_add(a, b)
+#define V4_SUB(a, b)		v4_sub(a, b)
+#define V4_MUL(a, b)		v4_mul(a, b)
+#define V4_SET1(x)			v4_set1(x)
+#define V4I_LOAD(p)			(*(const V4I *)(p))
+#define V4I_STORE(p, a)		(*(V4I *)(p) = (a))
+#define V4I_ADD(a, b)		v4i_add(a, b)
+#define V4I_TO_F(a)			v4i_to_f(a)
+#endif /* __SSE2__ */
+
+/*
+ * FM channels of groups * 4 lanes from the group first, added to the lanes of left and right.
+ * the groups are computed together, the operators of a channel depend on each other.
+ */
+static inline void run_fm(OPN_SYNTH *s, uint32_t first, uint32_t groups,
+                          V4 *left, V4 *right, uint32_t n)
+{
+    const V4 scale = V4_SET1(1.0f / 4294967296.0f);
+    V4I ph[2][4];
+    V4I inc[2][4];
+    V4 g[2][4];
+    V4 c[2][4];
+    V4 m[2][6];
+    V4 fb[2];
+    V4 fo1[2];
+    V4 fo2[2];
+    V4 pl[2];
+    V4 pr[2];
+
+    for (uint32_t k = 0; k < groups; k++)
+    {
+        uint32_t lane = (first + k) * 4;
+
+        for (uint32_t op = 0; op < 4; op++)
+        {
+            ph[k][op] = V4I_LOAD(&s->phase[op][lane]);
+            inc[k][op] = V4I_LOAD(&s->inc[op][lane]);
+            g[k][op] = V4_LOAD(&s->gain[op][lane]);
+            c[k][op] = V4_LOAD(&s->carrier[op][lane]);
+        }
+        for (uint32_t i = 0; i < 6; i++)
+        {
+            m[k][i] = V4_LOAD(&s->mod[i][lane]);
+        }
+        fb[k] = V4_LOAD(&s->fb[lane]);
+        fo1[k] = V4_LOAD(&s->fb_out[0][lane]);
+        fo2[k] = V4_LOAD(&s->fb_out[1][lane]);
+        pl[k] = V4_LOAD(&s->pan[0][lane]);
+        pr[k] = V4_LOAD(&s->pan[1][lane]);
+    }
+
+    for (uint32_t i = 0; i < n; i++)
+    {
+        for (uint32_t k = 0; k < groups; k++)
+        {
+            V4 o1 = V4_MUL(v4_sin(V4_ADD(V4_MUL(V4I_TO_F(ph[k][0]), scale),
+                                         V4_MUL(V4_ADD(fo1[k], fo2[k]), fb[k]))), g[k][0]);
+            V4 o2 = V4_MUL(v4_sin(V4_ADD(V4_MUL(V4I_TO_F(ph[k][1]), scale),
+                                         V4_MUL(o1, m[k][0]))), g[k][1]);
+            V4 o3 = V4_MUL(v4_sin(V4_ADD(V4_MUL(V4I_TO_F(ph[k][2]), scale),
+                                         V4_ADD(V4_MUL(o1, m[k][1]), V4_MUL(o2, m[k][2])))), g[k][2]);
+            V4 o4 = V4_MUL(v4_sin(V4_ADD(V4_MUL(V4I_TO_F(ph[k][3]), scale),
+                                         V4_ADD(V4_ADD(V4_MUL(o1, m[k][3]), V4_MUL(o2, m[k][4])),
+                                                V4_MUL(o3, m[k][5])))), g[k][3]);
+            V4 out = V4_ADD(V4_ADD(V4_MUL(o1, c[k][0]), V4_MUL(o2, c[k][1])),
+                            V4_ADD(V4_MUL(o3, c[k][2]), V4_MUL(o4, c[k][3])));
+
+            fo2[k] = fo1[k];
+            fo1[k] = o1;
+            left[i] = V4_ADD(left[i], V4_MUL(out, pl[k]));
+            right[i] = V4_ADD(right[i], V4_MUL(out, pr[k]));
+            for (uint32_t op = 0; op < 4; op++)
+            {
+                ph[k][op] = V4I_ADD(ph[k][op], inc[k][op]);
+            }
+        }
+    }
+
+    for (uint32_t k = 0; k < groups; k++)
+    {
+        uint32_t lane = (first + k) * 4;
+
+        for (uint32_t op = 0; op < 4; op++)
+        {
+            V4I_STORE(&s->phase[op][lane], ph[k][op]);
+        }
+        V4_STORE(&s->fb_out[0][lane], fo1[k]);
+        V4_STORE(&s->fb_out[1][lane], fo2[k]);
+    }
+}
+
+/* level of the envelope (0 - 31) */
+static uint32_t env_level(const OPN_SYNTH *s)
+{
+    uint32_t shape = s->reg[0][0x0d];
+    uint32_t cycle = s->env_step / 32;
+    uint32_t step = s->env_step % 32;
+    bool up = (shape & 0x04) != 0;
+
+    if (cycle > 0)
+    {
+        if (!(shape & 0x08))
+        {
+            return 0;
+        }
+        if (shape & 0x01)
+        {
+            return (up != ((shape & 0x02) != 0)) ? 31 : 0;
+        }
+        if ((shape & 0x02) && (cycle & 1))
+        {
+            up = !up;
+        }
+    }
+
+    return up ? step : 31 - step;
+}
+
+static void run_ssg(OPN_SYNTH *s, float *left, float *right, uint32_t n)
+{
+    const uint8_t *r = s->reg[0];
+    float out;
+
+    for (uint32_t i = 0; i < n; i++)
+    {
+        uint32_t noise;
+
+        s->noise_phase += s->noise_inc;
+        while (s->noise_phase >= 0x10000)
+        {
+            uint32_t bit = (s->noise_lfsr ^ (s->noise_lfsr >> 3)) & 1;
+
+            s->noise_lfsr = (s->noise_lfsr >> 1) | (bit << 16);
+            s->noise_phase -= 0x10000;
+        }
+        s->env_phase += s->env_inc;
+        while (s->env_phase >= 0x10000)
+        {
+            s->env_step++;
+            if (s->env_step >= 96)
+            {
+                s->env_step -= 64;
+            }
+            s->env_phase -= 0x10000;
+        }
+        noise = s->noise_lfsr & 1;
+
+        out = 0.0f;
+        for (uint32_t ch = 0; ch < 3; ch++)
+        {
+            uint32_t v = r[0x08 + ch];
+            uint32_t tone = ((uint32_t)s->ssg_phase[ch] >> 31) ^ 1;
+
+            if ((tone | ((r[0x07] >> ch) & 1)) & (noise | ((r[0x07] >> (ch + 3)) & 1)))
+            {
+                out += s->ssg_amp[(v & 0x10) ? env_level(s) : ((v & 0x0f) ? (v & 0x0f) * 2 + 1 : 0)];
+            }
+            s->ssg_phase[ch] = (int32_t)((uint32_t)s->ssg_phase[ch] + (uint32_t)s->ssg_inc[ch]);
+        }
+        out *= SSG_LEVEL;
+        /* high pass, the output of SSG is not centered */
+        s->dc += (out - s->dc) * 0.0005f;
+        left[i] += out - s->dc;
+        right[i] += out - s->dc;
+    }
+}
+
+static int16_t clip(float x)
+{
+    int32_t v = (int32_t)(x * 32767.0f);
+
+    return (int16_t)((v > 32767) ? 32767 : (v < -32768) ? -32768 : v);
+}
+
+void opn_synth_run(OPN_SYNTH *s, uint8_t *out, uint32_t samples)
+{
+    V4 fm_left[BLOCK];
+    V4 fm_right[BLOCK];
+    float left[BLOCK];
+    float right[BLOCK];
+    uint32_t heard;
+
+    while (samples > 0)
+    {
+        uint32_t n = (samples < BLOCK) ? samples : BLOCK;
+
+        eg_run(s, s->eg_rate * (float)n);
+        heard = update_gain(s);
+
+        for (uint32_t i = 0; i < n; i++)
+        {
+            fm_left[i] = V4_SET1(0.0f);
+            fm_right[i] = V4_SET1(0.0f);
+        }
+        /* the groups not heard are skipped, mostly the channels of port 1 */
+        if ((heard & 0x0f) && (heard & 0xf0))
+        {
+            run_fm(s, 0, 2, fm_left, fm_right, n);
+        }
+        else if (heard & 0x0f)
+        {
+            run_fm(s, 0, 1, fm_left, fm_right, n);
+        }
+        else if (heard & 0xf0)
+        {
+            run_fm(s, 1, 1, fm_left, fm_right, n);
+        }
+        for (uint32_t i = 0; i < n; i++)
+        {
+            left[i] = v4_sum(fm_left[i]);
+            right[i] = v4_sum(fm_right[i]);
+        }
+        run_ssg(s, left, right, n);
+
+        for (uint32_t i = 0; i < n; i++)
+        {
+            int16_t l = clip(left[i]);
+            int16_t r = clip(right[i]);
+
+            out[0] = (uint8_t)l;
+            out[1] = (uint8_t)((uint16_t)l >> 8);
+            out[2] = (uint8_t)r;
+            out[3] = (uint8_t)((uint16_t)r >> 8);
+            out += 4;
+        }
+        samples -= n;
+    }
+}
@@ -0,0 +1,60 @@
+/*
+ * opnsynth: software synthesizer of YM2203/YM2608 for previews
+ *
+ * Copyright (c) 2019 Hirokuni Yano
+ *
+ * Released under the MIT license.
+ * see https://opensource.org/licenses/MIT
+ */
+
+#ifndef OPNSYNTH_H
+#define OPNSYNTH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define OPN_SYNTH_LANES (8)			/* FM channels in vectors, 6 are used */
+
+/*
+ * FM operators are in the order of op1-op4 (the registers are op1, op3, op2, op4),
+ * each array is indexed by the channel.
+ */
+typedef struct
+{
+    float gain[4][OPN_SYNTH_LANES];		/* envelope and TL, linear */
+    int32_t phase[4][OPN_SYNTH_LANES];	/* 1 << 32 per cycle */
+    int32_t inc[4][OPN_SYNTH_LANES];
+    float mod[6][OPN_SYNTH_LANES];		/* op1>op2, op1>op3, op2>op3, op1>op4, op2>op4, op3>op4 */
+    float carrier[4][OPN_SYNTH_LANES];
+    float fb[OPN_SYNTH_LANES];			/* cycles per output of op1 */
+    float fb_out[2][OPN_SYNTH_LANES];	/* last outputs of op1 */
+    float pan[2][OPN_SYNTH_LANES];		/* L, R */
+    /* envelope generator */
+    float att[4][OPN_SYNTH_LANES];		/* 0 - 1023, 0.09375 dB */
+    uint8_t eg[4][OPN_SYNTH_LANES];
+    uint8_t kc[OPN_SYNTH_LANES];		/* key code of the channel */
+    float eg_inc[64];					/* attenuation per EG cycle of the rates */
+    float eg_rate;						/* EG cycles per sample */
+    /* SSG */
+    int32_t ssg_phase[4];
+    int32_t ssg_inc[4];
+    uint32_t noise_phase;
+    uint32_t noise_inc;
+    uint32_t noise_lfsr;
+    uint32_t env_phase;
+    uint32_t env_inc;
+    uint32_t env_step;					/* 0 - 31, 32 - 63: second and later cycles */
+    float ssg_amp[32];					/* linear of the levels */
+    float dc;							/* DC of SSG, removed from the output */
+    uint32_t rate;
+    bool opna;
+    uint8_t reg[2][256];
+} OPN_SYNTH;
+
+void opn_synth_init(OPN_SYNTH *s, bool opna, uint32_t rate);
+void opn_synth_write(OPN_SYNTH *s, uint32_t port, uint32_t reg, uint32_t val);
+
+/* synthesize samples of 16 bits stereo into out (4 bytes per sample, little endian) */
+void opn_synth_run(OPN_SYNTH *s, uint8_t *out, uint32_t samples);
+
+#endif /* OPNSYNTH_H */
@@ -0,0 +1,247 @@
+#!/bin/sh
+#
+# regression test: compare the output of fal2muc with golden files
+#
+# Copyright (c) 2019 Hirokuni Yano
+#
+# Released under the MIT license.
+# see https://opensource.org/licenses/MIT
+#
+# usage: test/run.sh [-u] [FAL2MUC [TXT2BAS]]
+#   -u  update golden files instead of comparing
+#
+
+# file names in a fixed order
+LC_ALL=C
+export LC_ALL
+
+update=0
+if [ "$1" = "-u" ]; then
+    update=1
+    shift
+fi
+
+dir=$(cd "$(dirname "$0")" && pwd)
+bin=${1:-$dir/../fal2muc}
+txt2bas=${2:-$dir/../txt2bas}
+# the JSON outputs have the names of the files run in the data directory
+case $bin in */*) bin=$(cd "$(dirname "$bin")" && pwd)/$(basename "$bin") ;; esac
+case $txt2bas in */*) txt2bas=$(cd "$(dirname "$txt2bas")" && pwd)/$(basename "$txt2bas") ;; esac
+out=$(mktemp -d)
+trap 'rm -rf "$out"' EXIT
+
+pass=0
+fail=0
+
+# run NAME INPUT OPTION(S)...
+run()
+{
+    name=$1
+    input=$2
+    shift 2
+
+    "$bin" "$@" "$dir/data/$input" > "$out/$name.muc" 2> "$out/$name.err"
+    rc=$?
+    if [ $rc -ne 0 ]; then
+        echo "FAIL: $name (exit $rc)"
+        sed 's/^/  /' "$out/$name.err"
+        fail=$((fail + 1))
+        return
+    fi
+
+    if [ $update -eq 1 ]; then
+        cp "$out/$name.muc" "$dir/golden/$name.muc"
+    elif ! cmp -s "$out/$name.muc" "$dir/golden/$name.muc"; then
+        echo "FAIL: $name"
+        diff "$dir/golden/$name.muc" "$out/$name.muc" | head -10
+        fail=$((fail + 1))
+        return
+    fi
+    pass=$((pass + 1))
+}
+
+# expect RC NAME INPUT OPTION(S)...: broken data, exit with RC and no crash
+expect()
+{
+    want=$1
+    name=$2
+    input=$3
+    shift 3
+
+    "$bin" "$@" "$input" > /dev/null 2> "$out/$name.err"
+    rc=$?
+    if [ $rc -ne $want ]; then
+        echo "FAIL: $name (exit $rc, expected $want)"
+        sed 's/^/  /' "$out/$name.err" | tail -5
+        fail=$((fail + 1))
+        return
+    fi
+    pass=$((pass + 1))
+}
+
+# golden NAME FILE: compare an output with golden/NAME
+golden()
+{
+    if [ $update -eq 1 ]; then
+        cp "$2" "$dir/golden/$1"
+        pass=$((pass + 1))
+    else
+        same "$1" "$2" "$dir/golden/$1"
+    fi
+}
+
+# same NAME FILE EXPECTED: compare an output with another file
+same()
+{
+    if cmp -s "$2" "$3"; then
+        pass=$((pass + 1))
+    else
+        echo "FAIL: $1"
+        fail=$((fail + 1))
+    fi
+}
+
+for s in 1 2 3; do
+    run opn_$s.auto     opn_$s.bin
+    run opn_$s.opn      opn_$s.bin   -F opn
+    run opna_$s.auto    opna_$s.bin
+    run opna_$s.opna    opna_$s.bin  -F opna
+    run opna_$s.mono    opna_$s.bin  -F mono
+    run opnar_$s.auto   opnar_$s.bin
+    run opnar_$s.opnar  opnar_$s.bin -F opnar
+    run va_$s.auto      va_$s.bin
+    run va_$s.va        va_$s.bin    -F va
+    run x1_$s.auto      x1_$s.bin
+    run x1_$s.x1opm     x1_$s.bin    -F x1opm
+    run x1_$s.x1psg     x1_$s.bin    -F x1psg
+done
+
+# channels converted in parallel, the same output
+for s in 1 2 3; do
+    run opnar_$s.auto   opnar_$s.bin -j 4
+    run x1_$s.auto      x1_$s.bin    -j 4
+    run x1_$s.x1psg     x1_$s.bin    -F x1psg -j 4
+done
+run opnar_2.opt opnar_2.bin -z -j 4
+
+# tags and workaround option
+run opna_1.tag opna_1.bin -w -m 1.7 -t TITLE -a AUTHOR -c COMPOSER -d 2019/01/01 -C COMMENT
+run x1_1.tag   x1_1.bin   -w -F x1psg -m 1.7 -t TITLE
+
+# identical voices
+run opna_dup.inst opna_dup.bin -i
+
+# size optimizer
+run opnar_2.opt opnar_2.bin -z
+run x1_2.opt    x1_2.bin    -z
+
+# conversion cache: a miss stores the output, a hit copies the entry
+mkdir "$out/cache"
+"$bin" --cache="$out/cache" "$dir/data/opnar_2.bin" > "$out/cache.miss.muc" 2> /dev/null
+same cache.miss "$out/cache.miss.muc" "$dir/golden/opnar_2.auto.muc"
+entry=$(ls "$out/cache"/*.muc 2> /dev/null | head -1)
+echo "; cached" > "$out/cache.entry"
+cp "$out/cache.entry" "${entry:-$out/cache/none}"
+"$bin" --cache="$out/cache" "$dir/data/opnar_2.bin" > "$out/cache.hit.muc" 2> /dev/null
+same cache.hit "$out/cache.hit.muc" "$out/cache.entry"
+"$bin" --cache="$out/cache" -z "$dir/data/opnar_2.bin" > "$out/cache.option.muc" 2> /dev/null
+same cache.option "$out/cache.option.muc" "$dir/golden/opnar_2.opt.muc"
+# a hit failing to write is an error, not converted again into the output
+if [ -w /dev/full ]; then
+    head -c 65536 /dev/zero | tr '\000' ';' > "${entry:-$out/cache/none}"
+    "$bin" --cache="$out/cache" "$dir/data/opnar_2.bin" > /dev/full 2> "$out/cache.full.err"
+    rc=$?
+    if [ $rc -eq 1 ] && [ "$(grep -c "Can't write" "$out/cache.full.err")" -eq 1 ]; then
+        pass=$((pass + 1))
+    else
+        echo "FAIL: cache.full (exit $rc)"
+        fail=$((fail + 1))
+    fi
+fi
+
+# songs in a D88 image (opna_1 at C01 and x1_2 at C02) are extracted as the files
+mkdir "$out/d88"
+"$bin" -D -O "$out/d88" "$dir/data/disk.d88" 2> /dev/null
+same d88.opna_1 "$out/d88/disk.d88.0.c01h0r01.muc" "$dir/golden/opna_1.auto.muc"
+same d88.x1_2   "$out/d88/disk.d88.0.c02h0r01.muc" "$dir/golden/x1_2.auto.muc"
+
+# programs written into a D88 image, nothing is written if one doesn't fit
+cp "$dir/data/disk.d88" "$out/disk.d88"
+"$txt2bas" -d "$out/disk.d88" "$dir/golden/opn_1.auto.muc" 2> /dev/null
+golden txt2bas.d88 "$out/disk.d88"
+cp "$dir/data/disk.d88" "$out/full.d88"
+"$txt2bas" -d "$out/full.d88" "$dir/golden/opn_1.auto.muc" "$dir/golden/x1_1.auto.muc" 2> /dev/null
+if [ $? -ne 1 ]; then
+    echo "FAIL: txt2bas.full (exit status)"
+    fail=$((fail + 1))
+else
+    same txt2bas.full "$out/full.d88" "$dir/data/disk.d88"
+fi
+
+# -B is the same as the MML through txt2bas
+for f in opna_1 opnar_2 x1_3; do
+    "$bin" -B "$dir/data/$f.bin" > "$out/$f.bas" 2> /dev/null
+    "$txt2bas" "$out/$f.ref.bas" < "$dir/golden/$f.auto.muc"
+    same $f.basic "$out/$f.bas" "$out/$f.ref.bas"
+done
+
+# length of the songs
+(cd "$dir/data" && "$bin" --timing *.bin) > "$out/timing.json" 2> /dev/null
+golden timing.json "$out/timing.json"
+
+# fingerprints and near-duplicates
+(cd "$dir/data" && "$bin" --fingerprint *.bin) > "$out/fingerprint.json" 2> /dev/null
+golden fingerprint.json "$out/fingerprint.json"
+
+# register log of the playback
+"$bin" --render=vgm -o "$out/opn_1.vgm" "$dir/data/opn_1.bin" 2> /dev/null
+golden opn_1.vgm "$out/opn_1.vgm"
+
+# truncated and garbage data, a broken header fails even with workaround
+head -c 1 "$dir/data/opna_1.bin" > "$out/byte.bin"
+head -c 100 "$dir/data/opna_1.bin" > "$out/header.bin"
+tail -c +8 "$dir/data/opna_1.bin" > "$out/garbage.bin"
+for b in byte header garbage; do
+    expect 1 $b.plain  "$out/$b.bin"
+    expect 1 $b.w      "$out/$b.bin" -w
+    expect 1 $b.opt    "$out/$b.bin" -w -z -i
+    expect 1 $b.basic  "$out/$b.bin" -w -B
+    expect 1 $b.thread "$out/$b.bin" -w -j 4
+done
+expect 1 offset.w "$dir/data/opna_1.bin" -w -s 2569
+
+# bad data is reported alone, without the hint of -w
+for e in byte.plain header.w garbage.plain; do
+    if grep -q "try -w" "$out/$e.err"; then
+        echo "FAIL: $e.hint"
+        fail=$((fail + 1))
+    else
+        pass=$((pass + 1))
+    fi
+done
+
+# PSG song of X1 data near the end of the view, the channel runs to the end
+head -c 65536 /dev/zero > "$out/psg.bin"
+printf '\000\377' | dd of="$out/psg.bin" bs=1 seek=26 conv=notrunc 2> /dev/null
+printf '\020\000\000\000\000\000\040\000\040\000\040\000' \
+    | dd of="$out/psg.bin" bs=1 seek=65280 conv=notrunc 2> /dev/null
+expect 1 psg.plain  "$out/psg.bin" -F x1psg -l 65535
+expect 1 psg.thread "$out/psg.bin" -F x1psg -l 65535 -j 4
+expect 0 psg.w      "$out/psg.bin" -F x1psg -l 65535 -w
+expect 1 psg.timing "$out/psg.bin" -F x1psg -l 65535 --timing
+expect 1 psg.fingerprint "$out/psg.bin" -F x1psg -l 65535 --fingerprint
+
+# a truncated channel is converted up to the end of the data with workaround
+head -c 1000 "$dir/data/opnar_1.bin" > "$out/channel.bin"
+expect 1 channel.plain  "$out/channel.bin" -F opnar
+expect 1 channel.thread "$out/channel.bin" -F opnar -j 4
+expect 0 channel.w      "$out/channel.bin" -F opnar -w
+expect 0 channel.opt    "$out/channel.bin" -F opnar -w -z -i
+
+if [ $update -eq 1 ]; then
+    echo "$pass golden file(s) updated, $fail failed"
+else
+    echo "$pass passed, $fail failed"
+fi
+
+[ $fail -eq 0 ]
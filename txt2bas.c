@@ -11,67 +11,427 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <unistd.h>
 
+#include "d88.h"
+#include "n88bas.h"
+
+/* N88-DISK BASIC file system of 2D disks */
+#define N88_SECTOR_SIZE (256)
+#define N88_CLUSTER_SECTORS (8)
+#define N88_CLUSTER_MAX (160)
+#define N88_DIR_C (18)
+#define N88_DIR_H (1)
+#define N88_DIR_SECTORS (12)
+#define N88_DIR_ENTRY_SIZE (16)
+#define N88_FAT_SECTOR (14)
+#define N88_FAT_COPIES (3)
+#define N88_FAT_FREE (0xff)
+#define N88_FAT_LAST (0xc0)		/* + number of sectors in the last cluster */
+#define N88_ATTR_BASIC (0x80)	/* tokenized BASIC program */
+
 char line[1024];
-uint8_t buff[0x10000];
 
 void help(void)
 {
     fprintf(stderr, "Usage: txt2bas file\n");
+    fprintf(stderr, "       txt2bas -d DISK text...\n");
+    fprintf(stderr, "  -d DISK\twrite programs into a D88 disk image (2D, N88-DISK BASIC)\n");
     exit(1);
 }
 
+static size_t file_write(void *opaque, const void *buf, size_t size)
+{
+    return fwrite(buf, 1, size, (FILE *)opaque);
+}
+
+/*
+ * convert text and write the program as each line is linked,
+ * returns the size (0: error, write errors are reported by the caller).
+ * memory doesn't depend on the size, a line longer than the buffer is split.
+ */
+uint32_t convert(FILE *fp, size_t (*write)(void *opaque, const void *buf, size_t size),
+                 void *opaque)
+{
+    N88BAS bas;
+    char *p;
+    uint32_t size;
+
+    n88bas_init(&bas, write, opaque);
+    while (fgets(line, sizeof(line), fp) != NULL && !bas.error)
+    {
+        p = strchr(line, '\n');
+        if(p) *p = '\0';
+        n88bas_line(&bas, line, strlen(line));
+    }
+    size = n88bas_end(&bas);
+    if (bas.overflow)
+    {
+        fprintf(stderr, "Program too large for N88-BASIC (%u bytes at line %u)\n",
+                (unsigned)bas.ptr, (unsigned)bas.lineno);
+    }
+    else if (size < 1 && !bas.error)
+    {
+        fprintf(stderr, "convert error\n");
+    }
+
+    return size;
+}
+
+typedef struct
+{
+    uint8_t *image;
+    D88 d88;
+    uint8_t fat[N88_CLUSTER_MAX];
+} DISK;
+
+/* data of a sector, NULL if it's not a 256 bytes sector */
+uint8_t *sector_data(DISK *disk, uint32_t c, uint32_t h, uint32_t r)
+{
+    const D88_SECTOR *s = d88_find_sector(&disk->d88, c, h, r);
+
+    if (s == NULL || s->size != N88_SECTOR_SIZE)
+    {
+        return NULL;
+    }
+
+    return &disk->image[s->offset];
+}
+
+uint8_t *cluster_sector(DISK *disk, uint32_t cluster, uint32_t i)
+{
+    uint32_t track = cluster / 2;
+
+    return sector_data(disk, track / 2, track % 2, (cluster % 2) * N88_CLUSTER_SECTORS + 1 + i);
+}
+
+uint8_t *dir_entry(DISK *disk, uint32_t i)
+{
+    uint8_t *p = sector_data(disk, N88_DIR_C, N88_DIR_H,
+                             1 + i / (N88_SECTOR_SIZE / N88_DIR_ENTRY_SIZE));
+
+    return (p != NULL) ? &p[(i % (N88_SECTOR_SIZE / N88_DIR_ENTRY_SIZE)) * N88_DIR_ENTRY_SIZE] : NULL;
+}
+
+/* file name in the directory: 6 bytes name and 3 bytes extension */
+void n88_name(uint8_t *name, const char *path)
+{
+    const char *p = strrchr(path, '/');
+    const char *ext;
+    size_t len;
+
+    p = (p != NULL) ? p + 1 : path;
+    ext = strchr(p, '.');
+    len = (ext != NULL) ? (size_t)(ext - p) : strlen(p);
+    memset(name, ' ', 9);
+    memcpy(name, p, (len < 6) ? len : 6);
+}
+
+/* free the clusters of a file */
+void free_chain(DISK *disk, uint32_t cluster)
+{
+    for (uint32_t n = 0; cluster < N88_CLUSTER_MAX && n < N88_CLUSTER_MAX; n++)
+    {
+        uint32_t next = disk->fat[cluster];
+
+        disk->fat[cluster] = N88_FAT_FREE;
+        cluster = next;
+    }
+}
+
+/* file being written, clusters are allocated as sectors are filled */
+typedef struct
+{
+    DISK *disk;
+    uint32_t first;
+    uint32_t cluster;			/* N88_CLUSTER_MAX: no cluster yet */
+    uint32_t sector;			/* sectors used in the cluster */
+    uint32_t pos;				/* bytes used in the sector */
+    uint8_t *p;					/* current sector */
+    bool full;
+} DISK_FILE;
+
+static bool next_sector(DISK_FILE *file)
+{
+    DISK *disk = file->disk;
+
+    if (file->cluster >= N88_CLUSTER_MAX || file->sector == N88_CLUSTER_SECTORS)
+    {
+        uint32_t cluster;
+
+        for (cluster = 0; cluster < N88_CLUSTER_MAX; cluster++)
+        {
+            if (disk->fat[cluster] == N88_FAT_FREE)
+            {
+                break;
+            }
+        }
+        if (cluster == N88_CLUSTER_MAX)
+        {
+            file->full = true;
+            return false;
+        }
+        if (file->cluster < N88_CLUSTER_MAX)
+        {
+            disk->fat[file->cluster] = cluster;
+        }
+        else
+        {
+            file->first = cluster;
+        }
+        file->cluster = cluster;
+        file->sector = 0;
+    }
+
+    file->p = cluster_sector(disk, file->cluster, file->sector);
+    if (file->p == NULL)
+    {
+        return false;
+    }
+    file->sector++;
+    file->pos = 0;
+    disk->fat[file->cluster] = N88_FAT_LAST + file->sector;
+
+    return true;
+}
+
+static size_t disk_write(void *opaque, const void *buf, size_t size)
+{
+    DISK_FILE *file = opaque;
+    const uint8_t *src = buf;
+    size_t done = 0;
+
+    while (done < size)
+    {
+        size_t n;
+
+        if ((file->p == NULL || file->pos == N88_SECTOR_SIZE) && !next_sector(file))
+        {
+            break;
+        }
+        n = N88_SECTOR_SIZE - file->pos;
+        if (n > size - done)
+        {
+            n = size - done;
+        }
+        memcpy(&file->p[file->pos], &src[done], n);
+        file->pos += n;
+        done += n;
+    }
+
+    return done;
+}
+
+/* convert text into a file, replacing the file of the same name */
+bool write_file(DISK *disk, const uint8_t *name, FILE *fp)
+{
+    uint8_t *entry = NULL;
+    uint8_t *p;
+    DISK_FILE file;
+    uint32_t i;
+
+    /* same name, or the first unused entry */
+    for (i = 0; i < N88_DIR_SECTORS * N88_SECTOR_SIZE / N88_DIR_ENTRY_SIZE; i++)
+    {
+        p = dir_entry(disk, i);
+        if (p == NULL)
+        {
+            return false;
+        }
+        if (p[0] != 0x00 && p[0] != 0xff && memcmp(p, name, 9) == 0)
+        {
+            free_chain(disk, p[10]);
+            entry = p;
+            break;
+        }
+        if (entry == NULL && (p[0] == 0x00 || p[0] == 0xff))
+        {
+            entry = p;
+        }
+        if (p[0] == 0xff)
+        {
+            /* never used after this */
+            break;
+        }
+    }
+    if (entry == NULL)
+    {
+        fprintf(stderr, "Directory full\n");
+        return false;
+    }
+
+    memset(&file, 0, sizeof(file));
+    file.disk = disk;
+    file.cluster = N88_CLUSTER_MAX;
+    if (convert(fp, disk_write, &file) == 0)
+    {
+        if (file.full)
+        {
+            fprintf(stderr, "Disk full\n");
+        }
+        return false;
+    }
+    memset(&file.p[file.pos], 0, N88_SECTOR_SIZE - file.pos);
+
+    memcpy(entry, name, 9);
+    entry[9] = N88_ATTR_BASIC;
+    entry[10] = file.first;
+    memset(&entry[11], 0xff, N88_DIR_ENTRY_SIZE - 11);
+
+    return true;
+}
+
+/* write programs into the first disk of a D88 image */
+int write_disk(const char *path, char *text[], int count)
+{
+    FILE *fp;
+    DISK disk;
+    long size;
+    uint8_t *fat;
+    uint8_t name[9];
+    int ret = 0;
+
+    fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Can't open '%s'\n", path);
+        return 1;
+    }
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    disk.image = malloc((size > 0) ? size : 1);
+    if (disk.image == NULL || size <= 0 || fread(disk.image, 1, size, fp) != (size_t)size)
+    {
+        fprintf(stderr, "Can't read '%s'\n", path);
+        return 1;
+    }
+    fclose(fp);
+
+    if (!d88_parse(&disk.d88, disk.image, size))
+    {
+        fprintf(stderr, "'%s' is not a D88 image\n", path);
+        return 1;
+    }
+    if (disk.d88.protect != 0)
+    {
+        fprintf(stderr, "'%s' is write protected\n", path);
+        return 1;
+    }
+    fat = sector_data(&disk, N88_DIR_C, N88_DIR_H, N88_FAT_SECTOR);
+    if (disk.d88.media != 0x00 || fat == NULL)
+    {
+        fprintf(stderr, "'%s' is not a 2D disk of N88-DISK BASIC\n", path);
+        return 1;
+    }
+    memcpy(disk.fat, fat, N88_CLUSTER_MAX);
+
+    for (int i = 0; i < count; i++)
+    {
+        bool ok;
+
+        fp = fopen(text[i], "r");
+        if (fp == NULL)
+        {
+            fprintf(stderr, "Can't open '%s'\n", text[i]);
+            ret = 1;
+            continue;
+        }
+        n88_name(name, text[i]);
+        ok = write_file(&disk, name, fp);
+        fclose(fp);
+        if (!ok)
+        {
+            fprintf(stderr, "Can't write '%s' into '%s'\n", text[i], path);
+            ret = 1;
+        }
+    }
+
+    /* nothing is written if any of the programs failed */
+    if (ret != 0)
+    {
+        d88_free(&disk.d88);
+        free(disk.image);
+        return ret;
+    }
+
+    /* all copies of FAT */
+    for (uint32_t i = 0; i < N88_FAT_COPIES; i++)
+    {
+        fat = sector_data(&disk, N88_DIR_C, N88_DIR_H, N88_FAT_SECTOR + i);
+        if (fat != NULL)
+        {
+            memcpy(fat, disk.fat, N88_CLUSTER_MAX);
+        }
+    }
+
+    fp = fopen(path, "r+b");
+    if (fp == NULL || fwrite(disk.image, 1, size, fp) != (size_t)size)
+    {
+        fprintf(stderr, "Can't write '%s'\n", path);
+        ret = 1;
+    }
+    if (fp != NULL)
+    {
+        fclose(fp);
+    }
+    d88_free(&disk.d88);
+    free(disk.image);
+
+    return ret;
+}
 
 int main(int _argc, char *_argv[])
 {
     FILE *fp;
-    char *p;
-    int len;
-    uint16_t lineno = 1000;
-    uint32_t ptr = 0;
-    uint32_t next;
+    uint32_t size;
+    int c;
+    const char *diskfile = NULL;
 
-    if (_argc != 2)
+    while ((c = getopt(_argc, _argv, "d:")) != -1)
     {
-        help();
+        switch (c)
+        {
+        case 'd':
+            diskfile = optarg;
+            break;
+        default:
+            help();
+            break;
+        }
     }
 
-    while (fgets(line, sizeof(line), stdin) != NULL)
+    if (diskfile != NULL)
     {
-        p = strchr(line, '\n');
-        if(p) *p = '\0';
-        p = strchr(line, '\r');
-        if(p) *p = '\0';
-        len = strlen(line) + 1;
-
-        next = ptr + len + 8;
-        buff[ptr++] = next;
-        buff[ptr++] = next >> 8;
-        buff[ptr++] = lineno;
-        buff[ptr++] = lineno >> 8;
-        buff[ptr++] = 0x3a;
-        buff[ptr++] = 0x8f;
-        buff[ptr++] = 0xe9;
-        memcpy(&buff[ptr], line, len);
-        ptr = next - 1;
-        lineno += 10;
-    }
-    if (ptr < 1)
+        if (optind >= _argc)
+        {
+            help();
+        }
+        return write_disk(diskfile, &_argv[optind], _argc - optind);
+    }
+
+    if (optind != _argc - 1)
     {
-        fprintf(stderr, "convert error\n");
-        exit(1);
+        help();
     }
 
-    fp = fopen(_argv[1], "wb");
+    fp = fopen(_argv[optind], "wb");
     if (fp == NULL)
     {
-        fprintf(stderr, "Can't open '%s'\n", _argv[1]);
+        fprintf(stderr, "Can't open '%s'\n", _argv[optind]);
+        exit(1);
+    }
+    size = convert(stdin, file_write, fp);
+    if (ferror(fp) || fclose(fp) != 0)
+    {
+        fprintf(stderr, "Can't write '%s'\n", _argv[optind]);
+        size = 0;
+    }
+    if (size == 0)
+    {
         exit(1);
     }
-    ptr -= 1;
-    fwrite(buff, sizeof(unsigned char), ptr, fp);
-    fclose(fp);
 
     return 0;
 }